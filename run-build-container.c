@@ -1,4 +1,5 @@
 #include <stdarg.h>
+#include <stdint.h>
 #include <unistd.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -7,22 +8,64 @@
 #include <sched.h>
 #include <sys/types.h>
 #include <sys/mount.h>
+#include <sys/fsuid.h>
+#include <sys/syscall.h>
 #include <wait.h>
 #include <pwd.h>
 #include <grp.h>
 #include <fcntl.h>
 #include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/xattr.h>
 #include <sys/ioctl.h>
+#include <sys/file.h>
+#include <sys/resource.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <sys/utsname.h>
 #include <linux/if.h>
 #include <linux/sockios.h>
 #include <linux/loop.h>
+#include <linux/fs.h>
+#include <linux/openat2.h>
+#include <linux/ioprio.h>
+#include <linux/mempolicy.h>
+#include <linux/nsfs.h>
+#include <linux/perf_event.h>
+#include <linux/sched.h>
 #include <getopt.h>
+#include <dirent.h>
+#include <limits.h>
+#include <time.h>
+#include <poll.h>
+#include <signal.h>
+#include <pthread.h>
+#include <malloc.h>
+#include <glob.h>
+#include <ftw.h>
+#include <sys/inotify.h>
+#include <sys/signalfd.h>
+#include <netinet/in.h>
+#include <sys/random.h>
 
 #ifndef BUILD_CONTAINER_PATH
 #define BUILD_CONTAINER_PATH "BUILD_CONTAINER_PATH"
 #endif
+#ifndef NETNS_POOL_PATH
+#define NETNS_POOL_PATH "/run/build-container/netns"
+#endif
+#ifndef REGISTRY_PATH
+#define REGISTRY_PATH "/run/build-container/mounts"
+#endif
+#ifndef STATUS_PATH
+#define STATUS_PATH "/run/build-container/running"
+#endif
+#ifndef JOBSERVER_PATH
+#define JOBSERVER_PATH "/run/build-container/jobserver"
+#endif
+#ifndef QUEUE_PATH
+#define QUEUE_PATH "/run/build-container/queue"
+#endif
 #ifndef CONTAINER_PATH
 #define CONTAINER_PATH "~/.config/build-container:/etc/build-container"
 #endif
@@ -33,6 +76,7 @@ static int verbose = 1;
 static int chrooted;
 static int pidns;
 static int netns, userns;
+static int map_root;
 static char default_overlay_opts[] = "index=off,xino=off,";
 static char default_union_opts[] = "xino=off,";
 static char v4_15_overlay_opts[] = "index=off,";
@@ -160,19 +204,30 @@ struct stk
 {
 	struct stk *next;
 	enum arg arg;
+	int fd;		/* O_PATH descriptor of the path, or -1 */
+	int err;	/* errno of the failed lookup */
 	char val[1];
 };
 
-static void push(struct stk **head, enum arg arg, const char *val)
+static void push(struct stk **head, enum arg arg, const char *val, int fd)
 {
 	struct stk *e = malloc(sizeof(struct stk) + strlen(val));
 
 	e->next = *head;
 	e->arg = arg;
+	e->fd = fd;
+	e->err = fd < 0 ? errno : 0;
 	strcpy(e->val, val);
 	*head = e;
 }
 
+static void drop(struct stk *e)
+{
+	if (e && e->fd >= 0)
+		close(e->fd);
+	free(e);
+}
+
 static struct stk *pop(struct stk **head)
 {
 	struct stk *e = *head;
@@ -253,6 +308,7 @@ struct dict_element
 };
 
 #define MS_EXTRA_LOOP (1lu << 0)
+#define MS_EXTRA_SHARED (1lu << 1)
 
 static const struct dict_element generic_mount_opts[] = {
 	{ "rec", MS_REC },
@@ -262,6 +318,7 @@ static const struct dict_element generic_mount_opts[] = {
 	{ "ro", MS_RDONLY },
 	{ "rw", 0 },
 	{ "loop", 0, MS_EXTRA_LOOP },
+	{ "shared", 0, MS_EXTRA_SHARED },
 	{ NULL }
 };
 
@@ -377,6 +434,11 @@ static void args_to_mount_data(char *args)
 	*o = '\0';
 }
 
+static int is_home_relative(const char *name)
+{
+	return name[0] == '~' && (name[1] == '/' || !name[1]);
+}
+
 static char *abspath_buf;
 static const char *abspath(const char *dir, const char *name)
 {
@@ -385,7 +447,7 @@ static const char *abspath(const char *dir, const char *name)
 
 	if (is_absolute(name))
 		return name;
-	if (name[0] == '~' && (name[1] == '/' || !name[1])) {
+	if (is_home_relative(name)) {
 		dir = privileges.home;
 		++name;
 		if (*name)
@@ -401,6 +463,184 @@ static const char *abspath(const char *dir, const char *name)
 	return abspath_buf;
 }
 
+struct fs_creds
+{
+	uid_t uid;
+	gid_t gid;
+};
+
+/* The invoking user: the SUDO_USER under sudo, like drop_privileges() */
+static uid_t user_uid(void)
+{
+	return privileges.has_uid ? privileges.uid : getuid();
+}
+
+static gid_t user_gid(void)
+{
+	return privileges.has_gid ? privileges.gid : getgid();
+}
+
+/* Switch the file system credentials of the thread to the invoking user */
+static void user_fs_creds(struct fs_creds *saved)
+{
+	saved->gid = setfsgid(user_gid());
+	saved->uid = setfsuid(user_uid());
+}
+
+static void restore_fs_creds(const struct fs_creds *saved)
+{
+	int err = errno;
+
+	setfsuid(saved->uid);
+	setfsgid(saved->gid);
+	errno = err;
+}
+
+static int resolve(int dirfd, const char *name, int flags)
+{
+	struct open_how how = {
+		.flags = O_PATH | O_CLOEXEC | flags,
+		.resolve = RESOLVE_NO_MAGICLINKS,
+	};
+	int fd = syscall(SYS_openat2, dirfd, name, &how, sizeof(how));
+
+	if (fd < 0 && ENOSYS == errno)
+		fd = openat(dirfd, name, how.flags);
+	return fd;
+}
+
+static int mkdir_p(int dirfd, const char *path, mode_t mode)
+{
+	char *dir, *s, *next;
+	int fd = resolve(dirfd, path, O_DIRECTORY);
+
+	if (fd >= 0 || ENOENT != errno)
+		return fd;
+	/* create the missing components, looking up each of them just once */
+	dir = strdup(path);
+	if (is_absolute(dir))
+		fd = resolve(AT_FDCWD, SLASH, O_DIRECTORY);
+	else
+		fd = resolve(dirfd, ".", O_DIRECTORY);
+	for (s = dir; fd >= 0 && *s; s = next) {
+		int nfd = -1, err;
+
+		next = s + strcspn(s, SLASH);
+		if (*next)
+			*next++ = '\0';
+		if (!*s)
+			continue;
+		if (mkdirat(fd, s, mode) == 0 || EEXIST == errno)
+			nfd = resolve(fd, s, O_DIRECTORY);
+		err = errno;
+		close(fd);
+		errno = err;
+		fd = nfd;
+	}
+	free(dir);
+	return fd;
+}
+
+/* Create a file, with all the missing directories of the path */
+static int mkfile_p(int dirfd, const char *path, mode_t mode)
+{
+	char *dir = strdup(path), *base = strrchr(dir, '/');
+	int fd, pfd;
+
+	if (base) {
+		*base++ = '\0';
+		pfd = mkdir_p(dirfd, base == dir + 1 ? SLASH : dir, 0755);
+	} else {
+		base = dir;
+		pfd = resolve(dirfd, ".", O_DIRECTORY);
+	}
+	fd = pfd < 0 ? -1 : openat(pfd, base, O_WRONLY | O_CREAT | O_CLOEXEC, mode);
+	if (fd >= 0) {
+		close(fd);
+		fd = resolve(pfd, base, 0);
+	}
+	if (pfd >= 0) {
+		int err = errno;
+		close(pfd);
+		errno = err;
+	}
+	free(dir);
+	return fd;
+}
+
+static int config_dirfd = AT_FDCWD;
+
+/*
+ * The paths of the configuration are looked up and created with the file
+ * system credentials of the invoking user, so that a SUID installation
+ * cannot be used to reach otherwise inaccessible places.
+ * The @create is 0, S_IFDIR or S_IFREG.
+ */
+static int lookup_config_path(const char *name, const char *path, mode_t create)
+{
+	struct fs_creds creds;
+	int fd, dirfd = config_dirfd;
+
+	if (check_config && !create) {
+		errno = 0;
+		return -1;
+	}
+	if (is_absolute(name) || is_home_relative(name)) {
+		dirfd = AT_FDCWD;
+		name = path;
+	}
+	user_fs_creds(&creds);
+	if (create == S_IFDIR)
+		fd = mkdir_p(dirfd, name, 0755);
+	else if (create == S_IFREG)
+		fd = mkfile_p(dirfd, name, 0644);
+	else
+		fd = resolve(dirfd, name, 0);
+	restore_fs_creds(&creds);
+	return fd;
+}
+
+/* Open an O_PATH descriptor for I/O, closing it */
+static int reopen(int fd, int flags)
+{
+	char proc[32];
+	int ret, err;
+
+	if (fd < 0)
+		return -1;
+	snprintf(proc, sizeof(proc), "/proc/self/fd/%d", fd);
+	ret = open(proc, flags | O_CLOEXEC);
+	err = errno;
+	close(fd);
+	errno = err;
+	return ret;
+}
+
+static void memo_from_path(const char *path, int fd);
+static void memo_upper(const struct stk *upper);
+
+enum { DROP_CACHE_NONE, DROP_CACHE_OUTPUTS, DROP_CACHE_CGROUP };
+static int drop_cache;
+static void drop_cache_output(const struct stk *dir);
+static void drop_cache_at(int dir, const char *name);
+static void watch_lowers(const struct stk *lower);
+
+static int push_config_path(struct stk **head, enum arg arg,
+			    const char *config_dir, const char *name, int create)
+{
+	const char *path = abspath(config_dir, name);
+	int fd = lookup_config_path(name, path, create ? S_IFDIR : 0);
+
+	if (fd < 0 && create) {
+		error("mkdir %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+	if (FROM == arg)
+		memo_from_path(path, fd);
+	push(head, arg, path, fd);
+	return 0;
+}
+
 static int do_mount_options(unsigned long *opts, unsigned long *extra, char *arg)
 {
 	arg = cleanup(arg);
@@ -423,9 +663,51 @@ static int do_mount_options(unsigned long *opts, unsigned long *extra, char *arg
 	return 0;
 }
 
-static int losetup(const char *src, char **bdev)
+/*
+ * The actions to run after the container has finished. If there are
+ * any, the program stays as the (privileged) parent of the container.
+ * The actions run in the reverse order of their registration.
+ */
+struct at_exit
+{
+	struct at_exit *next;
+	int (*fn)(void *ctx, int status);
+	void *ctx;
+};
+static struct at_exit *at_exit_head;
+
+static void push_at_exit(int (*fn)(void *, int), void *ctx)
+{
+	struct at_exit *e = malloc(sizeof(*e));
+
+	e->next = at_exit_head;
+	e->fn = fn;
+	e->ctx = ctx;
+	at_exit_head = e;
+}
+
+static int run_at_exit(int status)
+{
+	struct at_exit *e;
+
+	while ((e = at_exit_head)) {
+		at_exit_head = e->next;
+		if (e->fn(e->ctx, status) != 0 && status == 0)
+			status = 2;
+		free(e);
+	}
+	return status;
+}
+
+/*
+ * Attach the image to a free loop device, named in *@bdev, which is NULL
+ * unless attached. With @rdonly the image is opened read-only, and the
+ * device is too, so that nothing (like a journal replay) writes to it.
+ */
+static int loop_attach(const char *src, int srcfd, char **bdev, int rdonly)
 {
-	int fd, nr;
+	struct loop_config config = { .info.lo_flags = rdonly ? LO_FLAGS_READ_ONLY : 0 };
+	int fd, nr, mode = rdonly ? O_RDONLY : O_RDWR;
 
 	*bdev = NULL;
 	fd = open("/dev/loop-control", O_RDWR | O_CLOEXEC);
@@ -441,33 +723,49 @@ static int losetup(const char *src, char **bdev)
 		return -1;
 	*bdev = malloc(32);
 	sprintf(*bdev, "/dev/loop%d", nr);
-	fd = open(*bdev, O_RDWR | O_CLOEXEC);
+	fd = open(*bdev, mode | O_CLOEXEC);
 	if (fd < 0) {
 		error("%s: %s\n", *bdev, strerror(errno));
-		return -1;
+		goto failed;
 	}
-	nr = open(src, O_RDWR | O_CLOEXEC);
+	if (srcfd >= 0)
+		nr = reopen(dup(srcfd), mode);
+	else
+		nr = open(src, mode | O_CLOEXEC);
 	if (nr < 0) {
 		error("%s: %s\n", src, strerror(errno));
 		close(fd);
-		return -1;
+		goto failed;
 	}
-	if (ioctl(fd, LOOP_SET_FD, nr) < 0) {
+	config.fd = nr;
+	/* LOOP_SET_FD makes a device over a read-only file read-only too */
+	if (ioctl(fd, LOOP_CONFIGURE, &config) < 0 &&
+	    ((EINVAL != errno && ENOTTY != errno) || ioctl(fd, LOOP_SET_FD, nr) < 0)) {
 		error("%s: attach: %s\n", src, strerror(errno));
 		close(nr);
 		close(fd);
-		return -1;
+		goto failed;
 	}
 	close(nr);
 	close(fd);
 	return 0;
+failed:
+	free(*bdev);
+	*bdev = NULL;
+	return -1;
+}
+
+static int losetup(const char *src, int srcfd, char **bdev)
+{
+	return loop_attach(src, srcfd, bdev, 0);
 }
 
 static void locleanup(char **bdev)
 {
 	int fd;
 
-	fd = open(*bdev, O_RDWR | O_CLOEXEC);
+	/* read-only, which the read-only devices take as well */
+	fd = open(*bdev, O_RDONLY | O_CLOEXEC);
 	if (fd < 0) {
 		error("%s: %s\n", *bdev, strerror(errno));
 		return;
@@ -479,29 +777,41 @@ static void locleanup(char **bdev)
 	*bdev = NULL;
 }
 
-static int do_mount(const char *src_, char *tgt, const char *fstype,
-		    unsigned long flags, const void *data,
-		    char *args)
+static const char *mount_kind(unsigned long flags)
+{
+	return flags & MS_BIND ? "bind " :
+		flags & MS_MOVE ? "move " : "";
+}
+
+static void print_mount(const char *src, const char *tgt, const char *fstype,
+			unsigned long flags, unsigned long extra, const char *data)
+{
+	printf("# mount '%s' '%s' %s 0x%lx%s 0x%lx '%s'\n",
+	       src, tgt, fstype ? fstype : "(null)", flags,
+	       flags & MS_BIND ? " bind" :
+	       flags & MS_MOVE ? " move" : "",
+	       extra, data ? data : "(null)");
+}
+
+static unsigned mount_attr_flags(unsigned long opts)
+{
+	return (opts & MS_RDONLY ? MOUNT_ATTR_RDONLY : 0) |
+		(opts & MS_NOSUID ? MOUNT_ATTR_NOSUID : 0) |
+		(opts & MS_NODEV ? MOUNT_ATTR_NODEV : 0) |
+		(opts & MS_NOEXEC ? MOUNT_ATTR_NOEXEC : 0) |
+		(opts & MS_NOATIME ? MOUNT_ATTR_NOATIME : 0);
+}
+
+/* Mount(2) by path names, for the kernels without the new mount API */
+static int legacy_mount(const char *src_, int srcfd, const char *tgt,
+			const char *fstype, unsigned long flags,
+			const void *data, unsigned long opts, unsigned long extra)
 {
 	int ret = 0;
 	char *src;
-	unsigned long opts = 0;
-	unsigned long extra = 0;
 
-	// FIXME validate if the src and tgt are accessible by the target user
-	if (do_mount_options(&opts, &extra, args) != 0)
-		return -1;
-	if (check_config) {
-		printf("# mount '%s' '%s' %s 0x%lx%s 0x%lx '%s'\n",
-		       src_, tgt, fstype, flags | opts,
-		       flags & MS_BIND ? " bind" :
-		       flags & MS_MOVE ? " move" : "",
-		       extra,
-		       (const char *)data);
-		return 0;
-	}
 	if (extra & MS_EXTRA_LOOP) {
-		if (losetup(src_, &src) == -1) {
+		if (losetup(src_, srcfd, &src) == -1) {
 			if (src)
 				goto clean;
 			goto done;
@@ -509,18 +819,14 @@ static int do_mount(const char *src_, char *tgt, const char *fstype,
 	} else
 		src = strdup(src_);
 	if (mount(src, tgt, fstype, flags | (opts & MS_REC ? MS_REC : 0), data) != 0) {
-		error("%smount(%s, %s): %s\n",
-		      flags & MS_BIND ? "bind " :
-		      flags & MS_MOVE ? "move " : "",
+		error("%smount(%s, %s): %s\n", mount_kind(flags),
 		      src, tgt, strerror(errno));
 		ret = -1;
 		goto clean;
 	}
 	if (opts & ~(unsigned long)MS_REC) {
 		if (mount(src, tgt, fstype, MS_REMOUNT | flags | opts, data) != 0) {
-			error("%smount(%s, %s, 0x%lx): %s\n",
-			      flags & MS_BIND ? "bind " :
-			      flags & MS_MOVE ? "move " : "",
+			error("%smount(%s, %s, 0x%lx): %s\n", mount_kind(flags),
 			      src, tgt, opts, strerror(errno));
 			ret = -1;
 			goto clean;
@@ -534,410 +840,6385 @@ done:
 	return ret;
 }
 
-static int do_chroot(const char *root)
+/* Pass the comma-separated mount(2) data to a file system context */
+static int fs_configure(int fsfd, const char *data)
 {
-	chrooted = 1;
-	if (check_config) {
-		printf("# chroot '%s'\n", root);
-		return 0;
+	char *opts = strdup(data ? data : ""), *o, *next;
+	int ret = 0;
+
+	for (o = opts; ret == 0 && o; o = next) {
+		char *val;
+
+		next = strchr(o, ',');
+		if (next)
+			*next++ = '\0';
+		if (!*o)
+			continue;
+		val = strchr(o, '=');
+		if (val)
+			*val++ = '\0';
+		ret = fsconfig(fsfd, val ? FSCONFIG_SET_STRING : FSCONFIG_SET_FLAG,
+			       o, val, 0);
 	}
-	if (chroot(root) == 0)
-		return 0;
-	error("chroot(%s): %s\n", root, strerror(errno));
-	return -1;
+	free(opts);
+	return ret;
 }
 
-static FILE *open_config_file(const char *file, char **dir)
+/* Create a detached mount of a new file system instance */
+static int new_mount(const char *src, const char *fstype, const char *data,
+		     unsigned long opts, int (*setup)(int, const void *),
+		     const void *ctx)
 {
-	FILE *fp = fopen(file, "r");
+	int fsfd, mfd = -1, err;
 
-	if (fp) {
-		const char *e = strend(file);
+	fsfd = fsopen(fstype, FSOPEN_CLOEXEC);
+	if (fsfd < 0)
+		return -1;
+	if (fsconfig(fsfd, FSCONFIG_SET_STRING, "source", src, 0) == 0 &&
+	    (!(opts & MS_RDONLY) ||
+	     fsconfig(fsfd, FSCONFIG_SET_FLAG, "ro", NULL, 0) == 0) &&
+	    fs_configure(fsfd, data) == 0 &&
+	    (!setup || setup(fsfd, ctx) == 0) &&
+	    fsconfig(fsfd, FSCONFIG_CMD_CREATE, NULL, NULL, 0) == 0)
+		mfd = fsmount(fsfd, FSMOUNT_CLOEXEC, mount_attr_flags(opts));
+	err = errno;
+	close(fsfd);
+	errno = err;
+	return mfd;
+}
 
-		while (e > file)
-			if ('/' == *--e)
-				break;
-		if (e == file)
-			*dir = strdup("./");
-		else
-			*dir = strndup(file, e - file + 1);
-		if (verbose || check_config)
-			fprintf(check_config ? stdout : stderr, "# config file '%s'\n", file);
-	} else if (check_config) {
-		int err = errno;
-		printf("# config file '%s': %s\n", file, strerror(err));
-		errno = err;
-	}
-	return fp;
+/*
+ * Apply the mount attributes to the mount @fd and attach it on @tgtfd.
+ * The mount is a detached one, or an attached one to be moved.
+ */
+static int attach_mount(int fd, int tgtfd, unsigned long opts, int set_attrs)
+{
+	struct mount_attr attr = { .attr_set = mount_attr_flags(opts) };
+
+	if (set_attrs && attr.attr_set &&
+	    mount_setattr(fd, "", AT_EMPTY_PATH |
+			  (opts & MS_REC ? AT_RECURSIVE : 0),
+			  &attr, sizeof(attr)) != 0)
+		return -1;
+	return move_mount(fd, "", tgtfd, "",
+			  MOVE_MOUNT_F_EMPTY_PATH | MOVE_MOUNT_T_EMPTY_PATH);
 }
 
-static FILE *open_config(const char *config, char **config_dir)
+/*
+ * A registry of the read-only image and union mounts shared by the
+ * containers, so that the page cache and the dentries of an image are
+ * not duplicated per container. The mounts live in a helper mount
+ * namespace, with nothing but a tmpfs root, pinned on REGISTRY_PATH/ns.
+ * A container clones the registered mount (open_tree(2)) from there,
+ * making and registering it first if missing, and holds a shared lock on
+ * REGISTRY_PATH/<key>.users until it exits; the last one unmounts it.
+ * Only privileged launches without a user namespace can use it.
+ */
+static int host_root = -1, host_mntns = -1;	/* opened before unshare(2) */
+static int registry_dirfd = -1, registry_nsfd = -1;
+
+struct shared_ref
 {
-	static char dot[] = ".";
-	FILE *fp;
-	char *dirs;
-	char *p;
+	char *key;
+	int lock;	/* on <key>.users */
+};
 
-	if (strcmp(config, "-") == 0) {
-		*config_dir = strdup(PWD);
-		return stdin;
-	}
-	if (is_absolute(config))
-		return open_config_file(config, config_dir);
-	dirs = getenv(BUILD_CONTAINER_PATH);
-	if (dirs)
-		/* Necessary: protecting environment
-		   for subsequent users of the variable. */
-		dirs = strdup(dirs);
+static int send_fd(int sock, int fd)
+{
+	char buf[CMSG_SPACE(sizeof(fd))] = { 0 }, c = 0;
+	struct iovec iov = { &c, 1 };
+	struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1,
+			      .msg_control = buf, .msg_controllen = sizeof(buf) };
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(fd));
+	memcpy(CMSG_DATA(cmsg), &fd, sizeof(fd));
+	return sendmsg(sock, &msg, 0) < 0 ? -1 : 0;
+}
+
+static int recv_fd(int sock)
+{
+	char buf[CMSG_SPACE(sizeof(int))], c;
+	struct iovec iov = { &c, 1 };
+	struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1,
+			      .msg_control = buf, .msg_controllen = sizeof(buf) };
+	struct cmsghdr *cmsg;
+	int fd = -1;
+
+	if (recvmsg(sock, &msg, MSG_CMSG_CLOEXEC) < 0)
+		return -1;
+	cmsg = CMSG_FIRSTHDR(&msg);
+	if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+		memcpy(&fd, CMSG_DATA(cmsg), sizeof(fd));
 	else
-		dirs = strdup(CONTAINER_PATH);
-	if (!*dirs) {
-		free(dirs);
-		error("No defined path for configuration file %s\n", config);
-		errno = EINVAL;
-		return NULL;
-	}
-	char *end = dirs + strlen(dirs) + 1;
-	for (p = dirs; p < end;) {
-		char *file, *next;
-		size_t n = strcspn(p, ":");
-		next = p + n + 1;
-		if (!n) {
-			p = dot;
-			n = 1;
-		}
-		if (p[0] == '~' && (p[1] == '/' || p[1] == ':' || !p[1])) {
-			const char *home = privileges.home;
-			if (!home)
-				home = dot + 1;
-			file = malloc(strlen(home) + n + strlen(config) + 2);
-			strcpy(file, home);
-			memcpy(file + strlen(file), p + 1, n - 1);
-			file[strlen(file) + n - 1] = '\0';
-		} else {
-			file = malloc(n + strlen(config) + 2);
-			memcpy(file, p, n);
-			file[n] = '\0';
-		}
-		strcat(file, SLASH);
-		strcat(file, config);
-		fp = open_config_file(file, config_dir);
-		free(file);
-		if (fp)
-			break;
-		p = next;
-	}
-	free(dirs);
-	return fp;
+		errno = EPROTO;
+	return fd;
 }
 
-static int do_config_mount(struct stk **head, char *arg)
+/* Run @fn in a child process, returning its errno */
+static int run_in_child(int (*fn)(const void *), const void *ctx)
 {
-	int ret;
-	const char *from;
-	struct stk *b = pop(head);
-	struct stk *a = pop(head);
+	int status;
+	pid_t pid = fork();
 
-	if (a && b && b->arg != TO)
-		swap(a, b);
-	from = a ? a->val : "none";
-	if (b && b->arg == TO) {
-		const char *fstype = NULL;
-		arg = cleanup(arg);
-		fstype = arg;
-		if (at_id_terminator(fstype))
-			fstype = NULL;
-		else {
-			while (!at_id_terminator(arg))
-				++arg;
-			if (*arg)
-				*arg++ = '\0';
-		}
-		if (fstype)
-			ret = do_mount(from, b->val, fstype, 0, NULL, arg);
-		else {
-			error("'mount' expects a file system type\n");
-			ret = -1;
-		}
-	} else {
-		error("'mount' expects a 'to' and, optionally, a 'from'\n");
-		ret = -1;
+	if (pid < 0)
+		return errno;
+	if (!pid)
+		_exit(fn(ctx) ? (errno ? errno : EIO) : 0);
+	while (waitpid(pid, &status, 0) == -1)
+		if (EINTR != errno)
+			return errno;
+	return WIFEXITED(status) ? WEXITSTATUS(status) : EIO;
+}
+
+/* The registry is changed under an exclusive lock on REGISTRY_PATH/lock */
+static int registry_lock(void)
+{
+	int fd = openat(registry_dirfd, "lock", O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+
+	if (fd >= 0 && flock(fd, LOCK_EX) != 0) {
+		close(fd);
+		fd = -1;
 	}
-	free(a);
-	free(b);
-	return ret;
+	return fd;
 }
 
-static int do_config_bind(struct stk **head, char *arg)
+/* In a child: make the helper namespace and pin it on REGISTRY_PATH/ns */
+static int make_registry_ns(const void *ctx)
 {
-	int ret;
-	struct stk *b = pop(head);
-	struct stk *a = pop(head);
-	if (a && a->arg != FROM)
-		swap(a, b);
-	if (a && b && a->arg == FROM && b->arg == TO)
-		ret = do_mount(a->val, b->val, NULL, MS_BIND, NULL, arg);
+	char proc[32];
+	int fd, nsfd;
+
+	if (setns(host_mntns, CLONE_NEWNS) != 0)
+		return -1;
+	fd = openat(registry_dirfd, "ns", O_WRONLY | O_CREAT | O_CLOEXEC, 0600);
+	if (fd < 0 || close(fd) != 0 || unshare(CLONE_NEWNS) != 0)
+		return -1;
+	nsfd = open("/proc/self/ns/mnt", O_RDONLY | O_CLOEXEC);
+	if (nsfd < 0 ||
+	    mount(NULL, "/", NULL, MS_REC | MS_PRIVATE, NULL) != 0 ||
+	    mount("build-container", REGISTRY_PATH, "tmpfs", MS_NOSUID | MS_NODEV,
+		  "mode=0700") != 0 ||
+	    chdir(REGISTRY_PATH) != 0 ||
+	    syscall(SYS_pivot_root, ".", ".") != 0 ||
+	    umount2(".", MNT_DETACH) != 0 ||
+	    setns(host_mntns, CLONE_NEWNS) != 0)
+		return -1;
+	snprintf(proc, sizeof(proc), "/proc/self/fd/%d", nsfd);
+	return mount(proc, REGISTRY_PATH "/ns", NULL, MS_BIND, NULL);
+}
+
+static int open_registry_ns(void)
+{
+	int lock, err;
+
+	if (registry_nsfd >= 0)
+		return 0;
+	if (host_mntns < 0) {
+		errno = EPERM;
+		return -1;
+	}
+	if (registry_dirfd < 0 &&
+	    (registry_dirfd = mkdir_p(host_root, REGISTRY_PATH + 1, 0700)) < 0)
+		return -1;
+	lock = registry_lock();
+	if (lock < 0)
+		return -1;
+	registry_nsfd = openat(registry_dirfd, "ns", O_RDONLY | O_CLOEXEC);
+	if (registry_nsfd < 0 || ioctl(registry_nsfd, NS_GET_NSTYPE) != CLONE_NEWNS) {
+		if (registry_nsfd >= 0)
+			close(registry_nsfd);
+		registry_nsfd = -1;
+		if ((err = run_in_child(make_registry_ns, NULL)) == 0)
+			registry_nsfd = openat(registry_dirfd, "ns", O_RDONLY | O_CLOEXEC);
+		else
+			errno = err;
+	}
+	close(lock);
+	return registry_nsfd < 0 ? -1 : 0;
+}
+
+struct registry_op
+{
+	const char *key;
+	int fd;		/* the mount to register, or -1 */
+	int sock;
+};
+
+/* In a child: clone the registered mount, after registering @fd if given */
+static int clone_registered(const void *ctx)
+{
+	const struct registry_op *op = ctx;
+	char path[PATH_MAX];
+	struct stat root, st;
+	int fd;
+
+	snprintf(path, sizeof(path), "/%s", op->key);
+	if (setns(registry_nsfd, CLONE_NEWNS) != 0 || stat("/", &root) != 0)
+		return -1;
+	if (stat(path, &st) != 0 || st.st_dev == root.st_dev) {
+		if (op->fd < 0) {
+			errno = ENOENT;
+			return -1;
+		}
+		if ((mkdir(path, 0700) != 0 && EEXIST != errno) ||
+		    move_mount(op->fd, "", AT_FDCWD, path, MOVE_MOUNT_F_EMPTY_PATH) != 0)
+			return -1;
+	}
+	fd = open_tree(AT_FDCWD, path, OPEN_TREE_CLONE | OPEN_TREE_CLOEXEC);
+	return fd < 0 ? -1 : send_fd(op->sock, fd);
+}
+
+static int unregister(const void *ctx)
+{
+	const struct registry_op *op = ctx;
+	char path[PATH_MAX];
+
+	snprintf(path, sizeof(path), "/%s", op->key);
+	if (setns(registry_nsfd, CLONE_NEWNS) != 0 || umount2(path, MNT_DETACH) != 0)
+		return -1;
+	return rmdir(path);
+}
+
+static int registry_clone(const char *key, int mfd)
+{
+	struct registry_op op = { key, mfd, -1 };
+	int sv[2], fd = -1, err;
+
+	if (socketpair(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0, sv) != 0)
+		return -1;
+	op.sock = sv[1];
+	err = run_in_child(clone_registered, &op);
+	if (!err)
+		fd = recv_fd(sv[0]);
+	else
+		errno = err;
+	err = errno;
+	close(sv[0]);
+	close(sv[1]);
+	errno = err;
+	return fd;
+}
+
+static int release_shared_mount(void *ctx, int status)
+{
+	struct shared_ref *ref = ctx;
+	struct registry_op op = { ref->key, -1, -1 };
+	char name[80];
+	int err, lock = registry_lock();
+
+	/* the last user */
+	if (lock >= 0 && flock(ref->lock, LOCK_EX | LOCK_NB) == 0) {
+		if (verbose > 1)
+			fprintf(stderr, "%s: shared mount '%s': unregister\n",
+				build_container, ref->key);
+		if ((err = run_in_child(unregister, &op)) != 0)
+			error("shared mount %s: %s\n", ref->key, strerror(err));
+		snprintf(name, sizeof(name), "%s.users", ref->key);
+		unlinkat(registry_dirfd, name, 0);
+		snprintf(name, sizeof(name), "%s.id", ref->key);
+		unlinkat(registry_dirfd, name, 0);
+	}
+	if (lock >= 0)
+		close(lock);
+	close(ref->lock);
+	free(ref->key);
+	free(ref);
+	return 0;
+}
+
+/*
+ * The key is a hash, which the users can steer by the names, sizes and
+ * times of their files: the complete identity of the mount is kept in
+ * <key>.id, written when registering, and compared before handing out a
+ * clone.
+ */
+static int registry_set_id(const char *key, const char *id)
+{
+	char name[80];
+	int fd, ret;
+
+	snprintf(name, sizeof(name), "%s.id", key);
+	fd = openat(registry_dirfd, name,
+		    O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC, 0600);
+	if (fd < 0)
+		return -1;
+	ret = dprintf(fd, "%s", id) == strlen(id) ? 0 : -1;
+	if (close(fd) != 0)
+		ret = -1;
+	return ret;
+}
+
+static int registry_id_is(const char *key, const char *id)
+{
+	size_t len = strlen(id);
+	char name[80], *buf = malloc(len + 1);
+	int fd, same = 0;
+	ssize_t n, done = 0;
+
+	snprintf(name, sizeof(name), "%s.id", key);
+	fd = openat(registry_dirfd, name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+	if (fd >= 0) {
+		while (done <= len && (n = read(fd, buf + done, len + 1 - done)) > 0)
+			done += n;
+		same = done == len && !memcmp(buf, id, len);
+		close(fd);
+	}
+	free(buf);
+	return same;
+}
+
+/*
+ * A clone of the registered mount @key, made with @make(@ctx) and
+ * registered if missing. Without the registry, or when another mount
+ * has the same @key, just the new mount.
+ */
+static int shared_mount(const char *key, const char *id,
+			int (*make)(const void *), const void *ctx)
+{
+	struct shared_ref *ref;
+	char name[80];
+	int fd, mfd, lock, users;
+
+	if (open_registry_ns() != 0) {
+		if (verbose > 1)
+			error("shared mount %s: %s, not shared\n", key, strerror(errno));
+		return make(ctx);
+	}
+	lock = registry_lock();
+	if (lock < 0)
+		return -1;
+	fd = registry_clone(key, -1);
+	if (fd >= 0 && !registry_id_is(key, id)) {
+		close(fd);
+		close(lock);
+		if (verbose > 1)
+			error("shared mount %s: registered for another mount, not shared\n", key);
+		return make(ctx);
+	}
+	if (fd < 0 && ENOENT == errno && (mfd = make(ctx)) >= 0) {
+		if (verbose > 1)
+			fprintf(stderr, "%s: shared mount '%s': register\n",
+				build_container, key);
+		fd = registry_set_id(key, id) == 0 ? registry_clone(key, mfd) : -1;
+		close(mfd);
+	}
+	/* a user, until the container exits */
+	snprintf(name, sizeof(name), "%s.users", key);
+	users = fd < 0 ? -1 :
+		openat(registry_dirfd, name, O_RDONLY | O_CREAT | O_CLOEXEC, 0600);
+	if (users >= 0 && flock(users, LOCK_SH) != 0) {
+		close(users);
+		users = -1;
+	}
+	close(lock);
+	if (users < 0)
+		return fd;
+	ref = malloc(sizeof(*ref));
+	ref->key = strdup(key);
+	ref->lock = users;
+	push_at_exit(release_shared_mount, ref);
+	return fd;
+}
+
+struct fs_mount_args
+{
+	const char *src;
+	int srcfd;
+	const char *fstype;
+	const void *data;
+	unsigned long opts, extra;
+};
+
+/* A new detached mount, of a loop device over the file for "loop" */
+static int make_fs_mount(const void *ctx)
+{
+	const struct fs_mount_args *a = ctx;
+	char *bdev = NULL;
+	int fd = -1, err;
+
+	if (!(a->extra & MS_EXTRA_LOOP))
+		return new_mount(a->src, a->fstype, a->data, a->opts, NULL, NULL);
+	if (losetup(a->src, a->srcfd, &bdev) == 0)
+		fd = new_mount(bdev, a->fstype, a->data, a->opts, NULL, NULL);
+	err = errno;
+	if (bdev)
+		locleanup(&bdev);
+	errno = err;
+	return fd;
+}
+
+static uint64_t fnv1a(uint64_t h, const void *data, size_t n)
+{
+	const unsigned char *p = data;
+
+	while (n--)
+		h = (h ^ *p++) * 0x100000001b3ull;
+	return h;
+}
+
+/* Identify a shared mount by its source file, type, options and data */
+static void shared_key(const char *kind, uint64_t h, const char *fstype,
+		       const char *data, unsigned long opts, char *key, size_t size)
+{
+	h = fnv1a(h, fstype, strlen(fstype) + 1);
+	h = fnv1a(h, data ? data : "", data ? strlen(data) + 1 : 1);
+	h = fnv1a(h, &opts, sizeof(opts));
+	snprintf(key, size, "%s-%016llx", kind, (unsigned long long)h);
+}
+
+static uint64_t stat_hash(uint64_t h, const struct stat *st)
+{
+	h = fnv1a(h, &st->st_dev, sizeof(st->st_dev));
+	h = fnv1a(h, &st->st_ino, sizeof(st->st_ino));
+	h = fnv1a(h, &st->st_mtim, sizeof(st->st_mtim));
+	return fnv1a(h, &st->st_size, sizeof(st->st_size));
+}
+
+/* What the hash is made of, spelled out for the registry */
+static void stat_id(FILE *fp, const struct stat *st)
+{
+	fprintf(fp, "%llx:%llu %lld.%09ld %lld\n", (unsigned long long)st->st_dev,
+		(unsigned long long)st->st_ino, (long long)st->st_mtim.tv_sec,
+		st->st_mtim.tv_nsec, (long long)st->st_size);
+}
+
+/* The identity of a shared mount, for the stat_id() of its sources to follow */
+static FILE *shared_id(char **id, size_t *size, const char *kind, const char *fstype,
+		       const char *data, unsigned long opts)
+{
+	FILE *fp = open_memstream(id, size);
+
+	fprintf(fp, "%s %s %lx\n%s\n", kind, fstype, opts, data ? data : "");
+	return fp;
+}
+
+static int do_mount(const struct stk *src, const struct stk *tgt,
+		    const char *fstype, unsigned long flags, const void *data,
+		    char *args)
+{
+	const char *src_ = src ? src->val : "none";
+	unsigned long opts = 0;
+	unsigned long extra = 0;
+	int fd = -1, ret = 0;
+
+	if (do_mount_options(&opts, &extra, args) != 0)
+		return -1;
+	if (check_config) {
+		print_mount(src_, tgt->val, fstype, flags | opts, extra, data);
+		return 0;
+	}
+	if (tgt->fd < 0) {
+		error("%smount(%s, %s): %s\n", mount_kind(flags),
+		      src_, tgt->val, strerror(tgt->err));
+		return -1;
+	}
+	if ((flags & (MS_BIND | MS_MOVE) || extra & MS_EXTRA_LOOP) &&
+	    (!src || src->fd < 0)) {
+		error("%smount(%s, %s): %s\n", mount_kind(flags),
+		      src_, tgt->val, strerror(src ? src->err : EINVAL));
+		return -1;
+	}
+	if (extra & MS_EXTRA_SHARED &&
+	    (flags & (MS_BIND | MS_MOVE) || !(opts & MS_RDONLY))) {
+		error("mount(%s, %s): only the new read-only mounts can be shared\n",
+		      src_, tgt->val);
+		return -1;
+	}
+	if (flags & MS_BIND)
+		fd = open_tree(src->fd, "", OPEN_TREE_CLONE | OPEN_TREE_CLOEXEC |
+			       AT_EMPTY_PATH | (opts & MS_REC ? AT_RECURSIVE : 0));
+	else if (flags & MS_MOVE)
+		fd = src->fd;
 	else {
-		error("'bind' expects 'from' and 'to' paths\n");
+		struct fs_mount_args args = {
+			src_, src ? src->fd : -1, fstype, data, opts, extra
+		};
+		char key[64], *id;
+		struct stat st;
+		size_t size;
+		uint64_t h = 0xcbf29ce484222325ull;
+
+		if (!(extra & MS_EXTRA_SHARED))
+			fd = make_fs_mount(&args);
+		else {
+			FILE *fp = shared_id(&id, &size, "image", fstype, data, opts);
+
+			if (src && src->fd >= 0 && fstat(src->fd, &st) == 0) {
+				h = stat_hash(h, &st);
+				stat_id(fp, &st);
+			} else {
+				h = fnv1a(h, src_, strlen(src_));
+				fprintf(fp, "%s\n", src_);
+			}
+			fclose(fp);
+			shared_key("image", h, fstype, data, opts, key, sizeof(key));
+			fd = shared_mount(key, id, make_fs_mount, &args);
+			free(id);
+		}
+	}
+	if (fd < 0 && ENOSYS == errno)
+		return legacy_mount(src_, src ? src->fd : -1, tgt->val, fstype,
+				    flags, data, opts, extra);
+	if (fd < 0 || attach_mount(fd, tgt->fd, opts, flags & (MS_BIND | MS_MOVE)) != 0) {
+		error("%smount(%s, %s): %s\n", mount_kind(flags),
+		      src_, tgt->val, strerror(errno));
 		ret = -1;
 	}
-	free(a);
-	free(b);
+	if (fd >= 0 && !(flags & MS_MOVE))
+		close(fd);
+	return ret;
+}
+
+static int do_chroot(const char *root)
+{
+	chrooted = 1;
+	if (check_config) {
+		printf("# chroot '%s'\n", root);
+		return 0;
+	}
+	if (chroot(root) == 0)
+		return 0;
+	error("chroot(%s): %s\n", root, strerror(errno));
+	return -1;
+}
+
+static FILE *open_config_file(const char *file, char **dir)
+{
+	FILE *fp = fopen(file, "r");
+
+	if (fp) {
+		const char *e = strend(file);
+
+		while (e > file)
+			if ('/' == *--e)
+				break;
+		if (e == file)
+			*dir = strdup("./");
+		else
+			*dir = strndup(file, e - file + 1);
+		if (verbose || check_config)
+			fprintf(check_config ? stdout : stderr, "# config file '%s'\n", file);
+	} else if (check_config) {
+		int err = errno;
+		printf("# config file '%s': %s\n", file, strerror(err));
+		errno = err;
+	}
+	return fp;
+}
+
+static FILE *open_config(const char *config, char **config_dir)
+{
+	static char dot[] = ".";
+	FILE *fp;
+	char *dirs;
+	char *p;
+
+	if (strcmp(config, "-") == 0) {
+		*config_dir = strdup(PWD);
+		return stdin;
+	}
+	if (is_absolute(config))
+		return open_config_file(config, config_dir);
+	dirs = getenv(BUILD_CONTAINER_PATH);
+	if (dirs)
+		/* Necessary: protecting environment
+		   for subsequent users of the variable. */
+		dirs = strdup(dirs);
+	else
+		dirs = strdup(CONTAINER_PATH);
+	if (!*dirs) {
+		free(dirs);
+		error("No defined path for configuration file %s\n", config);
+		errno = EINVAL;
+		return NULL;
+	}
+	char *end = dirs + strlen(dirs) + 1;
+	for (p = dirs; p < end;) {
+		char *file, *next;
+		size_t n = strcspn(p, ":");
+		next = p + n + 1;
+		if (!n) {
+			p = dot;
+			n = 1;
+		}
+		if (p[0] == '~' && (p[1] == '/' || p[1] == ':' || !p[1])) {
+			const char *home = privileges.home;
+			if (!home)
+				home = dot + 1;
+			file = malloc(strlen(home) + n + strlen(config) + 2);
+			strcpy(file, home);
+			memcpy(file + strlen(file), p + 1, n - 1);
+			file[strlen(file) + n - 1] = '\0';
+		} else {
+			file = malloc(n + strlen(config) + 2);
+			memcpy(file, p, n);
+			file[n] = '\0';
+		}
+		strcat(file, SLASH);
+		strcat(file, config);
+		fp = open_config_file(file, config_dir);
+		free(file);
+		if (fp)
+			break;
+		p = next;
+	}
+	free(dirs);
+	return fp;
+}
+
+static int is_dot_or_dotdot(const char *name)
+{
+	return name[0] == '.' && (!name[1] || (name[1] == '.' && !name[2]));
+}
+
+/* Remove a file or a directory tree, if it exists */
+static int remove_tree(int dirfd, const char *name)
+{
+	struct dirent *de;
+	int fd, ret = 0;
+	DIR *dir;
+
+	if (unlinkat(dirfd, name, 0) == 0 || ENOENT == errno)
+		return 0;
+	if (EISDIR != errno && EPERM != errno)
+		return -1;
+	fd = openat(dirfd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+	if (fd < 0 || !(dir = fdopendir(fd))) {
+		if (fd >= 0)
+			close(fd);
+		return -1;
+	}
+	while ((de = readdir(dir)))
+		if (!is_dot_or_dotdot(de->d_name) && remove_tree(fd, de->d_name) != 0)
+			ret = -1;
+	closedir(dir);
+	if (unlinkat(dirfd, name, AT_REMOVEDIR) != 0 && ENOENT != errno)
+		ret = -1;
 	return ret;
 }
 
-static int do_config_move(struct stk **head, char *arg)
+static int get_ovl_xattr(int fd, const char *name, char *val, size_t size)
+{
+	char key[64];
+	ssize_t n;
+
+	snprintf(key, sizeof(key), "trusted.overlay.%s", name);
+	n = fgetxattr(fd, key, val, size);
+	if (n < 0) {
+		snprintf(key, sizeof(key), "user.overlay.%s", name);
+		n = fgetxattr(fd, key, val, size);
+	}
+	return n;
+}
+
+static int is_whiteout(int dirfd, const char *name, const struct stat *st)
+{
+	char c;
+	int fd, ret;
+
+	if (S_ISCHR(st->st_mode))
+		return st->st_rdev == makedev(0, 0);
+	if (!S_ISREG(st->st_mode) || st->st_size)
+		return 0;
+	/* whiteouts made by overlays mounted with userxattr */
+	fd = openat(dirfd, name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+	if (fd < 0)
+		return 0;
+	ret = get_ovl_xattr(fd, "whiteout", &c, 1) >= 0;
+	close(fd);
+	return ret;
+}
+
+/*
+ * Copy the data of a file: share the extents if the file system can
+ * (FICLONE), or let the kernel copy with copy_file_range(2).
+ * Returns 1 if the extents were shared.
+ */
+static int copy_data(int sfd, int dfd, off_t size)
+{
+	char buf[BUFSIZ * 8];
+	ssize_t n;
+
+	if (ioctl(dfd, FICLONE, sfd) == 0)
+		return 1;
+	while (size > 0) {
+		n = copy_file_range(sfd, NULL, dfd, NULL, size, 0);
+		if (n < 0 && (EXDEV == errno || ENOSYS == errno ||
+			      EINVAL == errno || EOPNOTSUPP == errno))
+			break;
+		if (n < 0)
+			return -1;
+		if (n == 0)
+			return 0;
+		size -= n;
+	}
+	/* no in-kernel copy between these files */
+	while ((n = read(sfd, buf, sizeof(buf))) != 0) {
+		char *p = buf;
+		if (n < 0) {
+			if (EINTR == errno)
+				continue;
+			return -1;
+		}
+		while (n > 0) {
+			ssize_t w = write(dfd, p, n);
+			if (w < 0)
+				return -1;
+			p += w;
+			n -= w;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Replace the file @name in @tdir by a copy of the one in @sdir.
+ * Returns -errno on failure, or the result of copy_data().
+ */
+static int copy_file(int sdir, int tdir, const char *name)
+{
+	struct timespec times[2];
+	struct stat st;
+	int sfd, dfd = -1, shared, ret = -1;
+
+	sfd = openat(sdir, name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+	if (sfd < 0 || fstat(sfd, &st) != 0)
+		goto done;
+	if (remove_tree(tdir, name) != 0)
+		goto done;
+	dfd = openat(tdir, name, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC,
+		     st.st_mode & 07777);
+	if (dfd < 0 || (shared = copy_data(sfd, dfd, st.st_size)) < 0)
+		goto done;
+	times[0] = st.st_atim;
+	times[1] = st.st_mtim;
+	if (fchmod(dfd, st.st_mode & 07777) == 0 && futimens(dfd, times) == 0)
+		ret = shared;
+done:
+	if (ret < 0)
+		ret = -errno;
+	if (dfd >= 0)
+		close(dfd);
+	if (sfd >= 0)
+		close(sfd);
+	return ret;
+}
+
+/* A list of relative paths to process on a pool of workers */
+struct file_list
+{
+	char **v;
+	int n, nalloc;
+	int next;
+	int failed;
+};
+
+static void file_list_add(struct file_list *l, const char *path)
+{
+	if (l->n == l->nalloc)
+		l->v = realloc(l->v, sizeof(*l->v) * (l->nalloc = l->nalloc ? 2 * l->nalloc : 256));
+	l->v[l->n++] = strdup(path);
+}
+
+static const char *file_list_next(struct file_list *l)
+{
+	int i = __atomic_fetch_add(&l->next, 1, __ATOMIC_RELAXED);
+
+	return i < l->n ? l->v[i] : NULL;
+}
+
+static void file_list_free(struct file_list *l)
+{
+	while (l->n > 0)
+		free(l->v[--l->n]);
+	free(l->v);
+	l->v = NULL;
+	l->nalloc = 0;
+}
+
+static int do_config_mount(struct stk **head, char *arg)
+{
+	int ret;
+	struct stk *b = pop(head);
+	struct stk *a = pop(head);
+
+	if (a && b && b->arg != TO)
+		swap(a, b);
+	if (b && b->arg == TO) {
+		const char *fstype = NULL;
+		arg = cleanup(arg);
+		fstype = arg;
+		if (at_id_terminator(fstype))
+			fstype = NULL;
+		else {
+			while (!at_id_terminator(arg))
+				++arg;
+			if (*arg)
+				*arg++ = '\0';
+		}
+		if (fstype)
+			ret = do_mount(a, b, fstype, 0, NULL, arg);
+		else {
+			error("'mount' expects a file system type\n");
+			ret = -1;
+		}
+	} else {
+		error("'mount' expects a 'to' and, optionally, a 'from'\n");
+		ret = -1;
+	}
+	drop(a);
+	drop(b);
+	return ret;
+}
+
+static int do_config_bind(struct stk **head, char *arg)
+{
+	int ret;
+	struct stk *b = pop(head);
+	struct stk *a = pop(head);
+	if (a && a->arg != FROM)
+		swap(a, b);
+	if (a && b && a->arg == FROM && b->arg == TO)
+		ret = do_mount(a, b, NULL, MS_BIND, NULL, arg);
+	else {
+		error("'bind' expects 'from' and 'to' paths\n");
+		ret = -1;
+	}
+	drop(a);
+	drop(b);
+	return ret;
+}
+
+static int do_config_move(struct stk **head, char *arg)
+{
+	int ret;
+	struct stk *b = pop(head);
+	struct stk *a = pop(head);
+	if (a && a->arg != FROM)
+		swap(a, b);
+	if (a && b && a->arg == FROM && b->arg == TO)
+		ret = do_mount(a, b, NULL, MS_MOVE, NULL, arg);
+	else {
+		error("'move' expects 'from' and 'to' paths\n");
+		ret = -1;
+	}
+	drop(a);
+	drop(b);
+	return ret;
+}
+
+struct overlay_layers
+{
+	const struct stk *lower, *upper, *work;
+};
+
+static int set_layer_fd(int fsfd, const char *key, const struct stk *e)
+{
+	int fd, ret;
+
+	if (e->fd < 0) {
+		errno = e->err;
+		return -1;
+	}
+	/* fsconfig(2) does not accept O_PATH descriptors */
+	fd = openat(e->fd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+	ret = fsconfig(fsfd, FSCONFIG_SET_FD, key, NULL, fd);
+	close(fd);
+	return ret;
+}
+
+static int set_overlay_layers(int fsfd, const void *ctx)
+{
+	const struct overlay_layers *l = ctx;
+	const struct stk *e;
+
+	if (l->upper && (set_layer_fd(fsfd, "upperdir", l->upper) != 0 ||
+			 set_layer_fd(fsfd, "workdir", l->work) != 0))
+		return -1;
+	for (e = l->lower; e; e = e->next)
+		if (set_layer_fd(fsfd, "lowerdir+", e) != 0)
+			return -1;
+	return 0;
+}
+
+static int count_stk(const struct stk *e)
+{
+	int n = 0;
+
+	for (; e; e = e->next)
+		++n;
+	return n;
+}
+
+/*
+ * Identify the layers of a union by the inodes and modification times of
+ * their top directories only: a change deeper in a layer goes unnoticed,
+ * the layers are meant to be replaced (or touched) as a whole.
+ */
+static int flatten_key(const struct stk *lower, char *key, size_t size)
+{
+	uint64_t h = 0xcbf29ce484222325ull;
+	const struct stk *e;
+	struct stat st;
+
+	for (e = lower; e; e = e->next) {
+		if (e->fd < 0) {
+			errno = e->err;
+			return -1;
+		}
+		if (fstat(e->fd, &st) != 0)
+			return -1;
+		h = fnv1a(h, &st.st_dev, sizeof(st.st_dev));
+		h = fnv1a(h, &st.st_ino, sizeof(st.st_ino));
+		h = fnv1a(h, &st.st_mtim, sizeof(st.st_mtim));
+	}
+	snprintf(key, size, "%016llx", (unsigned long long)h);
+	return 0;
+}
+
+struct overlay_mount
+{
+	const char *name, *ovl_opts, *data;
+	unsigned long opts;
+	const struct overlay_layers *layers;
+};
+
+static int make_overlay_mount(const void *ctx)
+{
+	const struct overlay_mount *m = ctx;
+	int fd = new_mount(m->name, "overlay", m->ovl_opts, m->opts,
+			   set_overlay_layers, m->layers);
+
+	if (fd < 0 && EINVAL == errno)
+		/* no lowerdir+ before Linux 6.8, no upperdir by descriptor before 6.13 */
+		fd = new_mount(m->name, "overlay", m->data, m->opts, NULL, NULL);
+	return fd;
+}
+
+/*
+ * Mount an overlay of the @lower paths (the top one first), with the
+ * optional @upper and @work, on @tgt.
+ * The layers are passed to the kernel by the descriptors if it supports
+ * that, otherwise by the names in the mount data.
+ */
+static int do_overlay_mount(const char *name, const struct stk *tgt,
+			    const char *ovl_opts, const struct stk *lower,
+			    const struct stk *upper, const struct stk *work,
+			    char *args)
+{
+	struct overlay_layers layers = { lower, upper, work };
+	struct overlay_mount m = { name, ovl_opts, NULL, 0, &layers };
+	unsigned long opts = 0, extra = 0;
+	const struct stk *e;
+	size_t size = strlen(ovl_opts) + sizeof(",lowerdir=,upperdir=,workdir=");
+	char *data;
+	int fd, ret = 0;
+
+	if (do_mount_options(&opts, &extra, args) != 0)
+		return -1;
+	for (e = lower; e; e = e->next)
+		size += strlen(e->val) + 1;
+	if (upper)
+		size += strlen(upper->val) + strlen(work->val);
+	data = malloc(size);
+	strcpy(data, ovl_opts);
+	if (*data && *strlast(data) != ',')
+		strcat(data, ",");
+	if (upper) {
+		strcat(data, "upperdir=");
+		strcat(data, upper->val);
+		strcat(data, ",");
+	}
+	strcat(data, "lowerdir=");
+	for (e = lower; e; e = e->next) {
+		strcat(data, e->val);
+		if (e->next)
+			strcat(data, ":");
+	}
+	if (upper) {
+		strcat(data, ",workdir=");
+		strcat(data, work->val);
+	}
+	if (check_config) {
+		print_mount(name, tgt->val, "overlay", opts, extra, data);
+		goto done;
+	}
+	m.data = data;
+	m.opts = opts;
+	if (extra & MS_EXTRA_SHARED && upper) {
+		error("mount(%s, %s): only the read-only unions can be shared\n",
+		      name, tgt->val);
+		ret = -1;
+		goto done;
+	}
+	if (tgt->fd < 0) {
+		errno = tgt->err;
+		fd = -1;
+	} else if (extra & MS_EXTRA_SHARED) {
+		char key[64], *id;
+		size_t size;
+		struct stat st;
+
+		fd = -1;
+		if (flatten_key(lower, key, sizeof(key)) == 0) {
+			FILE *fp = shared_id(&id, &size, "union", "overlay", ovl_opts, opts);
+
+			/* the layers are all open, flatten_key() made sure */
+			for (e = lower; e; e = e->next)
+				if (fstat(e->fd, &st) == 0)
+					stat_id(fp, &st);
+			fclose(fp);
+			shared_key("union", fnv1a(0xcbf29ce484222325ull, key, strlen(key)),
+				   "overlay", ovl_opts, opts, key, sizeof(key));
+			fd = shared_mount(key, id, make_overlay_mount, &m);
+			free(id);
+		}
+	} else
+		fd = make_overlay_mount(&m);
+	if (fd < 0 && ENOSYS == errno) {
+		ret = legacy_mount(name, -1, tgt->val, "overlay", 0,
+				   data, opts, extra);
+		if (ret == 0)
+			watch_lowers(lower);
+		if (ret == 0 && upper) {
+			memo_upper(upper);
+			drop_cache_output(upper);
+		}
+		goto done;
+	}
+	if (fd < 0 || attach_mount(fd, tgt->fd, opts, 0) != 0) {
+		error("mount(%s, %s): %s\n", name, tgt->val, strerror(errno));
+		ret = -1;
+	} else {
+		watch_lowers(lower);
+		if (upper) {
+			memo_upper(upper);
+			drop_cache_output(upper);
+		}
+	}
+	if (fd >= 0)
+		close(fd);
+done:
+	free(data);
+	return ret;
+}
+
+/* Remove the "<key>=<value>" word from the space separated @opts */
+static char *take_option(char *opts, const char *key)
+{
+	size_t n = strlen(key);
+	char *p = opts;
+
+	while (*p) {
+		char *w = p + strspn(p, spaces_lf), *e;
+		if (!*w)
+			break;
+		e = w + strcspn(w, spaces_lf);
+		if (strncmp(w, key, n) == 0 && w[n] == '=') {
+			char *val = strndup(w + n + 1, e - w - n - 1);
+			memmove(w, e, strlen(e) + 1);
+			return val;
+		}
+		p = e;
+	}
+	return NULL;
+}
+
+/* Hardlink a file into the merged tree, or copy it if that fails */
+static int flatten_file(int ldir, int tdir, const char *name, const struct stat *st)
+{
+	char buf[PATH_MAX];
+	ssize_t n;
+
+	if (linkat(ldir, name, tdir, name, 0) == 0)
+		return 0;
+	if (EXDEV != errno && EPERM != errno && EMLINK != errno)
+		return -1;
+	if (S_ISREG(st->st_mode))
+		return copy_file(ldir, tdir, name) < 0 ? -1 : 0;
+	if (S_ISLNK(st->st_mode)) {
+		n = readlinkat(ldir, name, buf, sizeof(buf) - 1);
+		if (n < 0)
+			return -1;
+		buf[n] = '\0';
+		return symlinkat(buf, tdir, name);
+	}
+	return mknodat(tdir, name, st->st_mode, st->st_rdev);
+}
+
+/*
+ * Merge the directories @layers (the top one first) into @tdir with the
+ * overlay rules: the upper names hide the lower ones, whiteouts hide the
+ * names below, the directories merge down to the first opaque one.
+ */
+static int flatten_dir(int tdir, const int *layers, int n)
+{
+	char **masked = NULL;
+	int i, nmasked = 0, ret = 0;
+
+	for (i = 0; ret == 0 && i < n; ++i) {
+		int fd = openat(layers[i], ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		struct dirent *de;
+		DIR *dir;
+
+		if (fd < 0 || !(dir = fdopendir(fd))) {
+			if (fd >= 0)
+				close(fd);
+			return -1;
+		}
+		while (ret == 0 && (de = readdir(dir))) {
+			const char *name = de->d_name;
+			struct stat st;
+			int k;
+
+			if (is_dot_or_dotdot(name) ||
+			    fstatat(tdir, name, &st, AT_SYMLINK_NOFOLLOW) == 0)
+				continue;
+			for (k = 0; k < nmasked && strcmp(masked[k], name); ++k)
+				;
+			if (k < nmasked)
+				continue;
+			if (fstatat(layers[i], name, &st, AT_SYMLINK_NOFOLLOW) != 0)
+				ret = -1;
+			else if (is_whiteout(layers[i], name, &st)) {
+				masked = realloc(masked, sizeof(*masked) * (nmasked + 1));
+				masked[nmasked++] = strdup(name);
+			} else if (S_ISDIR(st.st_mode)) {
+				int sub[n], m = 0, j, tsub = -1;
+
+				/* the same directory in the layers below */
+				for (j = i; j < n; ++j) {
+					struct stat lst;
+					char opaque = 0;
+
+					if (fstatat(layers[j], name, &lst, AT_SYMLINK_NOFOLLOW) != 0)
+						continue;
+					if (!S_ISDIR(lst.st_mode))
+						break;
+					sub[m] = openat(layers[j], name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+					if (sub[m] < 0) {
+						ret = -1;
+						break;
+					}
+					get_ovl_xattr(sub[m++], "opaque", &opaque, 1);
+					if (opaque == 'y')
+						break;
+				}
+				/* writable until filled, without DAC override too */
+				if (ret == 0 && (mkdirat(tdir, name, 0700) != 0 ||
+						 (tsub = openat(tdir, name, O_PATH | O_DIRECTORY | O_CLOEXEC)) < 0))
+					ret = -1;
+				if (ret == 0)
+					ret = flatten_dir(tsub, sub, m);
+				if (ret == 0 && fchmodat(tdir, name, st.st_mode & 07777, 0) != 0)
+					ret = -1;
+				if (tsub >= 0)
+					close(tsub);
+				while (m > 0)
+					close(sub[--m]);
+			} else
+				ret = flatten_file(layers[i], tdir, name, &st);
+			if (ret == 0 && !user_uid())
+				fchownat(tdir, name, st.st_uid, st.st_gid, AT_SYMLINK_NOFOLLOW);
+			if (ret)
+				error("flatten: %s: %s\n", name, strerror(errno));
+		}
+		closedir(dir);
+	}
+	while (nmasked > 0)
+		free(masked[--nmasked]);
+	free(masked);
+	return ret;
+}
+
+/* A new directory <prefix>.<random> (like mkdtemp(3)), its name in @name */
+static int mkdirat_temp(int dirfd, const char *prefix, char *name, size_t size)
+{
+	uint32_t r;
+	int i;
+
+	for (i = 0; i < 100; ++i) {
+		if (getrandom(&r, sizeof(r), 0) != sizeof(r))
+			return -1;
+		snprintf(name, size, "%s.%08x", prefix, r);
+		if (mkdirat(dirfd, name, 0755) == 0)
+			return 0;
+		if (EEXIST != errno)
+			return -1;
+	}
+	return -1;
+}
+
+/*
+ * Instead of a union of @lower on @tgt, bind a read-only merged copy of
+ * the layers (a hardlink farm) from the @cache directory. The copy is made
+ * once for each set of the layer inodes and modification times.
+ */
+static int do_flatten_union(const char *config_dir, const char *cache,
+			    const struct stk *lower, const struct stk *tgt,
+			    char *mnt_opts)
+{
+	const char *path = abspath(config_dir, cache);
+	struct stk *merged = NULL;
+	char key[32], tmp[64], *args, *full;
+	int cachefd, fd, n = 0, ret = -1;
+	const struct stk *e;
+	struct fs_creds creds;
+
+	args = malloc(strlen(mnt_opts) + sizeof(" ro"));
+	sprintf(args, "%s ro", mnt_opts);
+	if (check_config) {
+		printf("# flatten '%s'\n", path);
+		push(&merged, FROM, path, -1);
+		ret = do_mount(merged, tgt, NULL, MS_BIND, NULL, args);
+		goto done;
+	}
+	cachefd = lookup_config_path(cache, path, S_IFDIR);
+	if (cachefd < 0 || flatten_key(lower, key, sizeof(key)) != 0) {
+		error("flatten: %s: %s\n", path, strerror(errno));
+		if (cachefd >= 0)
+			close(cachefd);
+		goto done;
+	}
+	user_fs_creds(&creds);
+	fd = resolve(cachefd, key, O_DIRECTORY);
+	if (fd < 0 && ENOENT == errno) {
+		int layers[count_stk(lower)], tdir;
+
+		if (verbose > 1)
+			fprintf(stderr, "%s: flatten '%s/%s'\n", build_container, path, key);
+		for (e = lower; e; e = e->next)
+			layers[n++] = e->fd;
+		if (mkdirat_temp(cachefd, key, tmp, sizeof(tmp)) != 0 ||
+		    (tdir = resolve(cachefd, tmp, O_DIRECTORY)) < 0) {
+			error("flatten: %s/%s: %s\n", path, tmp, strerror(errno));
+			fd = -2;
+		} else {
+			ret = flatten_dir(tdir, layers, n);
+			close(tdir);
+			/* the first complete copy wins */
+			if (ret == 0 && renameat(cachefd, tmp, cachefd, key) != 0 &&
+			    EEXIST != errno && ENOTEMPTY != errno)
+				ret = -1;
+			remove_tree(cachefd, tmp);
+			fd = ret == 0 ? resolve(cachefd, key, O_DIRECTORY) : -2;
+		}
+	}
+	restore_fs_creds(&creds);
+	close(cachefd);
+	if (fd < 0) {
+		/* -2: the error has been reported */
+		if (fd == -1)
+			error("flatten: %s/%s: %s\n", path, key, strerror(errno));
+		ret = -1;
+		goto done;
+	}
+	full = malloc(strlen(path) + strlen(key) + 2);
+	sprintf(full, "%s/%s", path, key);
+	push(&merged, FROM, full, fd);
+	free(full);
+	ret = do_mount(merged, tgt, NULL, MS_BIND, NULL, args);
+done:
+	drop(merged);
+	free(args);
+	return ret;
+}
+
+static int do_config_union(struct stk **head, const char *config_dir, char *arg)
+{
+	int ret = 0;
+	struct stk *a = NULL, *b = NULL, *e;
+	/* collect all 'from' paths and exactly one 'to' */
+
+	while (*head) {
+		switch ((*head)->arg) {
+		case FROM:
+			e = pop(head);
+			e->next = a;
+			a = e;
+			break;
+		case TO:
+			if (b)
+				ret = -2;
+			else
+				b = pop(head);
+		default:
+			break;
+		}
+	}
+	if (ret == -2 || !a || !b) {
+		ret = -1;
+		error("'union' expects exactly one 'to' path "
+		      "and at least one from\n");
+	} else {
+		char *mnt_opts = empty_str, *ovl_opts = empty_str, *cache;
+		arg = cleanup(arg);
+		split_args(arg, generic_mount_opts, &mnt_opts, &ovl_opts);
+		cache = take_option(ovl_opts, "flatten");
+		ovl_opts += strspn(ovl_opts, spaces_lf);
+		if (*ovl_opts)
+			args_to_mount_data(ovl_opts);
+		else
+			ovl_opts = union_opts;
+		if (cache)
+			ret = do_flatten_union(config_dir, cache, a, b, mnt_opts);
+		else
+			ret = do_overlay_mount("union", b, ovl_opts, a, NULL, NULL, mnt_opts);
+		free(cache);
+	}
+	drop(b);
+	while (a) {
+		e = a->next;
+		drop(a);
+		a = e;
+	}
+	return ret;
+}
+
+static int precopy_overlay(const char *merged, const char *globs);
+
+static int do_config_overlay(struct stk **head, char *arg)
+{
+	int ret = 0;
+	struct stk *a = NULL, *b = NULL, *w = NULL, *e;
+	/* collect one 'work', two 'from' paths, and exactly one 'to' */
+	while (*head && ret == 0 && !(a && a->next && b && w)) {
+		switch ((*head)->arg) {
+		case WORK:
+			if (w)
+				ret = -2;
+			else
+				w = pop(head);
+			break;
+		case FROM:
+			if (a && a->next)
+				ret = -2;
+			else {
+				e = pop(head);
+				e->next = a;
+				a = e;
+			}
+			break;
+		case TO:
+			if (b)
+				ret = -2;
+			else
+				b = pop(head);
+			break;
+		}
+	}
+	if (ret == -2 || !(a && a->next) || !b || !w) {
+		ret = -1;
+		error("'overlay' expects exactly one 'work', two 'from', "
+		      "and one 'to' path lines\n");
+	} else {
+		char *mnt_opts = empty_str, *ovl_opts = empty_str, *globs, *g;
+		struct stk *lower = a->next;
+		arg = cleanup(arg);
+		split_args(arg, generic_mount_opts, &mnt_opts, &ovl_opts);
+		/* "precopy=" may be given more than once */
+		globs = take_option(ovl_opts, "precopy");
+		while (globs && (g = take_option(ovl_opts, "precopy"))) {
+			globs = realloc(globs, strlen(globs) + strlen(g) + 2);
+			strcat(strcat(globs, ","), g);
+			free(g);
+		}
+		ovl_opts += strspn(ovl_opts, spaces_lf);
+		if (*ovl_opts)
+			args_to_mount_data(ovl_opts);
+		else
+			ovl_opts = overlay_opts;
+		a->next = NULL;
+		ret = do_overlay_mount("overlay", b, ovl_opts, lower, a, w, mnt_opts);
+		a->next = lower;
+		if (ret == 0 && globs)
+			precopy_overlay(b->val, globs);
+		free(globs);
+	}
+	drop(w);
+	drop(b);
+	while (a) {
+		e = a->next;
+		drop(a);
+		a = e;
+	}
+	return ret;
+}
+
+struct bind_entry
+{
+	char *src, *src_path;
+	char *dst, *dst_path;
+	unsigned long opts;
+	int depth;	/* number of the other targets above the target */
+};
+
+struct bind_batch
+{
+	struct bind_entry *v;
+	int n, depth;
+	int next;	/* the next entry to take, shared by the workers */
+	int failed;
+};
+
+static int bind_entry(const struct bind_entry *b)
+{
+	int src, tgt, tree, ret = -1;
+	struct stat st;
+
+	src = lookup_config_path(b->src, b->src_path, 0);
+	if (src < 0) {
+		error("bind-list: %s: %s\n", b->src_path, strerror(errno));
+		return -1;
+	}
+	tgt = lookup_config_path(b->dst, b->dst_path, 0);
+	if (tgt < 0 && ENOENT == errno && fstat(src, &st) == 0)
+		tgt = lookup_config_path(b->dst, b->dst_path,
+					 S_ISDIR(st.st_mode) ? S_IFDIR : S_IFREG);
+	if (tgt < 0) {
+		error("bind-list: %s: %s\n", b->dst_path, strerror(errno));
+		close(src);
+		return -1;
+	}
+	tree = open_tree(src, "", OPEN_TREE_CLONE | OPEN_TREE_CLOEXEC |
+			 AT_EMPTY_PATH | (b->opts & MS_REC ? AT_RECURSIVE : 0));
+	if (tree < 0 && ENOSYS == errno)
+		ret = legacy_mount(b->src_path, -1, b->dst_path, NULL, MS_BIND,
+				   NULL, b->opts, 0);
+	else if (tree < 0 || attach_mount(tree, tgt, b->opts, 1) != 0)
+		error("bind mount(%s, %s): %s\n", b->src_path, b->dst_path,
+		      strerror(errno));
+	else
+		ret = 0;
+	if (tree >= 0)
+		close(tree);
+	close(tgt);
+	close(src);
+	return ret;
+}
+
+static void *bind_worker(void *arg)
+{
+	struct bind_batch *batch = arg;
+	int i;
+
+	while ((i = __atomic_fetch_add(&batch->next, 1, __ATOMIC_RELAXED)) < batch->n)
+		if (batch->v[i].depth == batch->depth && bind_entry(&batch->v[i]) != 0)
+			__atomic_store_n(&batch->failed, 1, __ATOMIC_RELAXED);
+	return NULL;
+}
+
+#define MAX_WORKERS 32
+
+static int workers_for(int n)
+{
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+	if (cpus < 1)
+		cpus = 1;
+	if (cpus > MAX_WORKERS)
+		cpus = MAX_WORKERS;
+	return n < cpus ? n : cpus;
+}
+
+/* Run @fn on @nworkers threads, the calling one included */
+static void run_workers(void *(*fn)(void *), void *arg, int nworkers)
+{
+	pthread_t threads[MAX_WORKERS];
+	int i, n = 0;
+
+	for (i = 1; i < nworkers; ++i)
+		if (pthread_create(&threads[n], NULL, fn, arg) == 0)
+			++n;
+	fn(arg);
+	for (i = 0; i < n; ++i)
+		pthread_join(threads[i], NULL);
+}
+
+struct precopy
+{
+	char **paths;
+	size_t n, size;
+	size_t next;	/* the next path to take, shared by the workers */
+	int failed;
+};
+
+static struct precopy *precopy_list;
+
+static int precopy_add(const char *path, const struct stat *st, int type, struct FTW *ftw)
+{
+	struct precopy *p = precopy_list;
+
+	(void)ftw;
+	if (type != FTW_F || !S_ISREG(st->st_mode))
+		return 0;
+	if (p->n == p->size) {
+		p->size = p->size ? 2 * p->size : 64;
+		p->paths = realloc(p->paths, p->size * sizeof(*p->paths));
+	}
+	p->paths[p->n++] = strdup(path);
+	return 0;
+}
+
+static void *precopy_worker(void *arg)
+{
+	struct precopy *p = arg;
+	struct fs_creds creds;
+	size_t i;
+	int fd;
+
+	/* the file system credentials are those of the thread */
+	user_fs_creds(&creds);
+	while ((i = __atomic_fetch_add(&p->next, 1, __ATOMIC_RELAXED)) < p->n) {
+		/* an open for writing copies the file up, a write is not needed */
+		fd = open(p->paths[i], O_WRONLY | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+		if (fd >= 0)
+			close(fd);
+		else {
+			error("precopy: warning: %s: %s\n", p->paths[i], strerror(errno));
+			__atomic_store_n(&p->failed, 1, __ATOMIC_RELAXED);
+		}
+	}
+	restore_fs_creds(&creds);
+	return NULL;
+}
+
+/*
+ * Copy up the files matching the comma separated @globs (relative to the
+ * @merged overlay, the directories with all their files) on parallel
+ * workers, so that the program does not wait for the copy-up of big files
+ * on its first write to them.
+ */
+static int precopy_overlay(const char *merged, const char *globs)
+{
+	struct precopy p = { NULL, 0, 0, 0, 0 };
+	char *list = strdup(globs), *g, *save = NULL, *pattern;
+	struct fs_creds creds;
+	glob_t gl;
+	size_t i;
+
+	if (check_config) {
+		printf("# precopy '%s' in '%s'\n", globs, merged);
+		free(list);
+		return 0;
+	}
+	precopy_list = &p;
+	user_fs_creds(&creds);
+	for (g = strtok_r(list, ",", &save); g; g = strtok_r(NULL, ",", &save)) {
+		while (*g == '/')
+			++g;
+		pattern = malloc(strlen(merged) + strlen(g) + 2);
+		sprintf(pattern, "%s/%s", merged, g);
+		if (glob(pattern, GLOB_NOSORT, NULL, &gl) == 0) {
+			for (i = 0; i < gl.gl_pathc; ++i)
+				nftw(gl.gl_pathv[i], precopy_add, 16, FTW_PHYS | FTW_MOUNT);
+			globfree(&gl);
+		} else if (verbose)
+			fprintf(stderr, "%s: precopy: no match for '%s'\n", build_container, pattern);
+		free(pattern);
+	}
+	restore_fs_creds(&creds);
+	if (verbose > 1)
+		fprintf(stderr, "%s: precopy: %zu files in '%s'\n", build_container, p.n, merged);
+	run_workers(precopy_worker, &p, workers_for(p.n));
+	for (i = 0; i < p.n; ++i)
+		free(p.paths[i]);
+	free(p.paths);
+	free(list);
+	precopy_list = NULL;
+	return p.failed ? -1 : 0;
+}
+
+/*
+ * A read-only union of image files (the top one first): a small tmpfs is
+ * mounted on <to>, the images are attached to loop devices and mounted on
+ * its directories 0, 1, ... by parallel workers, and the union of those is
+ * mounted on top of it all, hiding the tmpfs and the image mounts.
+ */
+struct image_layer
+{
+	const struct stk *image;
+	int dir;	/* the mountpoint in the tmpfs */
+	int fd;		/* the image mount, or -1 */
+};
+
+struct image_union
+{
+	struct image_layer *v;
+	int n;
+	int next;	/* the next layer to take, shared by the workers */
+	int failed;
+	const char *fstype;
+	pthread_mutex_t losetup;
+};
+
+/* The file system type of an image, by its magic number */
+static const char *image_fstype(int fd)
+{
+	unsigned char sb[2048];
+	ssize_t n = pread(fd, sb, sizeof(sb), 0);
+
+	if (n >= 4 && !memcmp(sb, "hsqs", 4))
+		return "squashfs";
+	if (n >= 1028 && sb[1024] == 0xe2 && sb[1025] == 0xe1 &&
+	    sb[1026] == 0xf5 && sb[1027] == 0xe0)
+		return "erofs";
+	if (n >= 1082 && sb[1080] == 0x53 && sb[1081] == 0xef)
+		return "ext4";
+	return NULL;
+}
+
+static int mount_image_layer(struct image_union *u, struct image_layer *l)
+{
+	const char *fstype = u->fstype;
+	char *bdev = NULL;
+	int fd = -1, err;
+
+	if (!fstype) {
+		fd = reopen(dup(l->image->fd), O_RDONLY);
+		fstype = fd < 0 ? NULL : image_fstype(fd);
+		if (fd >= 0)
+			close(fd);
+		if (!fstype) {
+			error("image-union: %s: %s\n", l->image->val,
+			      fd < 0 ? strerror(errno) : "unknown image type");
+			return -1;
+		}
+	}
+	/* a free loop device is found and taken in two steps */
+	pthread_mutex_lock(&u->losetup);
+	err = loop_attach(l->image->val, l->image->fd, &bdev, 1);
+	pthread_mutex_unlock(&u->losetup);
+	if (err == 0) {
+		/* no journal replay either */
+		fd = new_mount(bdev, fstype, strcmp(fstype, "ext4") ? NULL : "noload",
+			       MS_RDONLY, NULL, NULL);
+		err = errno;
+		locleanup(&bdev);
+		free(bdev);
+	} else {
+		err = errno;
+		fd = -1;
+	}
+	if (fd < 0 || attach_mount(fd, l->dir, 0, 0) != 0) {
+		error("image-union: mount(%s): %s\n", l->image->val,
+		      strerror(fd < 0 ? err : errno));
+		if (fd >= 0)
+			close(fd);
+		return -1;
+	}
+	l->fd = fd;
+	return 0;
+}
+
+static void *image_union_worker(void *arg)
+{
+	struct image_union *u = arg;
+	int i;
+
+	while ((i = __atomic_fetch_add(&u->next, 1, __ATOMIC_RELAXED)) < u->n)
+		if (mount_image_layer(u, &u->v[i]) != 0)
+			__atomic_store_n(&u->failed, 1, __ATOMIC_RELAXED);
+	return NULL;
+}
+
+static int do_image_union(const struct stk *images, const struct stk *tgt,
+			  const char *fstype, char *args)
+{
+	struct image_union u = { NULL, count_stk(images), 0, 0, fstype,
+				 PTHREAD_MUTEX_INITIALIZER };
+	struct stk *layers = NULL, *e;
+	const struct stk *i;
+	char name[16], *path, *mnt_opts;
+	int tmp = -1, k, ret = -1;
+
+	mnt_opts = malloc(strlen(args) + sizeof(" ro"));
+	sprintf(mnt_opts, "%s ro", args);
+	u.v = calloc(u.n, sizeof(*u.v));
+	for (i = images, k = 0; i; i = i->next, ++k) {
+		u.v[k].image = i;
+		u.v[k].dir = -1;
+		u.v[k].fd = -1;
+		if (check_config)
+			printf("# image '%s' %s on '%s/%d'\n", i->val,
+			       fstype ? fstype : "(detected)", tgt->val, k);
+		else if (i->fd < 0) {
+			error("image-union: %s: %s\n", i->val, strerror(i->err));
+			goto done;
+		}
+	}
+	if (!check_config) {
+		if (tgt->fd < 0) {
+			error("image-union: %s: %s\n", tgt->val, strerror(tgt->err));
+			goto done;
+		}
+		tmp = new_mount("image-union", "tmpfs", "mode=0700,size=64k", 0, NULL, NULL);
+		if (tmp < 0 && ENOSYS == errno) {
+			/* the layers are only reachable by the detached mounts */
+			error("image-union: needs the new mount API (Linux 5.2)\n");
+			goto done;
+		}
+		if (tmp < 0 || attach_mount(tmp, tgt->fd, 0, 0) != 0) {
+			error("image-union: mount(tmpfs, %s): %s\n", tgt->val, strerror(errno));
+			goto done;
+		}
+		for (k = 0; k < u.n; ++k) {
+			snprintf(name, sizeof(name), "%d", k);
+			if (mkdirat(tmp, name, 0700) != 0 ||
+			    (u.v[k].dir = openat(tmp, name, O_PATH | O_DIRECTORY | O_CLOEXEC)) < 0) {
+				error("image-union: %s/%s: %s\n", tgt->val, name, strerror(errno));
+				goto done;
+			}
+		}
+		run_workers(image_union_worker, &u, workers_for(u.n));
+		if (u.failed)
+			goto done;
+	}
+	/* the layers in the order of the images, the top one first */
+	for (k = u.n - 1; k >= 0; --k) {
+		snprintf(name, sizeof(name), "/%d", k);
+		path = malloc(strlen(tgt->val) + sizeof(name));
+		sprintf(path, "%s%s", tgt->val, name);
+		push(&layers, FROM, path, u.v[k].fd);
+		u.v[k].fd = -1;
+		free(path);
+	}
+	ret = do_overlay_mount("image-union", tgt, union_opts, layers, NULL, NULL, mnt_opts);
+done:
+	while ((e = pop(&layers)))
+		drop(e);
+	for (k = 0; k < u.n; ++k) {
+		if (u.v[k].dir >= 0)
+			close(u.v[k].dir);
+		if (u.v[k].fd >= 0)
+			close(u.v[k].fd);
+	}
+	free(u.v);
+	if (tmp >= 0)
+		close(tmp);
+	free(mnt_opts);
+	return ret;
+}
+
+static int do_config_image_union(struct stk **head, char *arg)
+{
+	static const char *const fstypes[] = { "squashfs", "erofs", "ext4", NULL };
+	struct stk *a = NULL, *b = NULL, *e;
+	const char *fstype = NULL;
+	int k, ret = 0;
+
+	/* all the 'from' images and exactly one 'to', like 'union' */
+	while (*head) {
+		switch ((*head)->arg) {
+		case FROM:
+			e = pop(head);
+			e->next = a;
+			a = e;
+			break;
+		case TO:
+			if (b)
+				ret = -2;
+			else
+				b = pop(head);
+		default:
+			break;
+		}
+	}
+	if (ret == -2 || !a || !b) {
+		ret = -1;
+		error("'image-union' expects exactly one 'to' path "
+		      "and at least one from image\n");
+	} else {
+		arg = cleanup(arg);
+		for (k = 0; fstypes[k]; ++k)
+			if (expect_id(fstypes[k], &arg)) {
+				fstype = fstypes[k];
+				break;
+			}
+		ret = do_image_union(a, b, fstype, arg);
+	}
+	drop(b);
+	while (a) {
+		e = a->next;
+		drop(a);
+		a = e;
+	}
+	return ret;
+}
+
+static int is_path_prefix(const char *prefix, const char *path)
+{
+	size_t n = strlen(prefix);
+
+	while (n > 1 && prefix[n - 1] == '/')
+		--n;
+	return strncmp(prefix, path, n) == 0 && (path[n] == '/' || !path[n]);
+}
+
+static void free_bind_list(struct bind_entry *entries, int n)
+{
+	while (n-- > 0) {
+		free(entries[n].src);
+		free(entries[n].src_path);
+		free(entries[n].dst);
+		free(entries[n].dst_path);
+	}
+	free(entries);
+}
+
+static int parse_bind_list(FILE *fp, const char *manifest, const char *config_dir,
+			   struct bind_entry **entries)
+{
+	char line[BUFSIZ];
+	int n = 0, nalloc = 0, lineno = 0;
+
+	*entries = NULL;
+	while (fgets(line, sizeof(line), fp)) {
+		char *src, *dst, *p = cleanup(line);
+		unsigned long opts = 0, extra = 0;
+		struct bind_entry *b;
+
+		++lineno;
+		if ('#' == *p || !*p)
+			continue;
+		src = p;
+		p += strcspn(p, spaces);
+		if (*p)
+			*p++ = '\0';
+		p += strspn(p, spaces);
+		dst = p;
+		p += strcspn(p, spaces);
+		if (*p)
+			*p++ = '\0';
+		if (!*dst || do_mount_options(&opts, &extra, p) != 0 || extra) {
+			error("%s:%d: expected \"<from> <to> [ ro | rec | noexec | nosuid | nodev ]*\"\n",
+			      manifest, lineno);
+			free_bind_list(*entries, n);
+			*entries = NULL;
+			return -1;
+		}
+		if (n == nalloc)
+			*entries = realloc(*entries, sizeof(**entries) *
+					   (nalloc = nalloc ? 2 * nalloc : 64));
+		b = &(*entries)[n++];
+		b->src = strdup(src);
+		b->src_path = strdup(abspath(config_dir, src));
+		b->dst = strdup(dst);
+		b->dst_path = strdup(abspath(config_dir, dst));
+		b->opts = opts;
+		b->depth = 0;
+	}
+	return n;
+}
+
+/*
+ * Bind-mount all "<from> <to> [options]" lines of a manifest.
+ * The targets nested in other targets of the list are attached after
+ * them; all the others are cloned and attached in parallel.
+ */
+static int do_config_bind_list(const char *config_dir, char *arg)
+{
+	const char *name = cleanup(arg);
+	char *manifest = strdup(abspath(config_dir, name));
+	struct bind_entry *entries;
+	struct bind_batch batch;
+	int i, k, n, depth = 0, ret = 0;
+	FILE *fp;
+
+	if (check_config)
+		fp = fopen(manifest, "r");
+	else {
+		int fd = reopen(lookup_config_path(name, manifest, 0), O_RDONLY);
+		fp = fd < 0 ? NULL : fdopen(fd, "r");
+	}
+	if (!fp) {
+		error("bind-list: %s: %s\n", manifest, strerror(errno));
+		free(manifest);
+		return -1;
+	}
+	n = parse_bind_list(fp, manifest, config_dir, &entries);
+	fclose(fp);
+	for (i = 0; i < n; ++i)
+		for (k = 0; k < n; ++k)
+			if (k != i && is_path_prefix(entries[k].dst_path, entries[i].dst_path) &&
+			    (strcmp(entries[k].dst_path, entries[i].dst_path) || k < i))
+				if (++entries[i].depth > depth)
+					depth = entries[i].depth;
+	if (check_config) {
+		for (i = 0; i < n; ++i)
+			print_mount(entries[i].src_path, entries[i].dst_path, NULL,
+				    MS_BIND | entries[i].opts, 0, NULL);
+		goto done;
+	}
+	batch.v = entries;
+	batch.n = n;
+	batch.failed = 0;
+	for (batch.depth = 0; n > 0 && batch.depth <= depth && !batch.failed; ++batch.depth) {
+		batch.next = 0;
+		run_workers(bind_worker, &batch, workers_for(n));
+	}
+	if (batch.failed)
+		ret = -1;
+done:
+	if (n < 0)
+		ret = -1;
+	free_bind_list(entries, n);
+	free(manifest);
+	return ret;
+}
+
+struct commit
+{
+	char *upper_path, *target_path;
+	int upper, target;
+	struct file_list files;
+};
+
+/*
+ * Apply the directory @rel of the overlay upper on the target: delete the
+ * whiteouts, replace the opaque directories, make the directories, links,
+ * and special files; collect the regular files to copy.
+ */
+static int commit_dir(struct commit *c, int udir, int tdir, char *rel, size_t len)
+{
+	struct dirent *de;
+	int ret = 0;
+	DIR *dir = fdopendir(udir);
+
+	if (!dir) {
+		close(udir);
+		return -1;
+	}
+	while ((de = readdir(dir))) {
+		const char *name = de->d_name;
+		struct stat st;
+		size_t n = strlen(name);
+		char buf[PATH_MAX];
+		int r = 0;
+
+		if (is_dot_or_dotdot(name))
+			continue;
+		if (len + n + 2 > PATH_MAX) {
+			errno = ENAMETOOLONG;
+			r = -1;
+		} else if (fstatat(udir, name, &st, AT_SYMLINK_NOFOLLOW) != 0)
+			r = -1;
+		else if (is_whiteout(udir, name, &st))
+			r = remove_tree(tdir, name);
+		else if (S_ISDIR(st.st_mode)) {
+			int sub = openat(udir, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+			int tsub = -1;
+			char opaque = 0;
+
+			if (sub >= 0 && get_ovl_xattr(sub, "redirect", buf, sizeof(buf)) >= 0) {
+				error("commit: %s/%s%s: renamed directories are not supported\n",
+				      c->upper_path, rel, name);
+				errno = ENOTSUP;
+				close(sub);
+				sub = -1;
+			}
+			if (sub >= 0) {
+				get_ovl_xattr(sub, "opaque", &opaque, 1);
+				if (opaque == 'y' && remove_tree(tdir, name) != 0)
+					r = -1;
+				tsub = openat(tdir, name, O_PATH | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+				if (tsub < 0 && ENOENT != errno && remove_tree(tdir, name) != 0)
+					r = -1;
+				if (tsub < 0 && mkdirat(tdir, name, st.st_mode & 07777) == 0)
+					tsub = openat(tdir, name, O_PATH | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+			}
+			if (sub < 0 || tsub < 0)
+				r = -1;
+			else {
+				memcpy(rel + len, name, n);
+				rel[len + n] = '/';
+				rel[len + n + 1] = '\0';
+				if (commit_dir(c, sub, tsub, rel, len + n + 1) != 0)
+					ret = -1;
+				rel[len] = '\0';
+				sub = -1;
+			}
+			if (sub >= 0)
+				close(sub);
+			if (tsub >= 0) {
+				fchmodat(tdir, name, st.st_mode & 07777, 0);
+				close(tsub);
+			}
+		} else if (S_ISREG(st.st_mode)) {
+			memcpy(rel + len, name, n + 1);
+			file_list_add(&c->files, rel);
+			rel[len] = '\0';
+		} else if (S_ISLNK(st.st_mode)) {
+			ssize_t k = readlinkat(udir, name, buf, sizeof(buf) - 1);
+			if (k < 0 || remove_tree(tdir, name) != 0)
+				r = -1;
+			else {
+				buf[k] = '\0';
+				r = symlinkat(buf, tdir, name);
+			}
+		} else if (remove_tree(tdir, name) != 0 ||
+			   mknodat(tdir, name, st.st_mode, st.st_rdev) != 0)
+			r = -1;
+		if (r) {
+			error("commit: %s%s: %s\n", rel, name, strerror(errno));
+			ret = -1;
+		}
+	}
+	closedir(dir);
+	close(tdir);
+	return ret;
+}
+
+static void *commit_worker(void *arg)
+{
+	struct commit *c = arg;
+	struct fs_creds creds;
+	const char *rel;
+
+	user_fs_creds(&creds);
+	while ((rel = file_list_next(&c->files))) {
+		int err = copy_file(c->upper, c->target, rel);
+		if (err < 0) {
+			error("commit: %s: %s\n", rel, strerror(-err));
+			__atomic_store_n(&c->files.failed, 1, __ATOMIC_RELAXED);
+		} else if (DROP_CACHE_OUTPUTS == drop_cache)
+			drop_cache_at(c->target, rel);
+	}
+	restore_fs_creds(&creds);
+	return NULL;
+}
+
+static int run_commit(void *ctx, int status)
+{
+	struct commit *c = ctx;
+	struct fs_creds creds;
+	char rel[PATH_MAX] = "";
+	int ret = 0, udir, tdir;
+
+	if (status == 0) {
+		if (verbose > 1)
+			fprintf(stderr, "%s: commit '%s' to '%s'\n", build_container,
+				c->upper_path, c->target_path);
+		user_fs_creds(&creds);
+		udir = openat(c->upper, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		tdir = dup(c->target);
+		if (udir < 0 || tdir < 0) {
+			error("commit: %s: %s\n", c->upper_path, strerror(errno));
+			if (tdir >= 0)
+				close(tdir);
+			ret = -1;
+		} else
+			ret = commit_dir(c, udir, tdir, rel, 0);
+		restore_fs_creds(&creds);
+		run_workers(commit_worker, c, workers_for(c->files.n));
+		if (c->files.failed)
+			ret = -1;
+	} else if (verbose > 1)
+		fprintf(stderr, "%s: no commit of '%s', status %d\n", build_container,
+			c->upper_path, status);
+	file_list_free(&c->files);
+	close(c->upper);
+	close(c->target);
+	free(c->upper_path);
+	free(c->target_path);
+	free(c);
+	return ret;
+}
+
+/*
+ * Commit the changes recorded in an overlay upper directory <from> to the
+ * directory <to>, when the container has finished successfully, or "now".
+ */
+static int do_config_commit(struct stk **head, char *arg)
+{
+	struct stk *b = pop(head);
+	struct stk *a = pop(head);
+	struct commit *c;
+	int now = 0, ret = 0;
+
+	if (a && a->arg != FROM)
+		swap(a, b);
+	arg = cleanup(arg);
+	if (expect_id("now", &arg))
+		now = 1;
+	if (!a || !b || a->arg != FROM || b->arg != TO || *cleanup(arg)) {
+		error("'commit' expects 'from' and 'to' paths and optional \"now\"\n");
+		ret = -1;
+	} else if (check_config)
+		printf("# commit '%s' '%s'%s\n", a->val, b->val, now ? " now" : "");
+	else if (a->fd < 0 || b->fd < 0) {
+		error("commit: %s: %s\n", a->fd < 0 ? a->val : b->val,
+		      strerror(a->fd < 0 ? a->err : b->err));
+		ret = -1;
+	} else {
+		c = calloc(1, sizeof(*c));
+		c->upper_path = strdup(a->val);
+		c->target_path = strdup(b->val);
+		c->upper = a->fd;
+		c->target = b->fd;
+		a->fd = b->fd = -1;
+		if (now)
+			ret = run_commit(c, 0);
+		else
+			push_at_exit(run_commit, c);
+	}
+	drop(a);
+	drop(b);
+	return ret;
+}
+
+/*
+ * BLAKE3 (https://github.com/BLAKE3-team/BLAKE3), the portable form of the
+ * reference implementation: 1 KiB chunks merged into a binary tree.
+ */
+#define BLAKE3_OUT_LEN 32
+#define BLAKE3_BLOCK_LEN 64
+#define BLAKE3_CHUNK_BLOCKS 16
+
+enum {
+	B3_CHUNK_START = 1,
+	B3_CHUNK_END = 2,
+	B3_PARENT = 4,
+	B3_ROOT = 8,
+};
+
+static const uint32_t blake3_iv[8] = {
+	0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+	0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+};
+
+static const uint8_t blake3_perm[16] = {
+	2, 6, 3, 10, 7, 0, 4, 13, 1, 11, 12, 5, 9, 14, 15, 8,
+};
+
+struct blake3
+{
+	uint32_t cv[8];		/* the chaining value of the current chunk */
+	uint32_t stack[54][8];	/* the roots of the complete subtrees */
+	int depth;
+	uint64_t chunk;
+	unsigned blocks, block_len;
+	uint8_t block[BLAKE3_BLOCK_LEN];
+};
+
+static inline uint32_t rotr32(uint32_t w, int c)
+{
+	return w >> c | w << (32 - c);
+}
+
+#define B3_G(s, a, b, c, d, x, y) do { \
+	s[a] += s[b] + (x); s[d] = rotr32(s[d] ^ s[a], 16); \
+	s[c] += s[d]; s[b] = rotr32(s[b] ^ s[c], 12); \
+	s[a] += s[b] + (y); s[d] = rotr32(s[d] ^ s[a], 8); \
+	s[c] += s[d]; s[b] = rotr32(s[b] ^ s[c], 7); \
+} while (0)
+
+static void blake3_compress(const uint32_t cv[8], const uint32_t block[16],
+			    uint64_t counter, uint32_t len, uint32_t flags, uint32_t out[16])
+{
+	uint32_t s[16], m[16], t[16];
+	int i, r;
+
+	memcpy(m, block, sizeof(m));
+	memcpy(s, cv, 8 * sizeof(*s));
+	memcpy(s + 8, blake3_iv, 4 * sizeof(*s));
+	s[12] = counter;
+	s[13] = counter >> 32;
+	s[14] = len;
+	s[15] = flags;
+	for (r = 0; r < 7; ++r) {
+		B3_G(s, 0, 4, 8, 12, m[0], m[1]);
+		B3_G(s, 1, 5, 9, 13, m[2], m[3]);
+		B3_G(s, 2, 6, 10, 14, m[4], m[5]);
+		B3_G(s, 3, 7, 11, 15, m[6], m[7]);
+		B3_G(s, 0, 5, 10, 15, m[8], m[9]);
+		B3_G(s, 1, 6, 11, 12, m[10], m[11]);
+		B3_G(s, 2, 7, 8, 13, m[12], m[13]);
+		B3_G(s, 3, 4, 9, 14, m[14], m[15]);
+		for (i = 0; i < 16; ++i)
+			t[i] = m[blake3_perm[i]];
+		memcpy(m, t, sizeof(m));
+	}
+	for (i = 0; i < 8; ++i) {
+		out[i] = s[i] ^ s[i + 8];
+		out[i + 8] = s[i + 8] ^ cv[i];
+	}
+}
+
+static void blake3_words(const uint8_t *p, uint32_t m[16])
+{
+	int i;
+
+	for (i = 0; i < 16; ++i, p += 4)
+		m[i] = p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static void blake3_init(struct blake3 *h)
+{
+	memcpy(h->cv, blake3_iv, sizeof(h->cv));
+	h->depth = 0;
+	h->chunk = 0;
+	h->blocks = h->block_len = 0;
+}
+
+/* Add the chaining value of a chunk, merging the subtrees it completes */
+static void blake3_push_chunk(struct blake3 *h, const uint32_t cv[8])
+{
+	uint32_t m[16], out[16];
+	uint64_t total;
+
+	memcpy(out, cv, 8 * sizeof(*out));
+	for (total = ++h->chunk; !(total & 1); total >>= 1) {
+		memcpy(m, h->stack[--h->depth], 8 * sizeof(*m));
+		memcpy(m + 8, out, 8 * sizeof(*m));
+		blake3_compress(blake3_iv, m, 0, BLAKE3_BLOCK_LEN, B3_PARENT, out);
+	}
+	memcpy(h->stack[h->depth++], out, 8 * sizeof(*out));
+}
+
+static void blake3_update(struct blake3 *h, const void *data, size_t len)
+{
+	const uint8_t *p = data;
+	uint32_t m[16], out[16];
+
+	while (len > 0) {
+		size_t n = BLAKE3_BLOCK_LEN - h->block_len;
+
+		/* a full block is compressed only when more input follows */
+		if (!n) {
+			uint32_t flags = h->blocks ? 0 : B3_CHUNK_START;
+
+			blake3_words(h->block, m);
+			if (++h->blocks == BLAKE3_CHUNK_BLOCKS) {
+				blake3_compress(h->cv, m, h->chunk, BLAKE3_BLOCK_LEN,
+						flags | B3_CHUNK_END, out);
+				blake3_push_chunk(h, out);
+				memcpy(h->cv, blake3_iv, sizeof(h->cv));
+				h->blocks = 0;
+			} else {
+				blake3_compress(h->cv, m, h->chunk, BLAKE3_BLOCK_LEN, flags, out);
+				memcpy(h->cv, out, sizeof(h->cv));
+			}
+			h->block_len = 0;
+			n = BLAKE3_BLOCK_LEN;
+		}
+		if (n > len)
+			n = len;
+		memcpy(h->block + h->block_len, p, n);
+		h->block_len += n;
+		p += n;
+		len -= n;
+	}
+}
+
+static void blake3_final(struct blake3 *h, uint8_t hash[BLAKE3_OUT_LEN])
+{
+	uint32_t m[16], out[16];
+	uint32_t flags = (h->blocks ? 0 : B3_CHUNK_START) | B3_CHUNK_END;
+	int i = h->depth;
+
+	memset(h->block + h->block_len, 0, BLAKE3_BLOCK_LEN - h->block_len);
+	blake3_words(h->block, m);
+	blake3_compress(h->cv, m, h->chunk, h->block_len, flags | (i ? 0 : B3_ROOT), out);
+	while (i-- > 0) {
+		memcpy(m, h->stack[i], 8 * sizeof(*m));
+		memcpy(m + 8, out, 8 * sizeof(*m));
+		blake3_compress(blake3_iv, m, 0, BLAKE3_BLOCK_LEN,
+				B3_PARENT | (i ? 0 : B3_ROOT), out);
+	}
+	for (i = 0; i < BLAKE3_OUT_LEN; ++i)
+		hash[i] = out[i / 4] >> 8 * (i % 4);
+}
+
+struct manifest_entry
+{
+	char *path;
+	const char *kind;	/* "deleted", "opaque", or NULL */
+	struct stat st;
+	char hash[2 * BLAKE3_OUT_LEN + 1];
+};
+
+/* A manifest of the files an overlay upper directory adds, changes or deletes */
+struct manifest
+{
+	char *upper_path, *manifest_path;
+	int upper, out;
+	struct manifest_entry *v;
+	int n, nalloc;
+	int next;
+	int failed;
+};
+
+static void hash_hex(struct blake3 *h, char *hex)
+{
+	uint8_t hash[BLAKE3_OUT_LEN];
+	int i;
+
+	blake3_final(h, hash);
+	for (i = 0; i < BLAKE3_OUT_LEN; ++i)
+		sprintf(hex + 2 * i, "%02x", hash[i]);
+}
+
+static int hash_file(int dirfd, const char *name, char *hex)
+{
+	char buf[BUFSIZ * 8];
+	struct blake3 h;
+	ssize_t n;
+	int fd = openat(dirfd, name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+
+	if (fd < 0)
+		return -errno;
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+	blake3_init(&h);
+	while ((n = read(fd, buf, sizeof(buf))) > 0 || (n < 0 && EINTR == errno))
+		if (n > 0)
+			blake3_update(&h, buf, n);
+	if (n < 0) {
+		n = -errno;
+		close(fd);
+		return n;
+	}
+	close(fd);
+	hash_hex(&h, hex);
+	return 0;
+}
+
+static struct manifest_entry *manifest_add(struct manifest *m, const char *path,
+					   const struct stat *st, const char *kind)
+{
+	struct manifest_entry *e;
+
+	if (m->n == m->nalloc)
+		m->v = realloc(m->v, sizeof(*m->v) * (m->nalloc = m->nalloc ? 2 * m->nalloc : 256));
+	e = &m->v[m->n++];
+	e->path = strdup(path);
+	e->kind = kind;
+	e->st = *st;
+	strcpy(e->hash, "-");
+	return e;
+}
+
+/*
+ * List the directory @rel of the overlay upper; the symbolic links are
+ * hashed on the way, the regular files later by the workers.
+ */
+static int manifest_dir(struct manifest *m, int udir, char *rel, size_t len)
+{
+	struct dirent *de;
+	int ret = 0;
+	DIR *dir = fdopendir(udir);
+
+	if (!dir) {
+		close(udir);
+		return -1;
+	}
+	while ((de = readdir(dir))) {
+		const char *name = de->d_name;
+		struct manifest_entry *e;
+		struct stat st;
+		size_t n = strlen(name);
+		int r = 0;
+
+		if (is_dot_or_dotdot(name))
+			continue;
+		if (len + n + 2 > PATH_MAX) {
+			errno = ENAMETOOLONG;
+			r = -1;
+		} else if (fstatat(udir, name, &st, AT_SYMLINK_NOFOLLOW) != 0)
+			r = -1;
+		else {
+			memcpy(rel + len, name, n + 1);
+			if (is_whiteout(udir, name, &st))
+				manifest_add(m, rel, &st, "deleted");
+			else if (S_ISDIR(st.st_mode)) {
+				int sub = openat(udir, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+				char opaque = 0;
+
+				if (sub < 0)
+					r = -1;
+				else {
+					get_ovl_xattr(sub, "opaque", &opaque, 1);
+					manifest_add(m, rel, &st, opaque == 'y' ? "opaque" : NULL);
+					rel[len + n] = '/';
+					rel[len + n + 1] = '\0';
+					if (manifest_dir(m, sub, rel, len + n + 1) != 0)
+						ret = -1;
+				}
+			} else if (S_ISLNK(st.st_mode)) {
+				char buf[PATH_MAX];
+				ssize_t k = readlinkat(udir, name, buf, sizeof(buf));
+				struct blake3 h;
+
+				if (k < 0)
+					r = -1;
+				else {
+					e = manifest_add(m, rel, &st, NULL);
+					blake3_init(&h);
+					blake3_update(&h, buf, k);
+					hash_hex(&h, e->hash);
+				}
+			} else
+				manifest_add(m, rel, &st, NULL);
+			rel[len] = '\0';
+		}
+		if (r) {
+			error("manifest: %s/%s%s: %s\n", m->upper_path, rel, name, strerror(errno));
+			ret = -1;
+		}
+	}
+	closedir(dir);
+	return ret;
+}
+
+static void *manifest_worker(void *arg)
+{
+	struct manifest *m = arg;
+	struct fs_creds creds;
+	int i;
+
+	user_fs_creds(&creds);
+	while ((i = __atomic_fetch_add(&m->next, 1, __ATOMIC_RELAXED)) < m->n) {
+		struct manifest_entry *e = &m->v[i];
+		int err;
+
+		if (e->kind || !S_ISREG(e->st.st_mode))
+			continue;
+		err = hash_file(m->upper, e->path, e->hash);
+		if (err < 0) {
+			error("manifest: %s/%s: %s\n", m->upper_path, e->path, strerror(-err));
+			__atomic_store_n(&m->failed, 1, __ATOMIC_RELAXED);
+		}
+	}
+	restore_fs_creds(&creds);
+	return NULL;
+}
+
+static int cmp_manifest_entry(const void *a, const void *b)
+{
+	return strcmp(((const struct manifest_entry *)a)->path,
+		      ((const struct manifest_entry *)b)->path);
+}
+
+static int write_manifest(struct manifest *m)
+{
+	FILE *fp = fdopen(m->out, "w");
+	int i;
+
+	if (!fp)
+		return -1;
+	m->out = -1;
+	for (i = 0; i < m->n; ++i) {
+		const struct manifest_entry *e = &m->v[i];
+
+		if (e->kind && !strcmp(e->kind, "deleted"))
+			fprintf(fp, "deleted - - %s\n", e->path);
+		else if (S_ISREG(e->st.st_mode) || S_ISLNK(e->st.st_mode))
+			fprintf(fp, "%s %06o %lld %s\n", e->hash, e->st.st_mode,
+				(long long)e->st.st_size, e->path);
+		else
+			fprintf(fp, "%s %06o - %s\n", e->kind ? e->kind : "-",
+				e->st.st_mode, e->path);
+	}
+	return fclose(fp) != 0 ? -1 : 0;
+}
+
+static int run_manifest(void *ctx, int status)
+{
+	struct manifest *m = ctx;
+	struct fs_creds creds;
+	char rel[PATH_MAX] = "";
+	int ret = 0, udir;
+
+	if (status == 0) {
+		if (verbose > 1)
+			fprintf(stderr, "%s: manifest of '%s' to '%s'\n", build_container,
+				m->upper_path, m->manifest_path);
+		user_fs_creds(&creds);
+		udir = openat(m->upper, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		if (udir < 0) {
+			error("manifest: %s: %s\n", m->upper_path, strerror(errno));
+			ret = -1;
+		} else
+			ret = manifest_dir(m, udir, rel, 0);
+		restore_fs_creds(&creds);
+		run_workers(manifest_worker, m, workers_for(m->n));
+		if (m->failed)
+			ret = -1;
+		qsort(m->v, m->n, sizeof(*m->v), cmp_manifest_entry);
+		if (ret == 0 && write_manifest(m) != 0) {
+			error("manifest: %s: %s\n", m->manifest_path, strerror(errno));
+			ret = -1;
+		}
+	} else if (verbose > 1)
+		fprintf(stderr, "%s: no manifest of '%s', status %d\n", build_container,
+			m->upper_path, status);
+	while (m->n > 0)
+		free(m->v[--m->n].path);
+	free(m->v);
+	if (m->out >= 0)
+		close(m->out);
+	close(m->upper);
+	free(m->upper_path);
+	free(m->manifest_path);
+	free(m);
+	return ret;
+}
+
+/*
+ * Write a manifest of the overlay upper directory <from> to the file
+ * <name> when the container has finished successfully. The file is
+ * truncated now, so that a failed build leaves no stale manifest.
+ */
+static int do_config_manifest(struct stk **head, const char *config_dir, char *arg)
+{
+	struct stk *a = pop(head);
+	const char *name = cleanup(arg);
+	char *path = strdup(abspath(config_dir, name));
+	struct manifest *m;
+	int ret = 0, fd = -1;
+
+	if (!a || a->arg != FROM || !*name) {
+		error("'manifest' expects a 'from' path and a file name\n");
+		ret = -1;
+	} else if (check_config)
+		printf("# manifest '%s' '%s'\n", a->val, path);
+	else if (a->fd < 0) {
+		error("manifest: %s: %s\n", a->val, strerror(a->err));
+		ret = -1;
+	} else if ((fd = reopen(lookup_config_path(name, path, S_IFREG),
+				O_WRONLY | O_TRUNC | O_CLOEXEC)) < 0) {
+		error("manifest: %s: %s\n", path, strerror(errno));
+		ret = -1;
+	} else {
+		m = calloc(1, sizeof(*m));
+		m->upper_path = strdup(a->val);
+		m->manifest_path = strdup(path);
+		m->upper = a->fd;
+		m->out = fd;
+		a->fd = -1;
+		push_at_exit(run_manifest, m);
+	}
+	drop(a);
+	free(path);
+	return ret;
+}
+
+/* The deeper directories first */
+static int cmp_path_depth(const void *a, const void *b)
+{
+	size_t na = strlen(*(char *const *)a), nb = strlen(*(char *const *)b);
+
+	return na < nb ? 1 : na > nb ? -1 : 0;
+}
+
+/* A copy of a directory tree, walked by a pool of workers */
+struct copied_dir
+{
+	char *rel;	/* first: sorted as a string */
+	struct stat st;
+};
+
+struct tree_copy
+{
+	const char *from_path, *to_path;
+	int from, to;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	char **dirs;	/* the pending directories, relative to the roots */
+	int ndirs, nalloc;
+	int busy;	/* the workers processing a directory */
+	int failed;
+	int copied;	/* the data of some files was not shared */
+	struct copied_dir *made;	/* their modes and times are set last */
+	int nmade, nmade_alloc;
+};
+
+static void tree_copy_made(struct tree_copy *t, const char *rel,
+			   const char *name, const struct stat *st)
+{
+	struct copied_dir *d;
+
+	pthread_mutex_lock(&t->lock);
+	if (t->nmade == t->nmade_alloc)
+		t->made = realloc(t->made, sizeof(*t->made) *
+				  (t->nmade_alloc = t->nmade_alloc ? 2 * t->nmade_alloc : 64));
+	d = &t->made[t->nmade++];
+	d->rel = malloc(strlen(rel) + strlen(name) + 1);
+	sprintf(d->rel, "%s%s", rel, name);
+	d->st = *st;
+	pthread_mutex_unlock(&t->lock);
+}
+
+static void tree_copy_push(struct tree_copy *t, char *rel)
+{
+	pthread_mutex_lock(&t->lock);
+	if (t->ndirs == t->nalloc)
+		t->dirs = realloc(t->dirs, sizeof(*t->dirs) *
+				  (t->nalloc = t->nalloc ? 2 * t->nalloc : 64));
+	t->dirs[t->ndirs++] = rel;
+	pthread_cond_signal(&t->cond);
+	pthread_mutex_unlock(&t->lock);
+}
+
+/*
+ * The overlay attributes (opaque directories, whiteouts of the overlays
+ * mounted with userxattr), so that a copy of an upper is one still.
+ * Errors are ignored: the trusted.* ones need privileges.
+ */
+static void copy_ovl_xattrs(int sdir, int tdir, const char *name)
+{
+	char list[1024], val[256], *k;
+	ssize_t n, v;
+	int sfd, tfd = -1;
+
+	sfd = openat(sdir, name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+	n = sfd < 0 ? -1 : flistxattr(sfd, list, sizeof(list));
+	for (k = list; n > 0 && k < list + n; k += strlen(k) + 1) {
+		if (strncmp(k, "trusted.overlay.", 16) && strncmp(k, "user.overlay.", 13))
+			continue;
+		if (tfd < 0 &&
+		    (tfd = openat(tdir, name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC)) < 0)
+			break;
+		v = fgetxattr(sfd, k, val, sizeof(val));
+		if (v >= 0)
+			fsetxattr(tfd, k, val, v, 0);
+	}
+	if (tfd >= 0)
+		close(tfd);
+	if (sfd >= 0)
+		close(sfd);
+}
+
+static int copy_entry(struct tree_copy *t, int sdir, int tdir,
+		      const char *rel, const char *name)
+{
+	char buf[PATH_MAX];
+	struct stat st;
+	ssize_t n;
+	int ret;
+
+	if (fstatat(sdir, name, &st, AT_SYMLINK_NOFOLLOW) != 0)
+		return -1;
+	if (S_ISDIR(st.st_mode)) {
+		char *sub;
+		/* writable until its entries are in: the mode comes last */
+		if (mkdirat(tdir, name, 0700) != 0 && EEXIST != errno)
+			return -1;
+		copy_ovl_xattrs(sdir, tdir, name);
+		tree_copy_made(t, rel, name, &st);
+		sub = malloc(strlen(rel) + strlen(name) + 2);
+		sprintf(sub, "%s%s/", rel, name);
+		tree_copy_push(t, sub);
+		return 0;
+	}
+	if (S_ISREG(st.st_mode)) {
+		ret = copy_file(sdir, tdir, name);
+		if (ret < 0) {
+			errno = -ret;
+			return -1;
+		}
+		if (!ret)
+			__atomic_store_n(&t->copied, 1, __ATOMIC_RELAXED);
+		if (!st.st_size)
+			copy_ovl_xattrs(sdir, tdir, name);
+	} else if (S_ISLNK(st.st_mode)) {
+		n = readlinkat(sdir, name, buf, sizeof(buf) - 1);
+		if (n < 0 || remove_tree(tdir, name) != 0)
+			return -1;
+		buf[n] = '\0';
+		if (symlinkat(buf, tdir, name) != 0)
+			return -1;
+	} else if (remove_tree(tdir, name) != 0 ||
+		   mknodat(tdir, name, st.st_mode, st.st_rdev) != 0)
+		return -1;
+	if (!user_uid())
+		fchownat(tdir, name, st.st_uid, st.st_gid, AT_SYMLINK_NOFOLLOW);
+	return 0;
+}
+
+static void copy_dir(struct tree_copy *t, const char *rel)
+{
+	const char *dot = *rel ? rel : ".";
+	struct dirent *de;
+	int sdir, tdir;
+	DIR *dir;
+
+	sdir = openat(t->from, dot, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+	tdir = openat(t->to, dot, O_PATH | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+	dir = sdir < 0 || tdir < 0 ? NULL : fdopendir(sdir);
+	if (!dir) {
+		error("clone: %s%s: %s\n", t->from_path, rel, strerror(errno));
+		__atomic_store_n(&t->failed, 1, __ATOMIC_RELAXED);
+		if (sdir >= 0)
+			close(sdir);
+	} else {
+		while ((de = readdir(dir)))
+			if (!is_dot_or_dotdot(de->d_name) &&
+			    copy_entry(t, sdir, tdir, rel, de->d_name) != 0) {
+				error("clone: %s%s: %s\n", rel, de->d_name, strerror(errno));
+				__atomic_store_n(&t->failed, 1, __ATOMIC_RELAXED);
+			}
+		closedir(dir);
+	}
+	if (tdir >= 0)
+		close(tdir);
+}
+
+static void *tree_copy_worker(void *arg)
+{
+	struct tree_copy *t = arg;
+	struct fs_creds creds;
+
+	user_fs_creds(&creds);
+	pthread_mutex_lock(&t->lock);
+	for (;;) {
+		char *rel;
+
+		while (!t->ndirs && t->busy)
+			pthread_cond_wait(&t->cond, &t->lock);
+		if (!t->ndirs)
+			break;
+		rel = t->dirs[--t->ndirs];
+		++t->busy;
+		pthread_mutex_unlock(&t->lock);
+		copy_dir(t, rel);
+		free(rel);
+		pthread_mutex_lock(&t->lock);
+		if (!--t->busy && !t->ndirs)
+			break;
+	}
+	pthread_cond_broadcast(&t->cond);
+	pthread_mutex_unlock(&t->lock);
+	restore_fs_creds(&creds);
+	return NULL;
+}
+
+/*
+ * Copy the tree @from to @to, sharing the file extents where supported.
+ * Returns 1 if the data of some files was copied, -1 on errors.
+ */
+static int clone_tree(int from, int to, const char *from_path, const char *to_path)
+{
+	struct tree_copy t = {
+		.from_path = from_path,
+		.to_path = to_path,
+		.from = from,
+		.to = to,
+		.lock = PTHREAD_MUTEX_INITIALIZER,
+		.cond = PTHREAD_COND_INITIALIZER,
+	};
+
+	struct fs_creds creds;
+	int i;
+
+	tree_copy_push(&t, strdup(""));
+	run_workers(tree_copy_worker, &t, workers_for(MAX_WORKERS));
+	free(t.dirs);
+	/* the directories, once filled: the deeper ones first */
+	qsort(t.made, t.nmade, sizeof(*t.made), cmp_path_depth);
+	user_fs_creds(&creds);
+	for (i = 0; i < t.nmade; ++i) {
+		struct copied_dir *d = &t.made[i];
+		struct timespec times[2] = { d->st.st_atim, d->st.st_mtim };
+
+		if (!user_uid())
+			fchownat(to, d->rel, d->st.st_uid, d->st.st_gid, AT_SYMLINK_NOFOLLOW);
+		if (fchmodat(to, d->rel, d->st.st_mode & 07777, 0) != 0 ||
+		    utimensat(to, d->rel, times, AT_SYMLINK_NOFOLLOW) != 0) {
+			error("clone: %s/%s: %s\n", to_path, d->rel, strerror(errno));
+			t.failed = 1;
+		}
+		free(d->rel);
+	}
+	restore_fs_creds(&creds);
+	free(t.made);
+	return t.failed ? -1 : t.copied;
+}
+
+/* Copy the tree <from> to <to>, sharing the file extents where supported */
+static int do_config_clone(struct stk **head, char *arg)
+{
+	struct stk *b = pop(head);
+	struct stk *a = pop(head);
+	int ret = 0;
+
+	if (a && a->arg != FROM)
+		swap(a, b);
+	if (!a || !b || a->arg != FROM || b->arg != TO || *cleanup(arg)) {
+		error("'clone' expects 'from' and 'to' paths\n");
+		ret = -1;
+	} else if (check_config)
+		printf("# clone '%s' '%s'\n", a->val, b->val);
+	else if (a->fd < 0 || b->fd < 0) {
+		error("clone: %s: %s\n", a->fd < 0 ? a->val : b->val,
+		      strerror(a->fd < 0 ? a->err : b->err));
+		ret = -1;
+	} else {
+		ret = clone_tree(a->fd, b->fd, a->val, b->val);
+		if (ret > 0) {
+			error("clone: warning: %s: no reflink support, the data was copied\n",
+			      b->val);
+			ret = 0;
+		}
+	}
+	drop(a);
+	drop(b);
+	return ret;
+}
+
+/*
+ * The ephemeral directories, like the overlay upper and work directories
+ * made with 'to!' and 'work!', are moved into a trash directory next to
+ * them at exit (after the other exit actions), and removed there by a
+ * detached low-priority process, so that the next build need not wait.
+ */
+#ifndef TRASH_NAME
+#define TRASH_NAME ".build-container-trash"
+#endif
+
+struct ephemeral
+{
+	struct ephemeral *next;
+	char *path;
+	char *name;
+	int parent;
+};
+static struct ephemeral *ephemeral_head;
+
+/* The unlinking of trees in the trash, by a pool of workers */
+struct tree_unlink
+{
+	int trash;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	char **dirs;	/* the pending directories, relative to the trash */
+	int ndirs, nalloc;
+	char **seen;	/* the directories to remove once empty */
+	int nseen, nseen_alloc;
+	int busy;
+};
+
+static void tree_unlink_push(struct tree_unlink *t, char *rel)
+{
+	pthread_mutex_lock(&t->lock);
+	if (t->ndirs == t->nalloc)
+		t->dirs = realloc(t->dirs, sizeof(*t->dirs) *
+				  (t->nalloc = t->nalloc ? 2 * t->nalloc : 64));
+	t->dirs[t->ndirs++] = rel;
+	if (t->nseen == t->nseen_alloc)
+		t->seen = realloc(t->seen, sizeof(*t->seen) *
+				  (t->nseen_alloc = t->nseen_alloc ? 2 * t->nseen_alloc : 64));
+	t->seen[t->nseen++] = rel;
+	pthread_cond_signal(&t->cond);
+	pthread_mutex_unlock(&t->lock);
+}
+
+/*
+ * Open @rel beneath the trash, following no symlinks on the way: with
+ * openat2(2), or else one component at a time.
+ */
+static int open_beneath(int trash, const char *rel, int flags)
+{
+	struct open_how how = {
+		.flags = flags | O_NOFOLLOW | O_CLOEXEC,
+		.resolve = RESOLVE_BENEATH | RESOLVE_NO_SYMLINKS,
+	};
+	int fd = syscall(SYS_openat2, trash, rel, &how, sizeof(how)), nfd;
+	const char *slash;
+	char *name;
+
+	if (fd >= 0 || ENOSYS != errno)
+		return fd;
+	fd = dup(trash);
+	while (fd >= 0 && (slash = strchr(rel, '/'))) {
+		name = strndup(rel, slash - rel);
+		nfd = openat(fd, name, O_PATH | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+		free(name);
+		close(fd);
+		fd = nfd;
+		rel = slash + 1;
+	}
+	if (fd < 0)
+		return -1;
+	nfd = openat(fd, rel, how.flags);
+	close(fd);
+	return nfd;
+}
+
+/* Unlink the files of a directory, queueing the subdirectories */
+static void unlink_dir(struct tree_unlink *t, const char *rel)
+{
+	const char *slash = strrchr(rel, '/');
+	struct dirent *de;
+	int fd = open_beneath(t->trash, rel, O_RDONLY | O_DIRECTORY), parent;
+	int opened_up = 0;
+	DIR *dir;
+
+	/* a directory the build made unreadable, as the user can */
+	if (fd < 0 && EACCES == errno) {
+		char *up = slash ? strndup(rel, slash - rel) : NULL;
+
+		parent = up ? open_beneath(t->trash, up, O_PATH | O_DIRECTORY) : t->trash;
+		if (parent >= 0 && fchmodat(parent, slash ? slash + 1 : rel, 0700, 0) == 0)
+			fd = open_beneath(t->trash, rel, O_RDONLY | O_DIRECTORY);
+		if (parent >= 0 && parent != t->trash)
+			close(parent);
+		free(up);
+		opened_up = 1;
+	}
+	if (fd < 0 || !(dir = fdopendir(fd))) {
+		if (fd >= 0)
+			close(fd);
+		return;
+	}
+	while ((de = readdir(dir))) {
+		char *sub;
+
+		if (is_dot_or_dotdot(de->d_name))
+			continue;
+		if (DT_DIR != de->d_type) {
+			if (unlinkat(fd, de->d_name, 0) == 0)
+				continue;
+			/* or read-only */
+			if (EACCES == errno && !opened_up++ && fchmod(fd, 0700) == 0 &&
+			    unlinkat(fd, de->d_name, 0) == 0)
+				continue;
+			if (EISDIR != errno)
+				continue;
+		}
+		sub = malloc(strlen(rel) + strlen(de->d_name) + 2);
+		sprintf(sub, "%s/%s", rel, de->d_name);
+		tree_unlink_push(t, sub);
+	}
+	closedir(dir);
+}
+
+static void *tree_unlink_worker(void *arg)
+{
+	struct tree_unlink *t = arg;
+
+	pthread_mutex_lock(&t->lock);
+	for (;;) {
+		char *rel;
+
+		while (!t->ndirs && t->busy)
+			pthread_cond_wait(&t->cond, &t->lock);
+		if (!t->ndirs)
+			break;
+		rel = t->dirs[--t->ndirs];
+		++t->busy;
+		pthread_mutex_unlock(&t->lock);
+		unlink_dir(t, rel);
+		pthread_mutex_lock(&t->lock);
+		if (!--t->busy && !t->ndirs)
+			break;
+	}
+	pthread_cond_broadcast(&t->cond);
+	pthread_mutex_unlock(&t->lock);
+	return NULL;
+}
+
+/* Empty the trash directory; returns the number of the entries found */
+static int empty_trash(int trash)
+{
+	struct tree_unlink t = {
+		.trash = trash,
+		.lock = PTHREAD_MUTEX_INITIALIZER,
+		.cond = PTHREAD_COND_INITIALIZER,
+	};
+	struct dirent *de;
+	int i, n = 0, fd = openat(trash, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	DIR *dir = fd < 0 ? NULL : fdopendir(fd);
+
+	if (!dir)
+		return 0;
+	while ((de = readdir(dir)))
+		if (!is_dot_or_dotdot(de->d_name)) {
+			++n;
+			if (unlinkat(trash, de->d_name, 0) != 0 && EISDIR == errno)
+				tree_unlink_push(&t, strdup(de->d_name));
+		}
+	closedir(dir);
+	if (t.ndirs)
+		run_workers(tree_unlink_worker, &t, workers_for(MAX_WORKERS));
+	/* a child has a longer path than its parent */
+	qsort(t.seen, t.nseen, sizeof(*t.seen), cmp_path_depth);
+	for (i = 0; i < t.nseen; ++i) {
+		char *slash = strrchr(t.seen[i], '/');
+		int parent = trash;
+
+		if (slash) {
+			*slash = '\0';
+			parent = open_beneath(trash, t.seen[i], O_PATH | O_DIRECTORY);
+		}
+		if (parent >= 0)
+			unlinkat(parent, slash ? slash + 1 : t.seen[i], AT_REMOVEDIR);
+		if (parent >= 0 && parent != trash)
+			close(parent);
+		free(t.seen[i]);
+	}
+	free(t.seen);
+	free(t.dirs);
+	return n;
+}
+
+/*
+ * In a detached process: one of them at a time empties a trash directory,
+ * until it stays empty.
+ */
+static void start_trash_worker(int *trash, int n)
+{
+	struct fs_creds creds;
+	int i, status;
+	pid_t pid = fork();
+
+	if (pid == 0) {
+		if (fork() != 0)
+			_exit(0);
+		setsid();
+		if ((status = open("/dev/null", O_RDWR)) >= 0) {
+			dup2(status, 0);
+			dup2(status, 1);
+			dup2(status, 2);
+		}
+		/* not to keep the mounts of the container alive meanwhile */
+		if (host_mntns >= 0)
+			(void)setns(host_mntns, CLONE_NEWNS);
+		/* the trash is the user's: so are the workers, which inherit it */
+		user_fs_creds(&creds);
+		(void)setpriority(PRIO_PROCESS, 0, 19);
+		(void)syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0,
+			      IOPRIO_PRIO_VALUE(IOPRIO_CLASS_IDLE, 0));
+		for (i = 0; i < n; ++i)
+			while (flock(trash[i], LOCK_EX | LOCK_NB) == 0) {
+				while (empty_trash(trash[i]))
+					;
+				flock(trash[i], LOCK_UN);
+				/* anything trashed while the lock was being released? */
+				if (!empty_trash(trash[i]))
+					break;
+			}
+		_exit(0);
+	}
+	if (pid > 0)
+		while (waitpid(pid, &status, 0) == -1 && EINTR == errno)
+			;
+}
+
+/*
+ * The overlay leaves its work/work directory with mode 0, and owned by
+ * the mounter: hand it over to the user, on the fd, before the trash.
+ */
+static void open_up_work_dir(const struct ephemeral *e)
+{
+	int fd = openat(e->parent, e->name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+	int work = fd < 0 ? -1 :
+		openat(fd, "work", O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+	struct stat st;
+
+	if (work >= 0 && fstat(work, &st) == 0 && !(st.st_mode & S_IRWXU) &&
+	    (st.st_uid == user_uid() || fchown(work, user_uid(), user_gid()) == 0))
+		(void)fchmod(work, 0700);
+	if (work >= 0)
+		close(work);
+	if (fd >= 0)
+		close(fd);
+}
+
+static int discard_ephemeral(void *ctx, int status)
+{
+	int trash[64], n = 0, ret = 0;
+	struct ephemeral *e;
+	struct fs_creds creds;
+	char name[NAME_MAX + 1];
+
+	while ((e = ephemeral_head)) {
+		int fd;
+
+		ephemeral_head = e->next;
+		snprintf(name, sizeof(name), "%.200s.%ld.%d", e->name, (long)getpid(), n);
+		open_up_work_dir(e);
+		user_fs_creds(&creds);
+		if ((mkdirat(e->parent, TRASH_NAME, 0700) != 0 && EEXIST != errno) ||
+		    (fd = openat(e->parent, TRASH_NAME,
+				 O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC)) < 0)
+			fd = -1;
+		else if (renameat(e->parent, e->name, fd, name) != 0 && ENOENT != errno) {
+			close(fd);
+			fd = -1;
+		}
+		restore_fs_creds(&creds);
+		if (fd < 0) {
+			error("ephemeral: %s: %s\n", e->path, strerror(errno));
+			ret = -1;
+		} else if (n < sizeof(trash) / sizeof(*trash))
+			trash[n++] = fd;
+		else
+			close(fd);
+		close(e->parent);
+		free(e->path);
+		free(e);
+	}
+	if (n)
+		start_trash_worker(trash, n);
+	while (n-- > 0)
+		close(trash[n]);
+	return ret;
+}
+
+/* The exit actions run in the reverse order: append this one */
+static void append_at_exit(int (*fn)(void *, int), void *ctx)
+{
+	struct at_exit **p = &at_exit_head;
+
+	while (*p)
+		p = &(*p)->next;
+	*p = calloc(1, sizeof(**p));
+	(*p)->fn = fn;
+	(*p)->ctx = ctx;
+}
+
+static int do_config_ephemeral(struct stk **head, char *arg)
+{
+	struct stk *a = pop(head);
+	struct ephemeral *e;
+	struct stat st, pst;
+	const char *name;
+
+	if (!a || *cleanup(arg)) {
+		error("'ephemeral' expects a path\n");
+		drop(a);
+		return -1;
+	}
+	if (check_config) {
+		printf("# ephemeral '%s'\n", a->val);
+		drop(a);
+		return 0;
+	}
+	name = strrchr(a->val, '/');
+	name = name ? name + 1 : a->val;
+	e = calloc(1, sizeof(*e));
+	e->parent = a->fd < 0 ? -1 : openat(a->fd, "..", O_PATH | O_DIRECTORY | O_CLOEXEC);
+	/* the path must name the directory itself, not a symlink to it */
+	if (a->fd < 0 || e->parent < 0 || !*name || fstat(a->fd, &st) != 0 ||
+	    fstatat(e->parent, name, &pst, AT_SYMLINK_NOFOLLOW) != 0 ||
+	    !S_ISDIR(st.st_mode) || st.st_dev != pst.st_dev || st.st_ino != pst.st_ino) {
+		error("ephemeral: %s: %s\n", a->val,
+		      strerror(a->fd < 0 ? a->err : errno ? errno : ENOTDIR));
+		if (e->parent >= 0)
+			close(e->parent);
+		free(e);
+		drop(a);
+		return -1;
+	}
+	e->path = strdup(a->val);
+	e->name = strdup(name);
+	if (!ephemeral_head)
+		append_at_exit(discard_ephemeral, NULL);
+	e->next = ephemeral_head;
+	ephemeral_head = e;
+	drop(a);
+	return 0;
+}
+
+/*
+ * A scratch file system of its own for the container, so that the
+ * metadata traffic of concurrent builds does not meet in the journal of
+ * the host file system: a sparse image, attached to a loop device, made
+ * with mkfs without a journal where possible, and mounted noatime and
+ * lazytime. The image is an unnamed file in the <to> directory, freed
+ * when the last user is gone, or one of the images in the pool directory
+ * <from>, taken with a lock and emptied (hole-punched) at exit.
+ */
+#define MKFS_PATH "/usr/sbin:/sbin:/usr/bin:/bin"
+
+struct scratch_fs
+{
+	const char *fstype;
+	const char *mkfs[8];
+	const char *data;
+};
+
+static const struct scratch_fs scratch_fs[] = {
+	{ "ext4", { "-q", "-F", "-m", "0", "-O", "^has_journal",
+		    "-E", "nodiscard,lazy_itable_init=1" }, "lazytime,nobarrier" },
+	{ "xfs", { "-q", "-f", "-K" }, "lazytime" },
+	{ "btrfs", { "-q", "-f", "-K" }, "lazytime,nobarrier" },
+	{ NULL }
+};
+
+struct scratch
+{
+	int image;	/* locked, if from the pool */
+	int root;	/* of the mount */
+	off_t size;
+	int pooled;
+};
+
+static int parse_size(const char *arg, off_t *size);
+
+static int run_mkfs(const struct scratch_fs *fs, const char *bdev)
+{
+	/* privileged: nothing from the environment of the user */
+	static const char *const envp[] = { "PATH=" MKFS_PATH, "LC_ALL=C", NULL };
+	char prog[32], path[PATH_MAX];
+	const char *argv[sizeof(fs->mkfs) / sizeof(*fs->mkfs) + 3], *dir, *end;
+	int i, n = 0, status;
+	pid_t pid;
+
+	snprintf(prog, sizeof(prog), "mkfs.%s", fs->fstype);
+	argv[n++] = prog;
+	for (i = 0; i < sizeof(fs->mkfs) / sizeof(*fs->mkfs) && fs->mkfs[i]; ++i)
+		argv[n++] = fs->mkfs[i];
+	argv[n++] = bdev;
+	argv[n] = NULL;
+	switch (pid = fork()) {
+	case -1:
+		error("fork(%s): %s\n", prog, strerror(errno));
+		return -1;
+	case 0:
+		for (dir = MKFS_PATH; *dir; dir = *end ? end + 1 : end) {
+			end = dir + strcspn(dir, ":");
+			snprintf(path, sizeof(path), "%.*s/%s", (int)(end - dir), dir, prog);
+			execve(path, (char **)argv, (char **)envp);
+		}
+		error("execve(%s): not found in %s\n", prog, MKFS_PATH);
+		_exit(127);
+	}
+	while (waitpid(pid, &status, 0) == -1)
+		if (EINTR != errno)
+			return -1;
+	if (WIFEXITED(status) && WEXITSTATUS(status) == 0)
+		return 0;
+	error("scratch: %s %s failed\n", prog, bdev);
+	return -1;
+}
+
+/* The first unlocked image of the pool @dir, made if there is none */
+static int take_scratch_image(int dir)
+{
+	char name[32];
+	int i, fd;
+
+	for (i = 0; i < 1024; ++i) {
+		snprintf(name, sizeof(name), "scratch-%d.img", i);
+		fd = openat(dir, name, O_RDWR | O_CREAT | O_NOFOLLOW | O_CLOEXEC, 0600);
+		if (fd < 0)
+			return -1;
+		if (flock(fd, LOCK_EX | LOCK_NB) == 0)
+			return fd;
+		close(fd);
+	}
+	errno = EBUSY;
+	return -1;
+}
+
+static int discard_scratch(void *ctx, int status)
+{
+	struct scratch *s = ctx;
+	int cwd, mounted = 1, ret = 0;
+
+	/* unmounted first, so that nothing is written back into the holes */
+	if (s->root >= 0) {
+		cwd = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+		if (fchdir(s->root) == 0 && umount2(".", MNT_DETACH) == 0)
+			mounted = 0;
+		else if (verbose > 1)
+			error("scratch: umount: %s\n", strerror(errno));
+		close(s->root);
+		if (cwd >= 0) {
+			(void)fchdir(cwd);
+			close(cwd);
+		}
+	}
+	/* else the pooled image stays locked, as it is, until the exit */
+	if (s->pooled && mounted) {
+		free(s);
+		return 0;
+	}
+	if (s->pooled &&
+	    fallocate(s->image, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, 0, s->size) != 0) {
+		error("scratch: discard: %s\n", strerror(errno));
+		ret = -1;
+	}
+	close(s->image);
+	free(s);
+	return ret;
+}
+
+static int do_config_scratch(struct stk **head, char *arg)
+{
+	const struct scratch_fs *fs = scratch_fs;
+	struct stk *b = pop(head), *a = pop(head);
+	unsigned long opts = MS_NOATIME, extra = 0;
+	struct scratch *s = NULL;
+	struct fs_creds creds;
+	char *size, *bdev = NULL;
+	int fd = -1, ret = -1;
+	off_t bytes;
+
+	if (a && b && b->arg != TO)
+		swap(a, b);
+	if (!b || b->arg != TO || (a && a->arg != FROM)) {
+		error("'scratch' expects a 'to' and, optionally, a 'from' directory\n");
+		goto done;
+	}
+	arg = cleanup(arg);
+	size = arg;
+	arg += strcspn(arg, spaces_lf);
+	if (*arg)
+		*arg++ = '\0';
+	arg += strspn(arg, spaces_lf);
+	for (; fs->fstype; ++fs)
+		if (expect_id(fs->fstype, &arg))
+			break;
+	if (!fs->fstype)
+		fs = scratch_fs;
+	if (parse_size(size, &bytes) != 0 || !bytes) {
+		error("'scratch' expects a size, and optionally ext4, xfs or btrfs\n");
+		goto done;
+	}
+	if (do_mount_options(&opts, &extra, arg) != 0)
+		goto done;
+	if (check_config) {
+		printf("# scratch '%s' %lld %s image '%s'\n", b->val, (long long)bytes,
+		       fs->fstype, a ? a->val : "(unnamed)");
+		ret = 0;
+		goto done;
+	}
+	if (b->fd < 0 || (a && a->fd < 0)) {
+		error("scratch: %s: %s\n", b->fd < 0 ? b->val : a->val,
+		      strerror(b->fd < 0 ? b->err : a->err));
+		goto done;
+	}
+	s = calloc(1, sizeof(*s));
+	s->root = -1;
+	s->size = bytes;
+	s->pooled = !!a;
+	user_fs_creds(&creds);
+	if (a) {
+		fd = reopen(dup(a->fd), O_PATH | O_DIRECTORY);
+		s->image = fd < 0 ? -1 : take_scratch_image(fd);
+		if (fd >= 0)
+			close(fd);
+	} else
+		s->image = reopen(dup(b->fd), O_TMPFILE | O_RDWR);
+	restore_fs_creds(&creds);
+	if (s->image < 0 || ftruncate(s->image, bytes) != 0) {
+		error("scratch: %s image: %s\n", a ? a->val : b->val, strerror(errno));
+		goto done;
+	}
+	if (losetup(b->val, s->image, &bdev) != 0 || run_mkfs(fs, bdev) != 0)
+		goto done;
+	fd = new_mount(bdev, fs->fstype, fs->data, opts, NULL, NULL);
+	if (fd < 0 && ENOSYS == errno) {
+		ret = legacy_mount(bdev, -1, b->val, fs->fstype, 0, fs->data, opts, 0);
+		/* the root of the new mount, to unmount it by */
+		if (ret == 0)
+			s->root = resolve(AT_FDCWD, b->val, O_DIRECTORY);
+	} else if (fd < 0 || attach_mount(fd, b->fd, opts, 0) != 0)
+		error("mount(%s, %s): %s\n", bdev, b->val, strerror(errno));
+	else {
+		s->root = fd;
+		fd = -1;
+		ret = 0;
+	}
+	/* the user's to fill, like a directory made by "to!" */
+	if (ret == 0 && s->root >= 0 &&
+	    fchownat(s->root, "", user_uid(), user_gid(), AT_EMPTY_PATH) != 0)
+		error("scratch: %s: chown: %s\n", b->val, strerror(errno));
+done:
+	if (fd >= 0)
+		close(fd);
+	/* detached when unmounted */
+	if (bdev)
+		locleanup(&bdev);
+	free(bdev);
+	if (s && ret == 0)
+		push_at_exit(discard_scratch, s);
+	else if (s) {
+		if (s->image >= 0)
+			close(s->image);
+		free(s);
+	}
+	drop(a);
+	drop(b);
+	return ret;
+}
+
+/*
+ * forward: a listening socket in the network namespace of -N for each
+ * line, relayed by the supervising parent to a host unix socket or TCP
+ * port on 127.0.0.1. The host ends are connected by a process left in
+ * the host network (and mount) namespace as the invoking user, which
+ * passes each socket back (SCM_RIGHTS) without waiting for the connection
+ * to complete; the supervisor takes the replies from its poll loop, and
+ * moves the data with splice(2) through a pipe per direction, not copied
+ * through userspace.
+ */
+#define FORWARD_MAX 16
+#define FORWARD_RELAYS 64
+#define FORWARD_CHUNK (1 << 16)
+#define FORWARD_POLLFDS (FORWARD_MAX + 1 + 2 * FORWARD_RELAYS)
+
+struct forward_addr
+{
+	socklen_t len;
+	struct sockaddr_storage ss;
+	char spec[120];
+};
+
+struct forward
+{
+	struct forward *next;
+	int sock;		/* listening, in the container network namespace */
+	int dir;		/* of the unix socket file, removed at exit */
+	char *name;
+	struct forward_addr host;
+};
+
+struct relay
+{
+	int fd[2];		/* the accepted socket, and the host one */
+	int pipe[2][2];		/* the data from fd[i] to fd[!i] */
+	size_t queued[2];
+	unsigned eof[2], shut[2];
+};
+
+static struct
+{
+	int sock;		/* to the host process */
+	pid_t pid;
+	int n;
+	struct forward *head;
+	int nrelays;
+	struct relay relays[FORWARD_RELAYS];
+	int npending;		/* accepted, the host end requested, in order */
+	int pending[FORWARD_RELAYS];	/* -1 once dropped */
+} forwarding = { .sock = -1 };
+
+/* In the host process: connect for each request, until the launcher is gone */
+static void forward_host(int sock)
+{
+	struct forward_addr a;
+	int fd;
+
+	while (recv(sock, &a, sizeof(a), 0) == sizeof(a)) {
+		a.spec[sizeof(a.spec) - 1] = '\0';
+		/* never waits: a TCP connection may still be on the way */
+		fd = socket(a.ss.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+		if (fd >= 0 && (connect(fd, (struct sockaddr *)&a.ss, a.len) == 0 ||
+				EINPROGRESS == errno))
+			send_fd(sock, fd);
+		else {
+			error("forward: %s: %s\n", a.spec, strerror(errno));
+			send(sock, "", 1, 0);
+		}
+		if (fd >= 0)
+			close(fd);
+	}
+	_exit(0);
+}
+
+/*
+ * Whether the configuration has 'forward' lines, before it is read for
+ * good: the host process has to be started before unshare(2). Standard
+ * input can't be read twice, so that may forward.
+ */
+static int config_forwards(const char *config)
+{
+	int quiet = verbose, ret = 0;
+	char line[BUFSIZ], *dir, *arg;
+	FILE *fp;
+
+	if (!strcmp(config, "-"))
+		return 1;
+	verbose = 0;
+	fp = open_config(config, &dir);
+	verbose = quiet;
+	if (!fp)
+		return 0;
+	while (!ret && fgets(line, sizeof(line), fp)) {
+		arg = line + strspn(line, spaces);
+		ret = expect_id("forward", &arg);
+	}
+	fclose(fp);
+	free(dir);
+	return ret;
+}
+
+/* Before unshare(2), when the configuration forwards */
+static int start_forward_host(void)
+{
+	int sv[2];
+
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) != 0) {
+		error("forward: socketpair: %s\n", strerror(errno));
+		return -1;
+	}
+	switch (forwarding.pid = fork()) {
+	case -1:
+		error("forward: fork: %s\n", strerror(errno));
+		close(sv[0]);
+		close(sv[1]);
+		return -1;
+	case 0:
+		/* nothing of the launcher but the standard error */
+		if (dup2(sv[1], STDIN_FILENO) < 0 || drop_privileges())
+			_exit(2);
+		close(STDOUT_FILENO);
+		close_range(3, ~0U, 0);
+		forward_host(STDIN_FILENO);
+	}
+	close(sv[1]);
+	/* the replies are read as they come, from poll(2) */
+	fcntl(sv[0], F_SETFL, O_NONBLOCK);
+	forwarding.sock = sv[0];
+	return 0;
+}
+
+static void stop_forward_host(void)
+{
+	if (forwarding.sock < 0)
+		return;
+	close(forwarding.sock);
+	forwarding.sock = -1;
+	while (waitpid(forwarding.pid, NULL, 0) < 0 && EINTR == errno)
+		;
+}
+
+/* tcp:<port> (on 127.0.0.1), unix:<path> or unix:@<abstract name> */
+static int parse_forward(const char *spec, const char *dir, struct forward_addr *a)
+{
+	struct sockaddr_in *in = (struct sockaddr_in *)&a->ss;
+	struct sockaddr_un *un = (struct sockaddr_un *)&a->ss;
+	const char *name = spec + 5;
+	unsigned long port;
+	char *e;
+
+	memset(a, 0, sizeof(*a));
+	if (strlen(spec) >= sizeof(a->spec))
+		return -1;
+	strcpy(a->spec, spec);
+	if (!strncmp(spec, "tcp:", 4)) {
+		port = strtoul(spec + 4, &e, 10);
+		if (e == spec + 4 || *e || !port || port > 65535)
+			return -1;
+		in->sin_family = AF_INET;
+		in->sin_port = htons(port);
+		in->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		a->len = sizeof(*in);
+		return 0;
+	}
+	if (strncmp(spec, "unix:", 5) || !*name)
+		return -1;
+	un->sun_family = AF_UNIX;
+	if ('@' == *name) {
+		/* an abstract name has no NUL, the length ends it */
+		if (strlen(name) > sizeof(un->sun_path))
+			return -1;
+		memcpy(un->sun_path + 1, name + 1, strlen(name) - 1);
+		a->len = offsetof(struct sockaddr_un, sun_path) + strlen(name);
+		return 0;
+	}
+	if (dir)
+		name = abspath(dir, name);
+	else if (!is_absolute(name))
+		return -1;
+	if (strlen(name) >= sizeof(un->sun_path))
+		return -1;
+	strcpy(un->sun_path, name);
+	a->len = sizeof(*un);
+	return 0;
+}
+
+static void drop_relay(int i)
+{
+	struct relay *r = &forwarding.relays[i];
+	int j;
+
+	for (j = 0; j < 2; ++j) {
+		close(r->fd[j]);
+		if (r->pipe[j][0] >= 0) {
+			close(r->pipe[j][0]);
+			close(r->pipe[j][1]);
+		}
+	}
+	*r = forwarding.relays[--forwarding.nrelays];
+}
+
+/* The relays of a run, and the connections still waiting for the host */
+static void drop_relays(void)
+{
+	int i;
+
+	while (forwarding.nrelays)
+		drop_relay(forwarding.nrelays - 1);
+	/* the replies to come still pop them */
+	for (i = 0; i < forwarding.npending; ++i)
+		if (forwarding.pending[i] >= 0) {
+			close(forwarding.pending[i]);
+			forwarding.pending[i] = -1;
+		}
+}
+
+static int close_forwards(void *ctx, int status)
+{
+	struct fs_creds creds;
+	struct forward *f;
+
+	(void)ctx;
+	(void)status;
+	drop_relays();
+	while ((f = forwarding.head)) {
+		forwarding.head = f->next;
+		close(f->sock);
+		/* whatever is there by now, as the user who made it */
+		if (f->dir >= 0) {
+			user_fs_creds(&creds);
+			unlinkat(f->dir, f->name, 0);
+			restore_fs_creds(&creds);
+			close(f->dir);
+		}
+		free(f->name);
+		free(f);
+	}
+	stop_forward_host();
+	return 0;
+}
+
+/* The listening socket, at the path as the invoking user */
+static int listen_forward(struct forward *f, const struct forward_addr *a)
+{
+	const struct sockaddr_un *un = (const struct sockaddr_un *)&a->ss;
+	struct fs_creds creds;
+	char *path = NULL, *slash;
+	int one = 1, ret;
+
+	f->sock = socket(a->ss.ss_family, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+	if (f->sock < 0)
+		return -1;
+	if (AF_INET == a->ss.ss_family)
+		setsockopt(f->sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	else if (un->sun_path[0]) {
+		path = strdup(un->sun_path);
+		slash = strrchr(path, '/');
+		*slash = '\0';
+		f->name = strdup(slash + 1);
+	}
+	user_fs_creds(&creds);
+	ret = bind(f->sock, (const struct sockaddr *)&a->ss, a->len);
+	if (ret == 0 && path)
+		f->dir = open(*path ? path : "/", O_PATH | O_DIRECTORY | O_CLOEXEC);
+	restore_fs_creds(&creds);
+	free(path);
+	if (ret != 0 || listen(f->sock, SOMAXCONN) != 0)
+		return -1;
+	return 0;
+}
+
+/* forward <inside> [<host>]: the same address on the host if not given */
+static int do_config_forward(const char *config_dir, char *arg)
+{
+	struct forward_addr inside;
+	struct forward *f;
+	char *host;
+
+	arg = cleanup(arg);
+	host = arg + strcspn(arg, spaces_lf);
+	if (*host)
+		*host++ = '\0';
+	host += strspn(host, spaces_lf);
+	if (!*host)
+		host = arg;
+	f = calloc(1, sizeof(*f));
+	f->sock = f->dir = -1;
+	if (!*arg || host[strcspn(host, spaces_lf)] ||
+	    parse_forward(arg, config_dir, &inside) != 0 ||
+	    parse_forward(host, NULL, &f->host) != 0) {
+		error("'forward' expects tcp:<port>, unix:<path> or unix:@<name>, "
+		      "and optionally the host one (with an absolute path)\n");
+		free(f);
+		return -1;
+	}
+	if (!netns) {
+		error("forward: %s: needs a network namespace (-N)\n", arg);
+		free(f);
+		return -1;
+	}
+	if (check_config) {
+		printf("# forward '%s' to '%s'\n", inside.spec, f->host.spec);
+		free(f);
+		return 0;
+	}
+	if (forwarding.n == FORWARD_MAX || forwarding.sock < 0 ||
+	    listen_forward(f, &inside) != 0) {
+		error("forward: %s: %s\n", arg,
+		      forwarding.n == FORWARD_MAX ? "too many" :
+		      forwarding.sock < 0 ? "no host process" : strerror(errno));
+		if (f->sock >= 0)
+			close(f->sock);
+		free(f->name);
+		free(f);
+		return -1;
+	}
+	if (!forwarding.head)
+		push_at_exit(close_forwards, NULL);
+	f->next = forwarding.head;
+	forwarding.head = f;
+	++forwarding.n;
+	return 0;
+}
+
+static int forward_slots(void)
+{
+	return FORWARD_RELAYS - forwarding.nrelays - forwarding.npending;
+}
+
+/* Accept, and ask the host process for the other end: it replies later */
+static void forward_accept(struct forward *f)
+{
+	int fd;
+
+	while (forward_slots() > 0 &&
+	       (fd = accept4(f->sock, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+		if (send(forwarding.sock, &f->host, sizeof(f->host), MSG_DONTWAIT) < 0) {
+			error("forward: %s: %s\n", f->host.spec, strerror(errno));
+			close(fd);
+			continue;
+		}
+		forwarding.pending[forwarding.npending++] = fd;
+	}
+}
+
+/* The host ends connected by now, for the oldest requests */
+static void forward_replies(void)
+{
+	struct relay *r;
+	int fd, host, j;
+
+	while (forwarding.npending) {
+		host = recv_fd(forwarding.sock);
+		if (host < 0 && EAGAIN == errno)
+			break;
+		fd = forwarding.pending[0];
+		memmove(forwarding.pending, forwarding.pending + 1,
+			--forwarding.npending * sizeof(*forwarding.pending));
+		/* the host process has reported a failure */
+		if (host < 0 || fd < 0) {
+			if (host >= 0)
+				close(host);
+			if (fd >= 0)
+				close(fd);
+			continue;
+		}
+		r = &forwarding.relays[forwarding.nrelays++];
+		memset(r, 0, sizeof(*r));
+		r->fd[0] = fd;
+		r->fd[1] = host;
+		for (j = 0; j < 2; ++j)
+			if (pipe2(r->pipe[j], O_CLOEXEC | O_NONBLOCK) != 0) {
+				r->pipe[j][0] = r->pipe[j][1] = -1;
+				error("forward: pipe: %s\n", strerror(errno));
+			}
+		if (r->pipe[0][0] < 0 || r->pipe[1][0] < 0)
+			drop_relay(forwarding.nrelays - 1);
+	}
+}
+
+/* Move what can be moved both ways; -1 once the relay is done with */
+static int relay_move(struct relay *r)
+{
+	ssize_t n;
+	int i;
+
+	for (i = 0; i < 2; ++i) {
+		if (!r->eof[i] && !r->queued[i]) {
+			n = splice(r->fd[i], NULL, r->pipe[i][1], NULL, FORWARD_CHUNK,
+				   SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+			if (n > 0)
+				r->queued[i] = n;
+			else if (!n)
+				r->eof[i] = 1;
+			else if (EAGAIN != errno)
+				return -1;
+		}
+		if (r->queued[i]) {
+			n = splice(r->pipe[i][0], NULL, r->fd[!i], NULL, r->queued[i],
+				   SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+			if (n > 0)
+				r->queued[i] -= n;
+			else if (n < 0 && EAGAIN != errno)
+				return -1;
+		}
+		/* pass the end of the data on, the other way may go on */
+		if (r->eof[i] && !r->queued[i] && !r->shut[i]) {
+			shutdown(r->fd[!i], SHUT_WR);
+			r->shut[i] = 1;
+		}
+	}
+	return r->shut[0] && r->shut[1] ? -1 : 0;
+}
+
+/* The poll(2) entries of the forwarding, FORWARD_POLLFDS at most */
+static int forward_pollfds(struct pollfd *p)
+{
+	struct forward *f;
+	int i, j, n = 0;
+
+	/* no new connections while all the relays are busy */
+	for (f = forwarding.head; f; f = f->next, ++n) {
+		p[n].fd = forward_slots() > 0 ? f->sock : -1;
+		p[n].events = POLLIN;
+	}
+	p[n].fd = forwarding.npending ? forwarding.sock : -1;
+	p[n++].events = POLLIN;
+	for (i = 0; i < forwarding.nrelays; ++i) {
+		struct relay *r = &forwarding.relays[i];
+
+		for (j = 0; j < 2; ++j, ++n) {
+			p[n].events = (!r->eof[j] && !r->queued[j] ? POLLIN : 0) |
+				      (r->queued[!j] ? POLLOUT : 0);
+			p[n].fd = p[n].events ? r->fd[j] : -1;
+		}
+	}
+	return n;
+}
+
+static void forward_events(const struct pollfd *p)
+{
+	const struct pollfd *q = p + forwarding.n + 1;
+	struct forward *f;
+	int i;
+
+	/* backwards: a dropped relay is replaced with the last one */
+	for (i = forwarding.nrelays - 1; i >= 0; --i)
+		if ((q[2 * i].revents || q[2 * i + 1].revents) &&
+		    relay_move(&forwarding.relays[i]) != 0)
+			drop_relay(i);
+	if (q[-1].revents)
+		forward_replies();
+	for (f = forwarding.head; f; f = f->next, ++p)
+		if (p->revents)
+			forward_accept(f);
+}
+
+/*
+ * --memoize: a run is keyed by a BLAKE3 hash of the configuration text,
+ * the trees of its 'from' paths (the names, modes, inodes, sizes and
+ * modification times, not crossing mount points), the program with its
+ * arguments, the -E variables, and the working directory. A hit restores
+ * the overlay upper directories saved by the first run, and its exit
+ * status, instead of running the program; the exit actions, like
+ * 'commit', run as usual.
+ */
+#define MEMO_MAX_UPPERS 16
+
+struct memo
+{
+	int enabled;
+	char *path;	/* the cache directory */
+	int dir;
+	struct blake3 h;
+	char key[BLAKE3_OUT_LEN * 2 + 1];
+	int nuppers;
+	int uppers[MEMO_MAX_UPPERS];
+	char *upper_paths[MEMO_MAX_UPPERS];
+};
+static struct memo memo = { .dir = -1 };
+
+/* A string, with its NUL: the strings cannot run into each other */
+static void memo_string(const char *s)
+{
+	blake3_update(&memo.h, s, strlen(s) + 1);
+}
+
+static void memo_stat(const char *name, const struct stat *st)
+{
+	uint64_t v[6] = {
+		st->st_mode, st->st_ino, st->st_size,
+		st->st_mtim.tv_sec, st->st_mtim.tv_nsec, st->st_rdev,
+	};
+
+	memo_string(name);
+	blake3_update(&memo.h, v, sizeof(v));
+}
+
+static int cmp_name(const void *a, const void *b)
+{
+	return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+static void memo_tree(int dirfd, dev_t dev)
+{
+	int i, n = 0, nalloc = 0, fd = openat(dirfd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	DIR *dir = fd < 0 ? NULL : fdopendir(fd);
+	char **names = NULL;
+	struct dirent *de;
+	struct stat st;
+
+	if (!dir) {
+		if (fd >= 0)
+			close(fd);
+		blake3_update(&memo.h, &errno, sizeof(errno));
+		return;
+	}
+	while ((de = readdir(dir))) {
+		if (is_dot_or_dotdot(de->d_name))
+			continue;
+		if (n == nalloc)
+			names = realloc(names, sizeof(*names) * (nalloc = nalloc ? 2 * nalloc : 64));
+		names[n++] = strdup(de->d_name);
+	}
+	/* the order of readdir(3) is not stable everywhere */
+	qsort(names, n, sizeof(*names), cmp_name);
+	for (i = 0; i < n; ++i) {
+		if (fstatat(fd, names[i], &st, AT_SYMLINK_NOFOLLOW) != 0)
+			memset(&st, 0, sizeof(st));
+		memo_stat(names[i], &st);
+		if (S_ISDIR(st.st_mode) && st.st_dev == dev) {
+			int sub = openat(fd, names[i], O_PATH | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+
+			if (sub >= 0) {
+				memo_tree(sub, dev);
+				close(sub);
+			}
+		}
+		free(names[i]);
+	}
+	/* the end of the directory, as an empty name */
+	memo_string("");
+	free(names);
+	closedir(dir);
+}
+
+/*
+ * A 'from' path of the configuration. The root itself is known by its
+ * mode only: a directory made afresh by each run (like an empty upper)
+ * does not change the key.
+ */
+static void memo_from_path(const char *path, int fd)
+{
+	struct fs_creds creds;
+	struct stat st;
+
+	if (!memo.enabled || check_config)
+		return;
+	memo_string(path);
+	if (fd < 0 || fstat(fd, &st) != 0) {
+		memo_string("-");
+		return;
+	}
+	if (!S_ISDIR(st.st_mode)) {
+		memo_stat("", &st);
+		return;
+	}
+	blake3_update(&memo.h, &st.st_mode, sizeof(st.st_mode));
+	user_fs_creds(&creds);
+	memo_tree(fd, st.st_dev);
+	restore_fs_creds(&creds);
+}
+
+/* The upper of a read-write overlay, saved and restored */
+static void memo_upper(const struct stk *upper)
+{
+	if (!memo.enabled || check_config || upper->fd < 0)
+		return;
+	if (memo.nuppers == MEMO_MAX_UPPERS) {
+		error("memoize: %s: too many overlays, not saved\n", upper->val);
+		return;
+	}
+	memo.uppers[memo.nuppers] = fcntl(upper->fd, F_DUPFD_CLOEXEC, 3);
+	memo.upper_paths[memo.nuppers++] = strdup(upper->val);
+}
+
+static int setup_memo(const char *path)
+{
+	struct fs_creds creds;
+
+	user_fs_creds(&creds);
+	memo.dir = mkdir_p(AT_FDCWD, path, 0755);
+	restore_fs_creds(&creds);
+	if (memo.dir < 0) {
+		error("memoize: %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+	memo.path = strdup(path);
+	return 0;
+}
+
+static int store_memo(void *ctx, int status)
+{
+	char tmp[64], name[32];
+	struct fs_creds creds;
+	FILE *fp = NULL;
+	int i, fd, ret = -1;
+
+	/* killed by a signal is no result */
+	if (status >= 128)
+		return 0;
+	snprintf(tmp, sizeof(tmp), ".tmp.%ld", (long)getpid());
+	user_fs_creds(&creds);
+	fd = mkdirat(memo.dir, tmp, 0755) == 0 ?
+		openat(memo.dir, tmp, O_PATH | O_DIRECTORY | O_CLOEXEC) : -1;
+	restore_fs_creds(&creds);
+	for (i = 0; fd >= 0 && i < memo.nuppers; ++i) {
+		int ufd;
+
+		snprintf(name, sizeof(name), "upper.%d", i);
+		user_fs_creds(&creds);
+		ufd = mkdirat(fd, name, 0755) == 0 ?
+			openat(fd, name, O_PATH | O_DIRECTORY | O_CLOEXEC) : -1;
+		restore_fs_creds(&creds);
+		if (ufd < 0 || clone_tree(memo.uppers[i], ufd, memo.upper_paths[i], name) < 0)
+			i = memo.nuppers + 1;
+		if (ufd >= 0)
+			close(ufd);
+	}
+	user_fs_creds(&creds);
+	if (fd >= 0 && i == memo.nuppers &&
+	    (fp = fdopen(openat(fd, "status", O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644), "w")) &&
+	    fprintf(fp, "%d\n", status) > 0 && fclose(fp) == 0) {
+		fp = NULL;
+		/* a concurrent run with the same key may have been first */
+		if (renameat(memo.dir, tmp, memo.dir, memo.key) == 0 ||
+		    EEXIST == errno || ENOTEMPTY == errno)
+			ret = 0;
+	}
+	if (fp)
+		fclose(fp);
+	if (ret != 0)
+		error("memoize: %s/%s: %s\n", memo.path, memo.key, strerror(errno));
+	else if (verbose > 1)
+		fprintf(stderr, "%s: memoized %s\n", build_container, memo.key);
+	if (fd >= 0) {
+		close(fd);
+		remove_tree(memo.dir, tmp);
+	}
+	restore_fs_creds(&creds);
+	return ret;
+}
+
+/* The exit status of the saved run, or -1 if there is none */
+static int replay_memo(void)
+{
+	struct fs_creds creds;
+	char name[32];
+	int i, fd, status = -1;
+	FILE *fp;
+
+	user_fs_creds(&creds);
+	fd = openat(memo.dir, memo.key, O_PATH | O_DIRECTORY | O_CLOEXEC);
+	fp = fd < 0 ? NULL : fdopen(openat(fd, "status", O_RDONLY | O_CLOEXEC), "r");
+	restore_fs_creds(&creds);
+	if (!fp || fscanf(fp, "%d", &status) != 1)
+		status = -1;
+	if (fp)
+		fclose(fp);
+	for (i = 0; status >= 0 && i < memo.nuppers; ++i) {
+		int ufd;
+
+		snprintf(name, sizeof(name), "upper.%d", i);
+		user_fs_creds(&creds);
+		ufd = openat(fd, name, O_PATH | O_DIRECTORY | O_CLOEXEC);
+		restore_fs_creds(&creds);
+		if (ufd < 0 || clone_tree(ufd, memo.uppers[i], name, memo.upper_paths[i]) < 0) {
+			error("memoize: %s/%s/%s: restore failed\n", memo.path, memo.key, name);
+			status = 2;
+		}
+		if (ufd >= 0)
+			close(ufd);
+	}
+	if (fd >= 0)
+		close(fd);
+	return status;
+}
+
+/*
+ * After the configuration: replay a saved run, returning its status, or
+ * arrange for this one to be saved and return -1.
+ */
+static int start_memo(const char *cd_to, char **argv)
+{
+	uint8_t hash[BLAKE3_OUT_LEN];
+	int i, status;
+
+	memo_string(cd_to ? cd_to : "");
+	for (; *argv; ++argv)
+		memo_string(*argv);
+	blake3_final(&memo.h, hash);
+	for (i = 0; i < BLAKE3_OUT_LEN; ++i)
+		sprintf(memo.key + 2 * i, "%02x", hash[i]);
+	status = replay_memo();
+	if (status >= 0) {
+		if (verbose)
+			fprintf(stderr, "%s: memoized run %s (%d)\n", build_container,
+				memo.key, status);
+		return status;
+	}
+	push_at_exit(store_memo, NULL);
+	return -1;
+}
+
+static int open_config_dir(const char *config_dir)
+{
+	if (config_dirfd >= 0)
+		close(config_dirfd);
+	config_dirfd = resolve(AT_FDCWD, config_dir, O_DIRECTORY);
+	if (config_dirfd >= 0)
+		return 0;
+	error("%s: %s\n", config_dir, strerror(errno));
+	config_dirfd = AT_FDCWD;
+	return -1;
+}
+
+/*
+ * The CPU affinity, NUMA memory binding, scheduling policy, nice value
+ * and I/O priority of the <prog>, set from the command line or the
+ * configuration and applied right before the exec.
+ */
+#define MAX_NUMA_NODES 1024
+
+static struct sched_opts
+{
+	char *cpus, *numa, *policy, *nice, *ioprio;	/* as given */
+	cpu_set_t cpuset;
+	unsigned long nodes[MAX_NUMA_NODES / (8 * sizeof(unsigned long))];
+	int policy_val, nice_val, ioprio_val;
+} sched_opts;
+
+/* Parse a "0-3,8,10-11" list into a bit mask of @nbits */
+static int parse_id_list(const char *s, unsigned long *mask, int nbits)
+{
+	const int w = 8 * sizeof(*mask);
+
+	memset(mask, 0, nbits / 8);
+	do {
+		char *e;
+		long lo = strtol(s, &e, 10), hi = lo;
+
+		if (e == s || lo < 0)
+			return -1;
+		if (*e == '-') {
+			s = e + 1;
+			hi = strtol(s, &e, 10);
+			if (e == s || hi < lo)
+				return -1;
+		}
+		if (hi >= nbits)
+			return -1;
+		for (; lo <= hi; ++lo)
+			mask[lo / w] |= 1UL << lo % w;
+		s = e;
+	} while (*s++ == ',');
+	return s[-1] ? -1 : 0;
+}
+
+static int set_sched_opt(const char *name, const char *val)
+{
+	char *e;
+	long n;
+
+	if (!strcmp(name, "cpus")) {
+		unsigned long mask[CPU_SETSIZE / (8 * sizeof(unsigned long))];
+		int i;
+
+		if (parse_id_list(val, mask, CPU_SETSIZE) != 0)
+			goto invalid;
+		CPU_ZERO(&sched_opts.cpuset);
+		for (i = 0; i < CPU_SETSIZE; ++i)
+			if (mask[i / (8 * sizeof(*mask))] & 1UL << i % (8 * sizeof(*mask)))
+				CPU_SET(i, &sched_opts.cpuset);
+		if (!CPU_COUNT(&sched_opts.cpuset))
+			goto invalid;
+		free(sched_opts.cpus);
+		sched_opts.cpus = strdup(val);
+	} else if (!strcmp(name, "numa")) {
+		if (parse_id_list(val, sched_opts.nodes, MAX_NUMA_NODES) != 0)
+			goto invalid;
+		free(sched_opts.numa);
+		sched_opts.numa = strdup(val);
+	} else if (!strcmp(name, "sched")) {
+		if (!strcmp(val, "other") || !strcmp(val, "normal"))
+			sched_opts.policy_val = SCHED_OTHER;
+		else if (!strcmp(val, "batch"))
+			sched_opts.policy_val = SCHED_BATCH;
+		else if (!strcmp(val, "idle"))
+			sched_opts.policy_val = SCHED_IDLE;
+		else
+			goto invalid;
+		free(sched_opts.policy);
+		sched_opts.policy = strdup(val);
+	} else if (!strcmp(name, "nice")) {
+		n = strtol(val, &e, 10);
+		if (e == val || *e || n < -20 || n > 19)
+			goto invalid;
+		sched_opts.nice_val = n;
+		free(sched_opts.nice);
+		sched_opts.nice = strdup(val);
+	} else if (!strcmp(name, "ioprio")) {
+		int class = 0;
+
+		n = 4;
+		if (!strncmp(val, "rt", 2))
+			class = IOPRIO_CLASS_RT;
+		else if (!strncmp(val, "be", 2))
+			class = IOPRIO_CLASS_BE;
+		else if (!strcmp(val, "idle"))
+			class = IOPRIO_CLASS_IDLE, n = 0;
+		if (class == IOPRIO_CLASS_RT || class == IOPRIO_CLASS_BE) {
+			e = (char *)val + 2;
+			if (*e == ':' && (n = strtol(e + 1, &e, 10), n < 0 || n > 7))
+				goto invalid;
+			if (*e)
+				goto invalid;
+		}
+		if (!class)
+			goto invalid;
+		sched_opts.ioprio_val = IOPRIO_PRIO_VALUE(class, n);
+		free(sched_opts.ioprio);
+		sched_opts.ioprio = strdup(val);
+	} else
+		goto invalid;
+	return 0;
+invalid:
+	error("invalid %s '%s'\n", name, val);
+	return -1;
+}
+
+static const char *expect_sched_opt(char **s)
+{
+	static const char *const names[] = { "cpus", "numa", "sched", "nice", "ioprio" };
+	int i;
+
+	for (i = 0; i < sizeof(names) / sizeof(*names); ++i)
+		if (expect_id(names[i], s))
+			return names[i];
+	return NULL;
+}
+
+static void print_sched_opts(void)
+{
+	if (sched_opts.cpus)
+		printf("# cpus %s\n", sched_opts.cpus);
+	if (sched_opts.numa)
+		printf("# numa %s\n", sched_opts.numa);
+	if (sched_opts.policy)
+		printf("# sched %s\n", sched_opts.policy);
+	if (sched_opts.nice)
+		printf("# nice %s\n", sched_opts.nice);
+	if (sched_opts.ioprio)
+		printf("# ioprio %s\n", sched_opts.ioprio);
+}
+
+/* After dropping the privileges: the limits of the invoking user apply */
+static int apply_sched_opts(void)
+{
+	struct sched_param param = { 0 };
+
+	if (sched_opts.cpus &&
+	    sched_setaffinity(0, sizeof(sched_opts.cpuset), &sched_opts.cpuset) != 0) {
+		error("sched_setaffinity(%s): %s\n", sched_opts.cpus, strerror(errno));
+		return -1;
+	}
+	if (sched_opts.numa &&
+	    syscall(SYS_set_mempolicy, MPOL_BIND, sched_opts.nodes, MAX_NUMA_NODES) != 0) {
+		error("set_mempolicy(%s): %s\n", sched_opts.numa, strerror(errno));
+		return -1;
+	}
+	if (sched_opts.policy &&
+	    sched_setscheduler(0, sched_opts.policy_val, &param) != 0) {
+		error("sched_setscheduler(%s): %s\n", sched_opts.policy, strerror(errno));
+		return -1;
+	}
+	if (sched_opts.nice &&
+	    setpriority(PRIO_PROCESS, 0, sched_opts.nice_val) != 0) {
+		error("setpriority(%s): %s\n", sched_opts.nice, strerror(errno));
+		return -1;
+	}
+	if (sched_opts.ioprio &&
+	    syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, sched_opts.ioprio_val) != 0) {
+		error("ioprio_set(%s): %s\n", sched_opts.ioprio, strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+static int do_config(const char *config)
+{
+	char line[BUFSIZ];
+	struct stk *head = NULL;
+	int ret = 0;
+	char *config_dir;
+	FILE *fp = open_config(config, &config_dir);
+
+	if (!fp) {
+		error("config file: %s: %s\n", config, strerror(errno));
+		return -1;
+	}
+	ret = open_config_dir(config_dir);
+	while (ret == 0 && fgets(line, BUFSIZ, fp)) {
+		char *arg = line + strspn(line, spaces);
+		const char *name;
+
+		if ('#' == *arg)
+			continue;
+		if (memo.enabled)
+			memo_string(arg);
+		/*
+		 * XXX the paths are delimited by EOL token and cannot begin with
+		 * XXX a whitespace character: all leading space is removed.
+		 */
+		if (expect_id("from", &arg))
+			ret = push_config_path(&head, FROM, config_dir, cleanup(arg), 0);
+		else if (expect_id("from!", &arg))
+			ret = push_config_path(&head, FROM, config_dir, cleanup(arg), 1);
+		else if (expect_id("to", &arg))
+			ret = push_config_path(&head, TO, config_dir, cleanup(arg), 0);
+		else if (expect_id("to!", &arg))
+			ret = push_config_path(&head, TO, config_dir, cleanup(arg), 1);
+		else if (expect_id("work", &arg))
+			ret = push_config_path(&head, WORK, config_dir, cleanup(arg), 0);
+		else if (expect_id("work!", &arg))
+			ret = push_config_path(&head, WORK, config_dir, cleanup(arg), 1);
+		else if (expect_id("mount", &arg))
+			ret = do_config_mount(&head, arg);
+		else if (expect_id("bind", &arg))
+			ret = do_config_bind(&head, arg);
+		else if (expect_id("bind-list", &arg))
+			ret = do_config_bind_list(config_dir, arg);
+		else if (expect_id("move", &arg))
+			ret = do_config_move(&head, arg);
+		else if (expect_id("union", &arg))
+			ret = do_config_union(&head, config_dir, arg);
+		else if (expect_id("image-union", &arg))
+			ret = do_config_image_union(&head, arg);
+		else if (expect_id("overlay", &arg))
+			ret = do_config_overlay(&head, arg);
+		else if (expect_id("commit", &arg))
+			ret = do_config_commit(&head, arg);
+		else if (expect_id("clone", &arg))
+			ret = do_config_clone(&head, arg);
+		else if (expect_id("manifest", &arg))
+			ret = do_config_manifest(&head, config_dir, arg);
+		else if (expect_id("ephemeral", &arg))
+			ret = do_config_ephemeral(&head, arg);
+		else if (expect_id("scratch", &arg))
+			ret = do_config_scratch(&head, arg);
+		else if (expect_id("forward", &arg))
+			ret = do_config_forward(config_dir, arg);
+		else if ((name = expect_sched_opt(&arg)))
+			ret = set_sched_opt(name, cleanup(arg));
+		else if (expect_id("chroot", &arg)) {
+			ret = do_chroot(abspath(config_dir, cleanup(arg)));
+			/* the relative paths are in the new root now */
+			if (ret == 0 && !check_config)
+				ret = open_config_dir(config_dir);
+		}
+	}
+	if (fp != stdin)
+		fclose(fp);
+	free(config_dir);
+	while (head) {
+		struct stk *a = head->next;
+		drop(head);
+		head = a;
+	}
+	if (config_dirfd >= 0)
+		close(config_dirfd);
+	config_dirfd = AT_FDCWD;
+	free(abspath_buf);
+	abspath_buf = NULL;
+	return ret;
+}
+
+/* The resource usage of the container, reported after it has finished */
+static struct rusage container_rusage;
+
+struct stats
+{
+	char *path;
+	int out;	/* the report file */
+	int json;
+	int cgroup;	/* the cgroup v2 directory of the launcher, or -1 */
+	char *cgroup_path;
+	struct timespec start;
+	FILE *fp;
+	int n;		/* the values written */
+};
+
+#define CGROUP_ROOT "/sys/fs/cgroup"
+
+/* The cgroup v2 directory of this process, on a unified or hybrid hierarchy */
+static int open_cgroup(char **path)
+{
+	static const char *const roots[] = { CGROUP_ROOT, CGROUP_ROOT "/unified" };
+	char line[PATH_MAX], dir[PATH_MAX + 32];
+	FILE *fp = fopen("/proc/self/cgroup", "r");
+	int i, fd = -1;
+
+	if (!fp)
+		return -1;
+	while (fgets(line, sizeof(line), fp))
+		if (!strncmp(line, "0::", 3))
+			break;
+	fclose(fp);
+	/* the root cgroup accounts for the whole host, not the container */
+	if (strncmp(line, "0::", 3) || !strcmp(cleanup(line), "0::/"))
+		return -1;
+	for (i = 0; i < sizeof(roots) / sizeof(*roots) && fd < 0; ++i) {
+		snprintf(dir, sizeof(dir), "%s%s", roots[i], line + 3);
+		fd = open(dir, O_PATH | O_DIRECTORY | O_CLOEXEC);
+		if (fd >= 0 && faccessat(fd, "cgroup.procs", F_OK, 0) != 0) {
+			close(fd);
+			fd = -1;
+		}
+	}
+	if (fd >= 0)
+		*path = strdup(line + 3);
+	return fd;
+}
+
+/* No process but this one in the cgroup, which then accounts for the container */
+static int cgroup_alone(int cgroup)
+{
+	int fd = openat(cgroup, "cgroup.procs", O_RDONLY | O_CLOEXEC);
+	FILE *fp = fd < 0 ? NULL : fdopen(fd, "r");
+	long pid;
+	int alone = !!fp;
+
+	if (!fp) {
+		if (fd >= 0)
+			close(fd);
+		return 0;
+	}
+	while (alone && fscanf(fp, "%ld", &pid) == 1)
+		alone = pid == getpid();
+	fclose(fp);
+	return alone;
+}
+
+static void stats_key(struct stats *s, const char *key)
+{
+	if (s->json)
+		fprintf(s->fp, "%s\n  \"%s\": ", s->n ? "," : "{", key);
+	else
+		fprintf(s->fp, "%-32s ", key);
+	++s->n;
+}
+
+static void stats_value(struct stats *s, const char *key, const char *fmt, ...)
+	__attribute__((format(printf, 3, 4)));
+
+static void stats_value(struct stats *s, const char *key, const char *fmt, ...)
+{
+	va_list ap;
+
+	stats_key(s, key);
+	va_start(ap, fmt);
+	vfprintf(s->fp, fmt, ap);
+	va_end(ap);
+	if (!s->json)
+		fputc('\n', s->fp);
+}
+
+static void stats_string(struct stats *s, const char *key, const char *val)
+{
+	stats_key(s, key);
+	if (s->json) {
+		fputc('"', s->fp);
+		for (; *val; ++val)
+			if ('"' == *val || '\\' == *val)
+				fprintf(s->fp, "\\%c", *val);
+			else if ((unsigned char)*val < ' ')
+				fprintf(s->fp, "\\u%04x", *val);
+			else
+				fputc(*val, s->fp);
+		fputs("\"", s->fp);
+	} else
+		fprintf(s->fp, "%s\n", val);
+}
+
+static double timeval_sec(const struct timeval *tv)
+{
+	return tv->tv_sec + tv->tv_usec / 1e6;
+}
+
+static FILE *open_cgroup_file(struct stats *s, const char *name)
+{
+	int fd = openat(s->cgroup, name, O_RDONLY | O_CLOEXEC);
+	FILE *fp = fd < 0 ? NULL : fdopen(fd, "r");
+
+	if (!fp && fd >= 0)
+		close(fd);
+	return fp;
+}
+
+/* The "key value" lines of cpu.stat, and the single value files */
+static void stats_cgroup_values(struct stats *s, const char *name, const char *prefix)
+{
+	char line[256], field[64], key[128], val[64];
+	FILE *fp = open_cgroup_file(s, name);
+
+	if (!fp)
+		return;
+	while (fgets(line, sizeof(line), fp))
+		if (sscanf(line, "%63s %63s", field, val) == 2) {
+			snprintf(key, sizeof(key), "%s%s", prefix, field);
+			stats_value(s, key, "%s", val);
+		} else if (sscanf(line, "%63s", val) == 1)
+			stats_value(s, prefix, "%s", val);
+	fclose(fp);
+}
+
+/* The sums over the devices of io.stat */
+static void stats_cgroup_io(struct stats *s)
+{
+	static const char *const keys[] = { "rbytes", "wbytes", "rios", "wios" };
+	unsigned long long sum[4] = { 0 };
+	char line[512];
+	FILE *fp = open_cgroup_file(s, "io.stat");
+	int i;
+
+	if (!fp)
+		return;
+	while (fgets(line, sizeof(line), fp))
+		for (i = 0; i < 4; ++i) {
+			char key[16], *p;
+
+			snprintf(key, sizeof(key), " %s=", keys[i]);
+			if ((p = strstr(line, key)))
+				sum[i] += strtoull(p + strlen(key), NULL, 10);
+		}
+	fclose(fp);
+	for (i = 0; i < 4; ++i) {
+		char key[32];
+
+		snprintf(key, sizeof(key), "cgroup.io.%s", keys[i]);
+		stats_value(s, key, "%llu", sum[i]);
+	}
+}
+
+/* The total stall times, in microseconds, of a PSI file */
+static void stats_cgroup_psi(struct stats *s, const char *name)
+{
+	char line[256], kind[8], key[64];
+	unsigned long long total;
+	FILE *fp = open_cgroup_file(s, name);
+	const char *p;
+
+	if (!fp)
+		return;
+	while (fgets(line, sizeof(line), fp))
+		if (sscanf(line, "%7s", kind) == 1 && (p = strstr(line, "total=")) &&
+		    sscanf(p, "total=%llu", &total) == 1) {
+			snprintf(key, sizeof(key), "cgroup.pressure.%.*s.%s_usec",
+				 (int)strcspn(name, "."), name, kind);
+			stats_value(s, key, "%llu", total);
+		}
+	fclose(fp);
+}
+
+static int report_stats(void *ctx, int status)
+{
+	struct stats *s = ctx;
+	const struct rusage *ru = &container_rusage;
+	struct timespec now;
+	int ret = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	s->fp = fdopen(s->out, "w");
+	if (!s->fp) {
+		error("stats: %s: %s\n", s->path, strerror(errno));
+		close(s->out);
+		ret = -1;
+		goto done;
+	}
+	stats_value(s, "status", "%d", status);
+	stats_value(s, "wall_sec", "%.3f", now.tv_sec - s->start.tv_sec +
+		    (now.tv_nsec - s->start.tv_nsec) / 1e9);
+	stats_value(s, "user_sec", "%.3f", timeval_sec(&ru->ru_utime));
+	stats_value(s, "system_sec", "%.3f", timeval_sec(&ru->ru_stime));
+	stats_value(s, "maxrss_kb", "%ld", ru->ru_maxrss);
+	stats_value(s, "minflt", "%ld", ru->ru_minflt);
+	stats_value(s, "majflt", "%ld", ru->ru_majflt);
+	stats_value(s, "inblock", "%ld", ru->ru_inblock);
+	stats_value(s, "oublock", "%ld", ru->ru_oublock);
+	stats_value(s, "nvcsw", "%ld", ru->ru_nvcsw);
+	stats_value(s, "nivcsw", "%ld", ru->ru_nivcsw);
+	if (s->cgroup >= 0) {
+		stats_string(s, "cgroup", s->cgroup_path);
+		stats_cgroup_values(s, "cpu.stat", "cgroup.cpu.");
+		stats_cgroup_values(s, "memory.peak", "cgroup.memory.peak");
+		stats_cgroup_values(s, "pids.peak", "cgroup.pids.peak");
+		stats_cgroup_io(s);
+		stats_cgroup_psi(s, "cpu.pressure");
+		stats_cgroup_psi(s, "memory.pressure");
+		stats_cgroup_psi(s, "io.pressure");
+	}
+	if (s->json)
+		fputs(s->n ? "\n}\n" : "{}\n", s->fp);
+	if (fclose(s->fp) != 0) {
+		error("stats: %s: %s\n", s->path, strerror(errno));
+		ret = -1;
+	}
+done:
+	if (s->cgroup >= 0)
+		close(s->cgroup);
+	free(s->cgroup_path);
+	free(s->path);
+	free(s);
+	return ret;
+}
+
+/* A report file, opened as the invoking user, or the standard error */
+static int open_report(const char *path, const char *what)
+{
+	struct fs_creds creds;
+	int fd;
+
+	if (path) {
+		user_fs_creds(&creds);
+		fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+		restore_fs_creds(&creds);
+	} else
+		fd = fcntl(STDERR_FILENO, F_DUPFD_CLOEXEC, 3);
+	if (fd < 0)
+		error("%s: %s: %s\n", what, path ? path : "stderr", strerror(errno));
+	return fd;
+}
+
+/*
+ * Open the report file and the cgroup directory now, they might be out
+ * of reach after a chroot.
+ */
+static struct stats *setup_stats(const char *path, int json)
+{
+	struct stats *s = calloc(1, sizeof(*s));
+
+	s->json = json;
+	s->path = strdup(path ? path : "stderr");
+	s->out = open_report(path, "stats");
+	if (s->out < 0) {
+		free(s->path);
+		free(s);
+		return NULL;
+	}
+	s->cgroup = open_cgroup(&s->cgroup_path);
+	if (s->cgroup >= 0 && !cgroup_alone(s->cgroup)) {
+		if (verbose > 1)
+			error("stats: cgroup %s: other processes, not reported\n", s->cgroup_path);
+		close(s->cgroup);
+		free(s->cgroup_path);
+		s->cgroup = -1;
+		s->cgroup_path = NULL;
+	}
+	return s;
+}
+
+static void start_stats(struct stats *s)
+{
+	clock_gettime(CLOCK_MONOTONIC, &s->start);
+	push_at_exit(report_stats, s);
+}
+
+/*
+ * --drop-cache: at exit, take the footprint of the build out of the page
+ * cache, so that it does not push out the pages of the toolchain that the
+ * next build needs. "outputs" drops the pages of the files in the overlay
+ * upper directories and of the committed files, after writing them back;
+ * "cgroup" asks the cgroup v2 of the launcher to reclaim all its memory.
+ */
+/* POSIX_FADV_DONTNEED drops the clean pages only: write the file back */
+static void drop_cache_at(int dir, const char *name)
+{
+	int fd = openat(dir, name, O_RDONLY | O_NOFOLLOW | O_NOATIME | O_CLOEXEC);
+
+	if (fd < 0 && EPERM == errno)
+		fd = openat(dir, name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+	if (fd < 0)
+		return;
+	sync_file_range(fd, 0, 0, SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE |
+			SYNC_FILE_RANGE_WAIT_AFTER);
+	posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+	close(fd);
+}
+
+static void drop_tree_cache(int dir)
+{
+	DIR *d = fdopendir(dir);
+	struct dirent *de;
+	struct stat st;
+	int sub;
+
+	if (!d) {
+		close(dir);
+		return;
+	}
+	while ((de = readdir(d))) {
+		if (is_dot_or_dotdot(de->d_name))
+			continue;
+		if (DT_UNKNOWN == de->d_type &&
+		    fstatat(dirfd(d), de->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0)
+			de->d_type = IFTODT(st.st_mode);
+		if (DT_REG == de->d_type)
+			drop_cache_at(dirfd(d), de->d_name);
+		else if (DT_DIR == de->d_type &&
+			 (sub = openat(dirfd(d), de->d_name, O_RDONLY | O_DIRECTORY |
+				       O_NOFOLLOW | O_CLOEXEC)) >= 0)
+			drop_tree_cache(sub);
+	}
+	closedir(d);
+}
+
+static int drop_output_cache(void *ctx, int status)
+{
+	int *fd = ctx, dir;
+	struct fs_creds creds;
+
+	user_fs_creds(&creds);
+	dir = openat(*fd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (dir >= 0)
+		drop_tree_cache(dir);
+	restore_fs_creds(&creds);
+	close(*fd);
+	free(fd);
+	return 0;
+}
+
+/*
+ * An overlay upper directory, dropped from the cache by an exit action of
+ * its own: after the later ones, like its commit, and before the earlier
+ * ones, like the scratch file system below it.
+ */
+static void drop_cache_output(const struct stk *dir)
+{
+	int *fd;
+
+	if (DROP_CACHE_OUTPUTS != drop_cache || check_config || dir->fd < 0)
+		return;
+	fd = malloc(sizeof(*fd));
+	*fd = fcntl(dir->fd, F_DUPFD_CLOEXEC, 3);
+	if (*fd < 0) {
+		free(fd);
+		return;
+	}
+	push_at_exit(drop_output_cache, fd);
+}
+
+static int reclaim_cgroup(void *ctx, int status)
+{
+	int *cg = ctx, fd, ret = 0;
+	char buf[32];
+	ssize_t n = -1;
+
+	fd = openat(*cg, "memory.current", O_RDONLY | O_CLOEXEC);
+	if (fd >= 0) {
+		n = read(fd, buf, sizeof(buf) - 1);
+		close(fd);
+	}
+	fd = openat(*cg, "memory.reclaim", O_WRONLY | O_CLOEXEC);
+	/* EAGAIN: less than asked for could be reclaimed */
+	if (n <= 0 || fd < 0 || (write(fd, buf, n) != n && EAGAIN != errno)) {
+		error("drop-cache: memory.reclaim: %s\n", strerror(errno));
+		ret = -1;
+	}
+	if (fd >= 0)
+		close(fd);
+	close(*cg);
+	free(cg);
+	return ret;
+}
+
+/* The cgroup is opened now, before a chroot; its reclaim is the last action */
+static void setup_drop_cache(void)
+{
+	char *path = NULL;
+	int *cg;
+
+	if (DROP_CACHE_CGROUP != drop_cache)
+		return;
+	cg = malloc(sizeof(*cg));
+	*cg = open_cgroup(&path);
+	if (*cg < 0 || faccessat(*cg, "memory.reclaim", F_OK, 0) != 0) {
+		error("drop-cache: %s\n", *cg < 0 ? "not in a cgroup v2 of its own" :
+		      "no memory.reclaim in the cgroup, nothing to reclaim");
+		if (*cg >= 0)
+			close(*cg);
+		free(path);
+		free(cg);
+		return;
+	}
+	free(path);
+	push_at_exit(reclaim_cgroup, cg);
+}
+
+/*
+ * --perf-stat: the performance counters of the container. With a cgroup v2
+ * of its own and the privileges, the launcher counts the cgroup on every
+ * CPU; otherwise it opens the counters disabled, inherited by the children,
+ * right before forking the container, so that they are enabled by the exec
+ * of the <prog> and count all its descendants. The hardware counters are
+ * reported as not supported where there is no PMU, like in many VMs.
+ */
+static const struct perf_counter
+{
+	const char *name;
+	__u32 type;
+	__u64 config;
+} perf_counters[] = {
+	{ "task_clock", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK },
+	{ "context_switches", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES },
+	{ "cpu_migrations", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CPU_MIGRATIONS },
+	{ "page_faults", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS },
+	{ "cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+	{ "instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+	{ "cache_references", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_REFERENCES },
+	{ "cache_misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+};
+#define NR_PERF_COUNTERS (sizeof(perf_counters) / sizeof(*perf_counters))
+
+struct perf_stat
+{
+	char *path;
+	int out;
+	int json;
+	int cgroup;	/* the cgroup directory, if counting per cgroup, or -1 */
+	char *cgroup_path;
+	int ncpus;	/* the fds per counter: the CPUs, or 1 */
+	int *fd;	/* [counter][cpu] */
+	int err[NR_PERF_COUNTERS];
+};
+
+static int perf_open(struct perf_event_attr *attr, pid_t pid, int cpu, unsigned long flags)
+{
+	int fd = syscall(SYS_perf_event_open, attr, pid, cpu, -1,
+			 flags | PERF_FLAG_FD_CLOEXEC);
+
+	/* perf_event_paranoid allows the user space only */
+	if (fd < 0 && (EACCES == errno || EPERM == errno) && !attr->exclude_kernel) {
+		attr->exclude_kernel = 1;
+		attr->exclude_hv = 1;
+		fd = syscall(SYS_perf_event_open, attr, pid, cpu, -1,
+			     flags | PERF_FLAG_FD_CLOEXEC);
+	}
+	return fd;
+}
+
+/* Open the counter i on all the CPUs for the cgroup, or inherited */
+static void perf_open_counter(struct perf_stat *p, int i)
+{
+	struct perf_event_attr attr = {
+		.size = sizeof(attr),
+		.type = perf_counters[i].type,
+		.config = perf_counters[i].config,
+		.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED |
+			       PERF_FORMAT_TOTAL_TIME_RUNNING,
+	};
+	int cpu, *fd = p->fd + i * p->ncpus, n = 0;
+
+	if (p->cgroup < 0) {
+		attr.disabled = 1;
+		attr.inherit = 1;
+		attr.enable_on_exec = 1;
+		fd[0] = perf_open(&attr, 0, -1, 0);
+		p->err[i] = fd[0] < 0 ? errno : 0;
+		return;
+	}
+	for (cpu = 0; cpu < p->ncpus; ++cpu) {
+		fd[cpu] = perf_open(&attr, p->cgroup, cpu, PERF_FLAG_PID_CGROUP);
+		if (fd[cpu] >= 0)
+			++n;
+		else if (ENODEV != errno)	/* an offline CPU */
+			p->err[i] = errno;
+	}
+	if (n)
+		p->err[i] = 0;
+	else if (!p->err[i])
+		p->err[i] = ENODEV;
+}
+
+static void close_perf_counters(struct perf_stat *p)
+{
+	int i;
+
+	for (i = 0; i < NR_PERF_COUNTERS * p->ncpus; ++i)
+		if (p->fd[i] >= 0)
+			close(p->fd[i]);
+	free(p->fd);
+	p->fd = NULL;
+}
+
+static void start_perf_counters(struct perf_stat *p)
+{
+	int i, cg = p->cgroup;
+
+	p->ncpus = cg >= 0 ? sysconf(_SC_NPROCESSORS_CONF) : 1;
+	p->fd = malloc(sizeof(*p->fd) * NR_PERF_COUNTERS * p->ncpus);
+	for (i = 0; i < NR_PERF_COUNTERS; ++i)
+		perf_open_counter(p, i);
+	if (cg >= 0 && p->err[0]) {
+		/* no cgroup events: count the processes instead */
+		if (verbose > 1)
+			error("perf-stat: cgroup %s: %s\n", p->cgroup_path, strerror(p->err[0]));
+		close_perf_counters(p);
+		close(cg);
+		p->cgroup = -1;
+		start_perf_counters(p);
+	}
+}
+
+static int read_perf_counter(struct perf_stat *p, int i, double *value, double *running)
+{
+	__u64 v[3];	/* value, time enabled, time running */
+	__u64 enabled = 0, run = 0;
+	int cpu, *fd = p->fd + i * p->ncpus;
+
+	*value = 0;
+	for (cpu = 0; cpu < p->ncpus; ++cpu) {
+		if (fd[cpu] < 0 || read(fd[cpu], v, sizeof(v)) != sizeof(v))
+			continue;
+		/* scaled if multiplexed with other counters */
+		if (v[2])
+			*value += (double)v[0] * v[1] / v[2];
+		enabled += v[1];
+		run += v[2];
+	}
+	*running = enabled ? (double)run / enabled : 0;
+	return run ? 0 : -1;
+}
+
+static int report_perf_stat(void *ctx, int status)
+{
+	struct perf_stat *p = ctx;
+	struct stats s = { .json = p->json };
+	double v[NR_PERF_COUNTERS], running, cycles = 0, instructions = 0;
+	char key[64];
+	int i, ret = 0;
+
+	s.fp = fdopen(p->out, "w");
+	if (!s.fp) {
+		error("perf-stat: %s: %s\n", p->path, strerror(errno));
+		close(p->out);
+		ret = -1;
+		goto done;
+	}
+	if (p->cgroup >= 0)
+		stats_string(&s, "perf.cgroup", p->cgroup_path);
+	for (i = 0; i < NR_PERF_COUNTERS; ++i) {
+		snprintf(key, sizeof(key), "perf.%s", perf_counters[i].name);
+		if (p->err[i])
+			stats_string(&s, key, "not supported");
+		else if (read_perf_counter(p, i, &v[i], &running) != 0)
+			stats_string(&s, key, "not counted");
+		else {
+			if (PERF_COUNT_SW_TASK_CLOCK == perf_counters[i].config &&
+			    PERF_TYPE_SOFTWARE == perf_counters[i].type)
+				stats_value(&s, "perf.task_clock_msec", "%.3f", v[i] / 1e6);
+			else
+				stats_value(&s, key, "%.0f", v[i]);
+			if (running < 0.9995) {
+				snprintf(key, sizeof(key), "perf.%s.running", perf_counters[i].name);
+				stats_value(&s, key, "%.3f", running);
+			}
+			if (PERF_TYPE_HARDWARE == perf_counters[i].type &&
+			    PERF_COUNT_HW_CPU_CYCLES == perf_counters[i].config)
+				cycles = v[i];
+			if (PERF_TYPE_HARDWARE == perf_counters[i].type &&
+			    PERF_COUNT_HW_INSTRUCTIONS == perf_counters[i].config)
+				instructions = v[i];
+		}
+	}
+	if (cycles > 0 && instructions > 0)
+		stats_value(&s, "perf.ipc", "%.3f", instructions / cycles);
+	if (s.json)
+		fputs(s.n ? "\n}\n" : "{}\n", s.fp);
+	if (fclose(s.fp) != 0) {
+		error("perf-stat: %s: %s\n", p->path, strerror(errno));
+		ret = -1;
+	}
+done:
+	close_perf_counters(p);
+	if (p->cgroup >= 0)
+		close(p->cgroup);
+	free(p->cgroup_path);
+	free(p->path);
+	free(p);
+	return ret;
+}
+
+/* The report file and the cgroup are opened now, like for --stats */
+static struct perf_stat *setup_perf_stat(const char *path, int json)
+{
+	struct perf_stat *p = calloc(1, sizeof(*p));
+	int cg;
+
+	p->json = json;
+	p->path = strdup(path ? path : "stderr");
+	p->out = open_report(path, "perf-stat");
+	if (p->out < 0) {
+		free(p->path);
+		free(p);
+		return NULL;
+	}
+	p->cgroup = -1;
+	/* the cgroup events are CPU-wide, with the privileges to match */
+	if (!privileges.euid && !userns && (cg = open_cgroup(&p->cgroup_path)) >= 0) {
+		p->cgroup = openat(cg, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		close(cg);
+	}
+	return p;
+}
+
+/* Right before forking the container */
+static void start_perf_stat(struct perf_stat *p)
+{
+	start_perf_counters(p);
+	push_at_exit(report_perf_stat, p);
+}
+
+/*
+ * The running containers, registered by their supervising parents: a unix
+ * socket <pid>.sock per container in STATUS_PATH (for root) or in
+ * $XDG_RUNTIME_DIR/build-container, answering each connection with the
+ * "<key> <value>" lines of the container and its current process count,
+ * CPU time and RSS, read from /proc. The parent serves it while relaying
+ * the --log, and then until the pidfd of the container tells that it has
+ * exited (no threads: the parent of a pid namespace cannot make any).
+ */
+struct status_server
+{
+	int dir;	/* the status directory, or -1 */
+	int proc;	/* /proc, opened before a chroot */
+	int sock;
+	int pidfd;
+	pid_t pid;
+	char name[32];
+	char *config;
+	char *cwd;
+	char *args;
+	time_t started;
+	struct timespec start;
+};
+static struct status_server status_server = { .dir = -1, .proc = -1, .sock = -1, .pidfd = -1 };
+
+static const char *status_dir(char *buf, size_t size)
+{
+	const char *run = getenv("XDG_RUNTIME_DIR");
+
+	if (!privileges.euid)
+		return STATUS_PATH;
+	if (!run || !is_absolute(run))
+		return NULL;
+	snprintf(buf, size, "%s/build-container", run);
+	return buf;
+}
+
+/* Before the unshare and the chroot */
+static void setup_status(const char *config)
+{
+	struct status_server *s = &status_server;
+	struct fs_creds creds;
+	char buf[PATH_MAX];
+	const char *dir = status_dir(buf, sizeof(buf));
+
+	if (!dir)
+		return;
+	if (privileges.euid)
+		user_fs_creds(&creds);
+	s->dir = mkdir_p(AT_FDCWD, dir, privileges.euid ? 0700 : 0755);
+	if (privileges.euid)
+		restore_fs_creds(&creds);
+	s->proc = open("/proc", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (s->dir < 0 || s->proc < 0) {
+		if (verbose > 1)
+			error("status: %s: %s\n", s->dir < 0 ? dir : "/proc", strerror(errno));
+		if (s->dir >= 0)
+			close(s->dir);
+		s->dir = -1;
+		return;
+	}
+	s->config = config ? realpath(config, NULL) : NULL;
+	if (config && !s->config)
+		s->config = strdup(config);
+	s->cwd = PWD ? strdup(PWD) : NULL;
+}
+
+struct proc_entry
+{
+	pid_t pid, ppid;
+	unsigned long long ticks;	/* user, system, and of the waited-for children */
+	long rss;
+	int in;
+};
+
+static int read_proc_entry(int proc, const char *name, struct proc_entry *e)
+{
+	char path[64], buf[1024], *p;
+	unsigned long long t[4];
+	int fd, n;
+
+	snprintf(path, sizeof(path), "%s/stat", name);
+	fd = openat(proc, path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+	n = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (n <= 0)
+		return -1;
+	buf[n] = '\0';
+	/* the comm may have spaces and parentheses */
+	p = strrchr(buf, ')');
+	if (!p || sscanf(p + 2, "%*c %d %*d %*d %*d %*d %*u %*u %*u %*u %*u "
+			 "%llu %llu %llu %llu %*d %*d %*d %*d %*u %*u %ld",
+			 &e->ppid, &t[0], &t[1], &t[2], &t[3], &e->rss) != 6)
+		return -1;
+	e->pid = atoi(name);
+	e->ticks = t[0] + t[1] + t[2] + t[3];
+	e->in = 0;
+	return 0;
+}
+
+/*
+ * The container process and its descendants. Summing the times of the
+ * waited-for children too counts each finished process once, in the one
+ * that reaped it.
+ */
+static void status_usage(struct status_server *s, int *nproc, double *cpu, long *rss_kb)
+{
+	struct proc_entry *v = NULL;
+	int i, n = 0, nalloc = 0, more, fd;
+	struct dirent *de;
+	DIR *dir;
+
+	*nproc = 0;
+	*cpu = 0;
+	*rss_kb = 0;
+	fd = openat(s->proc, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	dir = fd < 0 ? NULL : fdopendir(fd);
+	if (!dir) {
+		if (fd >= 0)
+			close(fd);
+		return;
+	}
+	while ((de = readdir(dir))) {
+		if (de->d_name[0] < '1' || de->d_name[0] > '9')
+			continue;
+		if (n == nalloc)
+			v = realloc(v, sizeof(*v) * (nalloc = nalloc ? 2 * nalloc : 256));
+		if (read_proc_entry(s->proc, de->d_name, &v[n]) == 0) {
+			v[n].in = v[n].pid == s->pid;
+			++n;
+		}
+	}
+	closedir(dir);
+	do {
+		more = 0;
+		for (i = 0; i < n; ++i) {
+			int j;
+
+			if (v[i].in)
+				continue;
+			for (j = 0; j < n && !(v[j].in && v[j].pid == v[i].ppid); ++j)
+				;
+			if (j < n)
+				v[i].in = more = 1;
+		}
+	} while (more);
+	for (i = 0; i < n; ++i)
+		if (v[i].in) {
+			++*nproc;
+			*cpu += (double)v[i].ticks / sysconf(_SC_CLK_TCK);
+			*rss_kb += v[i].rss * (sysconf(_SC_PAGESIZE) / 1024);
+		}
+	free(v);
+}
+
+static void status_reply(struct status_server *s, int fd)
+{
+	struct timespec now;
+	double cpu;
+	long rss;
+	int nproc;
+
+	status_usage(s, &nproc, &cpu, &rss);
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	dprintf(fd, "pid %ld\nlauncher %ld\nuid %ld\nconfig %s\ncwd %s\nargs %s\n"
+		"started %ld\nuptime_sec %.3f\nprocesses %d\ncpu_sec %.3f\nrss_kb %ld\n",
+		(long)s->pid, (long)getpid(), (long)privileges.uid,
+		s->config ? s->config : "-", s->cwd ? s->cwd : "-", s->args,
+		(long)s->started, now.tv_sec - s->start.tv_sec +
+		(now.tv_nsec - s->start.tv_nsec) / 1e9, nproc, cpu, rss);
+}
+
+/* The listening socket, to poll(2) for, or -1 */
+static int status_socket(void)
+{
+	return status_server.sock;
+}
+
+static void serve_status(void)
+{
+	int fd = accept4(status_server.sock, NULL, NULL, SOCK_CLOEXEC);
+
+	if (fd >= 0) {
+		status_reply(&status_server, fd);
+		close(fd);
+	}
+}
+
+/* Until the container has exited */
+static void serve_status_until_exit(void)
+{
+	struct pollfd p[2] = {
+		{ .fd = status_socket(), .events = POLLIN },
+		{ .fd = status_server.pidfd, .events = POLLIN },
+	};
+
+	while (p[0].fd >= 0) {
+		if (poll(p, 2, -1) < 0) {
+			if (EINTR == errno)
+				continue;
+			break;
+		}
+		if (p[1].revents)
+			break;
+		if (p[0].revents)
+			serve_status();
+	}
+}
+
+/* In the parent, until the container exits (after the log, if any) */
+static void relay_forwards(pid_t pid)
+{
+	struct pollfd p[2 + FORWARD_POLLFDS];
+	int n;
+
+	signal(SIGPIPE, SIG_IGN);
+	p[0].fd = syscall(SYS_pidfd_open, pid, 0);
+	p[0].events = POLLIN;
+	p[1].fd = status_socket();
+	p[1].events = POLLIN;
+	if (p[0].fd < 0) {
+		error("forward: pidfd_open: %s\n", strerror(errno));
+		return;
+	}
+	for (;;) {
+		n = forward_pollfds(p + 2);
+		if (poll(p, 2 + n, -1) < 0) {
+			if (EINTR == errno)
+				continue;
+			error("forward: poll: %s\n", strerror(errno));
+			break;
+		}
+		if (p[0].revents)
+			break;
+		if (p[1].fd >= 0 && p[1].revents)
+			serve_status();
+		forward_events(p + 2);
+	}
+	close(p[0].fd);
+	/* what is left of the connections of this run */
+	drop_relays();
+}
+
+/* In the parent, right after the fork; the @pidfd (or -1) is taken over */
+static void register_container(pid_t pid, int pidfd, char **argv)
+{
+	struct status_server *s = &status_server;
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	int cwd = -1, ok = 0;
+	size_t len = 1;
+	char **a;
+
+	if (s->dir < 0) {
+		if (pidfd >= 0)
+			close(pidfd);
+		return;
+	}
+	s->pid = pid;
+	s->started = time(NULL);
+	clock_gettime(CLOCK_MONOTONIC, &s->start);
+	for (a = argv; *a; ++a)
+		len += strlen(*a) + 1;
+	s->args = calloc(1, len);
+	for (a = argv; *a; ++a) {
+		if (a != argv)
+			strcat(s->args, " ");
+		strcat(s->args, *a);
+	}
+	snprintf(s->name, sizeof(s->name), "%ld.sock", (long)pid);
+	strcpy(addr.sun_path, s->name);
+	s->pidfd = pidfd >= 0 ? pidfd : syscall(SYS_pidfd_open, pid, 0);
+	s->sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	/* bind(2) in the status directory, which may be out of reach by name */
+	if (s->pidfd >= 0 && s->sock >= 0 &&
+	    (cwd = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC)) >= 0 && fchdir(s->dir) == 0) {
+		unlink(s->name);
+		ok = bind(s->sock, (struct sockaddr *)&addr, sizeof(addr)) == 0;
+		if (fchdir(cwd) != 0)
+			ok = 0;
+	}
+	if (cwd >= 0)
+		close(cwd);
+	if (ok && privileges.euid == 0 &&
+	    fchownat(s->dir, s->name, user_uid(), user_gid(), 0) != 0)
+		ok = 0;
+	if (ok && fchmodat(s->dir, s->name, 0600, 0) == 0 && listen(s->sock, 8) == 0)
+		return;
+	if (verbose > 1)
+		error("status: %s: %s\n", s->name, strerror(errno));
+	unlinkat(s->dir, s->name, 0);
+	if (s->sock >= 0)
+		close(s->sock);
+	if (s->pidfd >= 0)
+		close(s->pidfd);
+	free(s->args);
+	s->sock = s->pidfd = -1;
+	s->args = NULL;
+}
+
+static void unregister_container(void)
+{
+	struct status_server *s = &status_server;
+
+	if (s->dir < 0 || s->sock < 0)
+		return;
+	unlinkat(s->dir, s->name, 0);
+	close(s->sock);
+	close(s->pidfd);
+	free(s->args);
+	/* the directory stays open, for the next run of --watch */
+	s->sock = s->pidfd = -1;
+	s->args = NULL;
+}
+
+static char *status_value(char *reply, const char *key)
+{
+	size_t n = strlen(key);
+	char *p;
+
+	for (p = reply; p && *p; p = strchr(p, '\n'), p = p ? p + 1 : NULL)
+		if (!strncmp(p, key, n) && ' ' == p[n]) {
+			p += n + 1;
+			return strndup(p, strcspn(p, "\n"));
+		}
+	return strdup("-");
+}
+
+/*
+ * --list: ask each registered container of the invoking user (of all the
+ * users, for root), by the owner of its socket; the stale sockets are
+ * removed.
+ */
+static int list_containers(void)
+{
+	static const char *const keys[] = {
+		"pid", "uptime_sec", "processes", "cpu_sec", "rss_kb", "config", "args"
+	};
+	char buf[PATH_MAX], reply[8192];
+	const char *dirs[2] = { STATUS_PATH, NULL };
+	int i, k, n;
+
+	dirs[1] = status_dir(buf, sizeof(buf));
+	if (dirs[1] && !strcmp(dirs[1], STATUS_PATH))
+		dirs[1] = NULL;
+	printf("%-8s %10s %6s %10s %10s %s\n", "PID", "UPTIME", "PROCS", "CPU", "RSS_KB",
+	       "CONFIG ARGS");
+	for (i = 0; i < 2 && dirs[i]; ++i) {
+		DIR *dir = opendir(dirs[i]);
+		struct dirent *de;
+
+		while (dir && (de = readdir(dir))) {
+			struct sockaddr_un addr = { .sun_family = AF_UNIX };
+			char *v[sizeof(keys) / sizeof(*keys)];
+			struct stat st;
+			int fd;
+
+			n = strlen(de->d_name);
+			if (n < 6 || strcmp(de->d_name + n - 5, ".sock") ||
+			    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s/%s",
+				     dirs[i], de->d_name) >= sizeof(addr.sun_path))
+				continue;
+			/* the sockets are the users', in a directory they can't change */
+			if (fstatat(dirfd(dir), de->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0 ||
+			    !S_ISSOCK(st.st_mode) || (user_uid() && st.st_uid != user_uid()))
+				continue;
+			fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+			if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+				if (ECONNREFUSED == errno)
+					unlinkat(dirfd(dir), de->d_name, 0);
+				close(fd);
+				continue;
+			}
+			for (n = 0; n < sizeof(reply) - 1; n += k)
+				if ((k = read(fd, reply + n, sizeof(reply) - 1 - n)) <= 0)
+					break;
+			reply[n] = '\0';
+			close(fd);
+			for (k = 0; k < sizeof(keys) / sizeof(*keys); ++k)
+				v[k] = status_value(reply, keys[k]);
+			printf("%-8s %10s %6s %10s %10s %s %s\n",
+			       v[0], v[1], v[2], v[3], v[4], v[5], v[6]);
+			if (verbose > 1)
+				fputs(reply, stdout);
+			for (k = 0; k < sizeof(keys) / sizeof(*keys); ++k)
+				free(v[k]);
+		}
+		if (dir)
+			closedir(dir);
+	}
+	return 0;
+}
+
+/*
+ * The build queue: a daemon takes the runs submitted on a unix socket
+ * (SOCK_SEQPACKET, one message with the class, the directory, the args
+ * and the environment, and the standard input, output and error passed
+ * with SCM_RIGHTS) and starts them, as the submitting user like a SUID
+ * launch would, when one of its slots is free. The highest class goes
+ * first, then the user with the fewest runs going and the least CPU time
+ * used lately, then the oldest submission. The client waits for the exit
+ * status, and gets the queue latency and the run time.
+ */
+#define QUEUE_MSG_MAX (64 * 1024)
+
+/* the CPU seconds used by the runs of a user count less after this long */
+#define QUEUE_DECAY_SEC 600.0
+
+enum { QUEUE_HIGH, QUEUE_NORMAL, QUEUE_LOW };
+
+static const char *const queue_classes[] = { "high", "normal", "low" };
+
+enum { JOB_NEW, JOB_QUEUED, JOB_RUNNING };
+
+struct queue_user
+{
+	struct queue_user *next;
+	uid_t uid;
+	int running;
+	double usage;		/* the CPU seconds, decayed */
+	double stamp;		/* of the usage */
+};
+
+struct queue_job
+{
+	struct queue_job *next;
+	int state;
+	int sock;		/* of the client */
+	int fds[3];
+	int class;
+	uid_t uid;
+	gid_t gid;
+	gid_t groups[NGROUPS_MAX];
+	int ngroups;
+	char *cwd;
+	char **argv, **envp;
+	char *msg;
+	double queued, started;
+	pid_t pid;
+	int pidfd;
+	int killed;
+	struct queue_user *user;
+};
+
+static double queue_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double queue_usage(struct queue_user *u, double now)
+{
+	u->usage *= QUEUE_DECAY_SEC / (QUEUE_DECAY_SEC + now - u->stamp);
+	u->stamp = now;
+	return u->usage;
+}
+
+static void queue_reply(struct queue_job *job, const char *fmt, ...)
+{
+	char buf[256];
+	va_list args;
+	int n;
+
+	va_start(args, fmt);
+	n = vsnprintf(buf, sizeof(buf), fmt, args);
+	va_end(args);
+	if (job->sock >= 0)
+		(void)send(job->sock, buf, n, MSG_NOSIGNAL | MSG_DONTWAIT);
+}
+
+static void free_job(struct queue_job *job)
+{
+	int i;
+
+	for (i = 0; i < 3; ++i)
+		if (job->fds[i] >= 0)
+			close(job->fds[i]);
+	if (job->sock >= 0)
+		close(job->sock);
+	if (job->pidfd >= 0)
+		close(job->pidfd);
+	free(job->argv);
+	free(job->envp);
+	free(job->msg);
+	free(job);
+}
+
+/* Split "<class>\0<cwd>\0<argc>\0<args>...<env>..." into the @job */
+static int parse_job(struct queue_job *job, char *msg, size_t size)
+{
+	char *p = msg, *end = msg + size;
+	int i, argc, nenv = 0;
+
+	if (!size || end[-1] != '\0')
+		return -1;
+	job->class = atoi(p);
+	p += strlen(p) + 1;
+	if (p >= end || job->class < QUEUE_HIGH || job->class > QUEUE_LOW)
+		return -1;
+	job->cwd = p;
+	p += strlen(p) + 1;
+	if (p >= end || (argc = atoi(p)) < 1)
+		return -1;
+	p += strlen(p) + 1;
+	job->argv = calloc(argc + 1, sizeof(char *));
+	for (i = 0; i < argc; ++i, p += strlen(p) + 1)
+		if (p >= end)
+			return -1;
+		else
+			job->argv[i] = p;
+	for (i = 0; p + i < end; ++i)
+		nenv += !p[i];
+	job->envp = calloc(nenv + 1, sizeof(char *));
+	for (i = 0; i < nenv; ++i, p += strlen(p) + 1)
+		job->envp[i] = p;
+	return 0;
+}
+
+static int receive_job(struct queue_job *job)
+{
+	union {
+		char buf[CMSG_SPACE(3 * sizeof(int))];
+		struct cmsghdr align;
+	} control;
+	struct iovec iov;
+	struct msghdr msg = {
+		.msg_iov = &iov, .msg_iovlen = 1,
+		.msg_control = control.buf, .msg_controllen = sizeof(control.buf),
+	};
+	struct cmsghdr *c;
+	struct ucred cred;
+	socklen_t len = sizeof(cred);
+	int bad = 0;
+	ssize_t n;
+
+	job->msg = malloc(QUEUE_MSG_MAX);
+	iov.iov_base = job->msg;
+	iov.iov_len = QUEUE_MSG_MAX;
+	n = recvmsg(job->sock, &msg, MSG_CMSG_CLOEXEC | MSG_DONTWAIT);
+	if (n < 0 && (EAGAIN == errno || EINTR == errno))
+		return 1;
+	/* the descriptors of any other shape are closed, not left to pile up */
+	for (c = n >= 0 ? CMSG_FIRSTHDR(&msg) : NULL; c; c = CMSG_NXTHDR(&msg, c)) {
+		int *fd = (int *)CMSG_DATA(c), i;
+
+		if (c->cmsg_level != SOL_SOCKET || c->cmsg_type != SCM_RIGHTS)
+			continue;
+		if (c->cmsg_len == CMSG_LEN(3 * sizeof(int)) && job->fds[0] < 0) {
+			memcpy(job->fds, fd, 3 * sizeof(int));
+			continue;
+		}
+		for (i = 0; i < (c->cmsg_len - CMSG_LEN(0)) / sizeof(int); ++i)
+			close(fd[i]);
+		bad = 1;
+	}
+	if (n <= 0 || bad || (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) || job->fds[2] < 0 ||
+	    parse_job(job, job->msg, n) != 0 ||
+	    getsockopt(job->sock, SOL_SOCKET, SO_PEERCRED, &cred, &len) != 0) {
+		queue_reply(job, "error malformed submission\n");
+		return -1;
+	}
+	job->uid = cred.uid;
+	job->gid = cred.gid;
+	len = sizeof(job->groups);
+	if (getsockopt(job->sock, SOL_SOCKET, SO_PEERGROUPS, job->groups, &len) == 0)
+		job->ngroups = len / sizeof(gid_t);
+	if (getuid() && job->uid != getuid()) {
+		queue_reply(job, "error the queue runs as uid %ld only\n", (long)getuid());
+		return -1;
+	}
+	if (QUEUE_HIGH == job->class && job->uid && job->uid != getuid()) {
+		queue_reply(job, "error the high class is for root only\n");
+		return -1;
+	}
+	job->state = JOB_QUEUED;
+	job->queued = queue_now();
+	return 0;
+}
+
+/* Is @a to be started before @b, queued earlier? */
+static int job_before(struct queue_job *a, struct queue_job *b, double now)
+{
+	if (a->class != b->class)
+		return a->class < b->class;
+	if (a->user->running != b->user->running)
+		return a->user->running < b->user->running;
+	return queue_usage(a->user, now) < queue_usage(b->user, now);
+}
+
+/* The queued job to start next, if any */
+static struct queue_job *next_job(struct queue_job *jobs, double now)
+{
+	struct queue_job *job, *best = NULL;
+
+	for (job = jobs; job; job = job->next)
+		if (JOB_QUEUED == job->state && (!best || job_before(job, best, now)))
+			best = job;
+	return best;
+}
+
+static int start_job(struct queue_job *job)
+{
+	sigset_t none;
+	int i;
+
+	job->started = queue_now();
+	switch (job->pid = fork()) {
+	case -1:
+		error("queue: fork: %s\n", strerror(errno));
+		return -1;
+	case 0:
+		sigemptyset(&none);
+		sigprocmask(SIG_SETMASK, &none, NULL);
+		signal(SIGPIPE, SIG_DFL);
+		/* a process group of its own, to be stopped as a whole */
+		setpgid(0, 0);
+		for (i = 0; i < 3; ++i)
+			if (dup2(job->fds[i], i) < 0)
+				_exit(2);
+		close_range(3, ~0U, 0);
+		/* like a SUID launch by the user */
+		if (!getuid() && job->uid &&
+		    (setgroups(job->ngroups, job->groups) != 0 ||
+		     setresgid(job->gid, job->gid, job->gid) != 0 ||
+		     setresuid(job->uid, 0, 0) != 0)) {
+			error("queue: setting credentials: %s\n", strerror(errno));
+			_exit(2);
+		}
+		setfsuid(job->uid);
+		if (chdir(job->cwd) != 0) {
+			error("queue: chdir(%s): %s\n", job->cwd, strerror(errno));
+			_exit(3);
+		}
+		setfsuid(geteuid());
+		execve("/proc/self/exe", job->argv, job->envp);
+		error("queue: execve: %s\n", strerror(errno));
+		_exit(2);
+	}
+	setpgid(job->pid, job->pid);
+	job->pidfd = syscall(SYS_pidfd_open, job->pid, 0);
+	job->state = JOB_RUNNING;
+	++job->user->running;
+	queue_reply(job, "started %.3f\n", job->started - job->queued);
+	return 0;
+}
+
+static void finish_job(struct queue_job *job)
+{
+	struct rusage ru;
+	double now = queue_now();
+	int status;
+
+	if (wait4(job->pid, &status, 0, &ru) < 0)
+		status = 2 << 8;
+	status = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+	--job->user->running;
+	queue_usage(job->user, now);
+	job->user->usage += ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 +
+			    ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+	queue_reply(job, "exit %d %.3f %.3f\n", status,
+		    job->started - job->queued, now - job->started);
+	if (verbose)
+		fprintf(stderr, "%s: queue: uid %ld %s: status %d, queued %.3fs, ran %.3fs\n",
+			build_container, (long)job->uid, queue_classes[job->class],
+			status, job->started - job->queued, now - job->started);
+}
+
+static struct queue_user *queue_user(struct queue_user **users, uid_t uid)
+{
+	struct queue_user *u;
+
+	for (u = *users; u; u = u->next)
+		if (u->uid == uid)
+			return u;
+	u = calloc(1, sizeof(*u));
+	u->uid = uid;
+	u->stamp = queue_now();
+	u->next = *users;
+	*users = u;
+	return u;
+}
+
+static int queue_socket(const char *path, struct sockaddr_un *addr)
+{
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+	if (snprintf(addr->sun_path, sizeof(addr->sun_path), "%s", path) >=
+	    sizeof(addr->sun_path)) {
+		error("queue: %s: %s\n", path, strerror(ENAMETOOLONG));
+		return -1;
+	}
+	return socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+}
+
+/* --queue-daemon: serve until SIGINT or SIGTERM, then stop the runs */
+static int queue_daemon(const char *path, int slots)
+{
+	struct queue_job *jobs = NULL, *job, **pj;
+	struct queue_user *users = NULL;
+	struct sockaddr_un addr;
+	struct pollfd *p = NULL;
+	int lfd, sfd, running = 0, stopping = 0, n, i;
+	char *slash = strrchr(path, '/'), tmp[PATH_MAX];
+	sigset_t mask;
+
+	if (slash && slash != path) {
+		char *dir = strndup(path, slash - path);
+		int fd = mkdir_p(AT_FDCWD, dir, 0755);
+
+		if (fd >= 0)
+			close(fd);
+		free(dir);
+	}
+	/* listening once it is there */
+	snprintf(tmp, sizeof(tmp), "%s.%ld", path, (long)getpid());
+	lfd = queue_socket(tmp, &addr);
+	if (lfd < 0)
+		return 2;
+	unlink(tmp);
+	if (bind(lfd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+	    chmod(tmp, getuid() ? 0600 : 0666) != 0 || listen(lfd, 64) != 0 ||
+	    rename(tmp, path) != 0) {
+		error("queue: %s: %s\n", path, strerror(errno));
+		unlink(tmp);
+		return 2;
+	}
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGTERM);
+	sigprocmask(SIG_BLOCK, &mask, NULL);
+	sfd = signalfd(-1, &mask, SFD_CLOEXEC);
+	signal(SIGPIPE, SIG_IGN);
+	if (verbose)
+		fprintf(stderr, "%s: queue: '%s', %d slots\n", build_container, path, slots);
+	while (!stopping || running) {
+		for (n = 2, job = jobs; job; job = job->next)
+			++n;
+		p = realloc(p, 2 * n * sizeof(*p));
+		p[0].fd = sfd;
+		p[0].events = POLLIN;
+		p[1].fd = stopping ? -1 : lfd;
+		p[1].events = POLLIN;
+		for (n = 2, job = jobs; job; job = job->next) {
+			p[n].fd = job->sock;
+			p[n++].events = JOB_NEW == job->state ? POLLIN : POLLRDHUP;
+			p[n].fd = job->pidfd;
+			p[n++].events = POLLIN;
+		}
+		if (poll(p, n, -1) < 0) {
+			if (EINTR == errno)
+				continue;
+			error("queue: poll: %s\n", strerror(errno));
+			break;
+		}
+		for (pj = &jobs, i = 2; (job = *pj); i += 2) {
+			int done = 0;
+
+			if (JOB_NEW == job->state && p[i].revents) {
+				done = receive_job(job) < 0;
+				if (!done && JOB_QUEUED == job->state)
+					job->user = queue_user(&users, job->uid);
+			} else if (p[i].revents & (POLLHUP | POLLRDHUP | POLLERR)) {
+				/* the client is gone: drop its run, or stop it */
+				done = JOB_RUNNING != job->state;
+				if (JOB_RUNNING == job->state && !job->killed)
+					kill(-job->pid, SIGTERM);
+				job->killed = 1;
+				close(job->sock);
+				job->sock = -1;
+			}
+			if (JOB_RUNNING == job->state && p[i + 1].revents) {
+				finish_job(job);
+				--running;
+				done = 1;
+			}
+			if (done) {
+				*pj = job->next;
+				free_job(job);
+			} else
+				pj = &job->next;
+		}
+		if (p[0].revents) {
+			struct signalfd_siginfo si;
+
+			/* stop the runs, and drop the queued ones */
+			stopping = 1;
+			(void)read(sfd, &si, sizeof(si));
+			for (pj = &jobs; (job = *pj); )
+				if (JOB_RUNNING != job->state) {
+					*pj = job->next;
+					free_job(job);
+				} else {
+					if (!job->killed)
+						kill(-job->pid, SIGTERM);
+					job->killed = 1;
+					pj = &job->next;
+				}
+			close(lfd);
+			unlink(path);
+			continue;
+		}
+		if (p[1].revents) {
+			int fd = accept4(lfd, NULL, NULL, SOCK_CLOEXEC);
+
+			if (fd >= 0) {
+				job = calloc(1, sizeof(*job));
+				job->sock = fd;
+				job->fds[0] = job->fds[1] = job->fds[2] = -1;
+				job->pidfd = -1;
+				job->state = JOB_NEW;
+				/* in the order of submission */
+				for (pj = &jobs; *pj; pj = &(*pj)->next)
+					;
+				*pj = job;
+			}
+		}
+		while (running < slots && (job = next_job(jobs, queue_now())) &&
+		       start_job(job) == 0)
+			++running;
+	}
+	free(p);
+	close(sfd);
+	return 0;
+}
+
+/* --queue: submit the run to the daemon, and wait for it */
+static int submit_job(const char *path, int class, char **args)
+{
+	union {
+		char buf[CMSG_SPACE(3 * sizeof(int))];
+		struct cmsghdr align;
+	} control;
+	struct iovec iov;
+	struct msghdr msg = {
+		.msg_iov = &iov, .msg_iovlen = 1,
+		.msg_control = control.buf, .msg_controllen = sizeof(control.buf),
+	};
+	struct cmsghdr *c;
+	struct sockaddr_un addr;
+	char *buf = malloc(QUEUE_MSG_MAX), reply[256], **s;
+	double waited, ran;
+	size_t size;
+	int fd = -1, argc, status = 2;
+	ssize_t n;
+
+	for (argc = 0; args[argc]; ++argc)
+		;
+	size = snprintf(buf, QUEUE_MSG_MAX, "%d%c%s%c%d", class, 0, PWD, 0, argc) + 1;
+	for (s = args; *s && size < QUEUE_MSG_MAX; ++s)
+		size += snprintf(buf + size, QUEUE_MSG_MAX - size, "%s", *s) + 1;
+	for (s = environ; *s && size < QUEUE_MSG_MAX; ++s)
+		size += snprintf(buf + size, QUEUE_MSG_MAX - size, "%s", *s) + 1;
+	if (size > QUEUE_MSG_MAX) {
+		error("queue: the arguments and the environment are too long\n");
+		goto done;
+	}
+	iov.iov_base = buf;
+	iov.iov_len = size;
+	c = CMSG_FIRSTHDR(&msg);
+	c->cmsg_level = SOL_SOCKET;
+	c->cmsg_type = SCM_RIGHTS;
+	c->cmsg_len = CMSG_LEN(3 * sizeof(int));
+	memcpy(CMSG_DATA(c), (int []){ 0, 1, 2 }, 3 * sizeof(int));
+	fd = queue_socket(path, &addr);
+	if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+	    sendmsg(fd, &msg, MSG_NOSIGNAL) < 0) {
+		error("queue: %s: %s\n", path, strerror(errno));
+		goto done;
+	}
+	while ((n = recv(fd, reply, sizeof(reply) - 1, 0)) > 0 ||
+	       (n < 0 && EINTR == errno)) {
+		if (n < 0)
+			continue;
+		reply[n] = '\0';
+		if (sscanf(reply, "started %lf", &waited) == 1) {
+			if (verbose > 1)
+				fprintf(stderr, "%s: queue: started after %.3fs\n",
+					build_container, waited);
+		} else if (sscanf(reply, "exit %d %lf %lf", &status, &waited, &ran) == 3) {
+			if (verbose)
+				fprintf(stderr, "%s: queue: status %d, queued %.3fs, ran %.3fs\n",
+					build_container, status, waited, ran);
+			goto done;
+		} else if (!strncmp(reply, "error ", 6)) {
+			error("queue: %s", reply + 6);
+			status = 2;
+			goto done;
+		}
+	}
+	error("queue: %s: the daemon has gone away\n", path);
+done:
+	if (fd >= 0)
+		close(fd);
+	free(buf);
+	return status;
+}
+
+/*
+ * --log: the standard output and error of the container are pipes read by
+ * the launcher, that passes the data on to its own standard output and
+ * error and to the log file. The data stays in the kernel: tee(2)
+ * duplicates the pipe buffers into a spare pipe, which is spliced to the
+ * output of the launcher, and the originals are spliced into the log.
+ * A terminal does not support splice(2) and gets a copy; the timestamps
+ * per line need the data in userspace too.
+ */
+#define LOG_CHUNK (64 * 1024)
+
+enum { LOG_TIME_NONE, LOG_TIME_CHUNK, LOG_TIME_LINE };
+
+struct log_stream
+{
+	int in[2];	/* the output of the container */
+	int spare[2];	/* the tee(2) of the above */
+	int out;	/* the output of the launcher, -1 once gone */
+	int copy;	/* out does not support splice(2) */
+	int bol;	/* at the beginning of a line */
+};
+
+struct output_log
+{
+	char *path;
+	char *name;
+	int dir;	/* the directory of the log, to rotate it */
+	int fd;		/* -1 once writing has failed */
+	int copy;
+	int time;
+	off_t size;
+	off_t max;
+	struct timespec start;
+	struct log_stream s[2];
+};
+
+static struct output_log *output_log;
+static char log_buf[LOG_CHUNK];
+
+/* A size with an optional k, M, or G suffix */
+static int parse_size(const char *arg, off_t *size)
+{
+	char *end;
+	unsigned long long v = strtoull(arg, &end, 10);
+
+	switch (*end) {
+	case 'G':
+	case 'g':
+		v <<= 10;
+		/* fall through */
+	case 'M':
+	case 'm':
+		v <<= 10;
+		/* fall through */
+	case 'K':
+	case 'k':
+		v <<= 10;
+		++end;
+	}
+	if (end == arg || *end || v > LLONG_MAX)
+		return -1;
+	*size = v;
+	return 0;
+}
+
+static int write_all(int fd, const char *p, size_t n)
+{
+	ssize_t r;
+
+	while (n) {
+		r = write(fd, p, n);
+		if (r < 0 && EINTR == errno)
+			continue;
+		if (r <= 0)
+			return -1;
+		p += r;
+		n -= r;
+	}
+	return 0;
+}
+
+/*
+ * Move n bytes (or, if !exact, what is there up to n) from the pipe in
+ * to out, or drop them if out is -1.
+ */
+static ssize_t log_move(int in, int out, size_t n, int exact, int *copy)
+{
+	size_t done = 0;
+	ssize_t r;
+
+	while (done < n) {
+		if (out >= 0 && !*copy) {
+			r = splice(in, NULL, out, NULL, n - done, SPLICE_F_MOVE);
+			if (r < 0 && EINVAL == errno) {
+				*copy = 1;
+				continue;
+			}
+		} else {
+			r = read(in, log_buf, n - done < sizeof(log_buf) ? n - done : sizeof(log_buf));
+			if (r > 0 && out >= 0 && write_all(out, log_buf, r) != 0)
+				r = -1;
+		}
+		if (r < 0 && EINTR == errno)
+			continue;
+		if (r <= 0)
+			return done ? done : r;
+		done += r;
+		if (!exact)
+			break;
+	}
+	return done;
+}
+
+static int log_stamp(struct output_log *log, char *buf)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return sprintf(buf, "[%10.3f] ", now.tv_sec - log->start.tv_sec +
+		       (now.tv_nsec - log->start.tv_nsec) / 1e9);
+}
+
+static void log_failed(struct output_log *log)
+{
+	error("log: %s: %s\n", log->path, strerror(errno));
+	close(log->fd);
+	log->fd = -1;
+}
+
+static void log_write(struct output_log *log, const char *p, size_t n)
+{
+	if (log->fd < 0)
+		return;
+	if (write_all(log->fd, p, n) != 0)
+		log_failed(log);
+	else
+		log->size += n;
+}
+
+/* The log has reached --log-max: rename it to <file>.1, or truncate it */
+static void rotate_log(struct output_log *log)
+{
+	char old[PATH_MAX];
+	struct fs_creds creds;
+	int fd = -1;
+
+	snprintf(old, sizeof(old), "%s.1", log->name);
+	user_fs_creds(&creds);
+	if (log->dir >= 0 && renameat(log->dir, log->name, log->dir, old) == 0)
+		fd = openat(log->dir, log->name,
+			    O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	restore_fs_creds(&creds);
+	if (fd >= 0) {
+		close(log->fd);
+		log->fd = fd;
+	} else if (ftruncate(log->fd, 0) != 0 || lseek(log->fd, 0, SEEK_SET) != 0) {
+		log_failed(log);
+		return;
+	}
+	log->size = 0;
+}
+
+/* Up to n bytes, not many more than the log has room for */
+static size_t log_room(struct output_log *log, size_t n)
+{
+	if (log->max && log->fd >= 0 && log->max - log->size < n)
+		return log->max - log->size;
+	return n;
+}
+
+/* With timestamps per line, the data is copied */
+static ssize_t log_lines(struct output_log *log, struct log_stream *s, size_t n)
 {
-	int ret;
-	struct stk *b = pop(head);
-	struct stk *a = pop(head);
-	if (a && a->arg != FROM)
-		swap(a, b);
-	if (a && b && a->arg == FROM && b->arg == TO)
-		ret = do_mount(a->val, b->val, NULL, MS_MOVE, NULL, arg);
-	else {
-		error("'move' expects 'from' and 'to' paths\n");
-		ret = -1;
+	static char buf[LOG_CHUNK];
+	char *p = buf, *end = buf + sizeof(buf) - 32;
+	ssize_t i;
+
+	n = read(s->in[0], log_buf, n);
+	if ((ssize_t)n <= 0)
+		return (ssize_t)n < 0 && EINTR == errno ? 1 : -1;
+	if (s->out >= 0 && write_all(s->out, log_buf, n) != 0)
+		s->out = -1;
+	for (i = 0; i < n; ++i) {
+		if (s->bol && log->max && log->fd >= 0 && log->size + (p - buf) >= log->max) {
+			log_write(log, buf, p - buf);
+			p = buf;
+			rotate_log(log);
+		}
+		if (s->bol)
+			p += log_stamp(log, p);
+		s->bol = '\n' == log_buf[i];
+		*p++ = log_buf[i];
+		if (p >= end) {
+			log_write(log, buf, p - buf);
+			p = buf;
+		}
 	}
-	free(a);
-	free(b);
-	return ret;
+	log_write(log, buf, p - buf);
+	return n;
 }
 
-static int do_config_union(struct stk **head, char *arg)
+/* Relay what the stream has, 0 at the end, -1 on errors */
+static ssize_t log_chunk(struct output_log *log, struct log_stream *s)
 {
-	int ret = 0;
-	struct stk *a = NULL, *b = NULL, *e;
-	/* collect all 'from' paths and exactly one 'to' */
-	size_t lowersize = 0;
+	char stamp[32];
+	ssize_t n, m;
+	int avail;
 
-	while (*head) {
-		switch ((*head)->arg) {
-		case FROM:
-			e = pop(head);
-			lowersize += strlen(e->val) + 1;
-			e->next = a;
-			a = e;
-			break;
-		case TO:
-			if (b)
-				ret = -2;
-			else
-				b = pop(head);
-		default:
-			break;
-		}
+	if (ioctl(s->in[0], FIONREAD, &avail) != 0)
+		return -1;
+	if (!avail)
+		return 0;
+	if (log->max && log->size >= log->max && log->fd >= 0)
+		rotate_log(log);
+	n = log_room(log, avail < LOG_CHUNK ? avail : LOG_CHUNK);
+	if (LOG_TIME_LINE == log->time)
+		return log_lines(log, s, n);
+	if (LOG_TIME_CHUNK == log->time)
+		log_write(log, stamp, log_stamp(log, stamp));
+	if (s->out < 0 || log->fd < 0) {
+		/* one place left to write to, or none */
+		if (s->out >= 0)
+			return log_move(s->in[0], s->out, n, 1, &s->copy);
+		n = log_move(s->in[0], log->fd, n, 1, &log->copy);
+		if (n > 0 && log->fd >= 0)
+			log->size += n;
+		return n;
 	}
-	if (ret == -2 || !a || !b) {
-		ret = -1;
-		error("'union' expects exactly one 'to' path "
-		      "and at least one from\n");
-	} else {
-		char *data, *mnt_opts = empty_str, *ovl_opts = empty_str;
-		arg = cleanup(arg);
-		split_args(arg, generic_mount_opts, &mnt_opts, &ovl_opts);
-		if (*ovl_opts)
-			args_to_mount_data(ovl_opts);
-		else
-			ovl_opts = union_opts;
-		data = malloc(strlen(ovl_opts) + 1 + sizeof("lowerdir") + lowersize);
-		strcpy(data, ovl_opts);
-		strcat(data, ",lowerdir=" + (!*data || *strlast(data) == ','));
-		for (e = a; e; e = e->next) {
-			strcat(data, e->val);
-			if (e->next)
-				strcat(data, ":");
-		}
-		ret = do_mount("union", b->val, "overlay", 0, data, mnt_opts);
-		free(data);
-	}
-	free(b);
-	while (a) {
-		e = a->next;
-		free(a);
-		a = e;
+	n = tee(s->in[0], s->spare[1], n, 0);
+	if (n <= 0)
+		return n < 0 && EINTR == errno ? 1 : -1;
+	m = log_move(s->in[0], log->fd, n, 1, &log->copy);
+	if (m > 0)
+		log->size += m;
+	if (m != n) {
+		log_failed(log);
+		log_move(s->in[0], -1, n - (m > 0 ? m : 0), 1, &log->copy);
 	}
-	return ret;
+	m = log_move(s->spare[0], s->out, n, 1, &s->copy);
+	if (m != n) {
+		s->out = -1;
+		log_move(s->spare[0], -1, n - (m > 0 ? m : 0), 1, &s->copy);
+	}
+	return n;
 }
 
-static int do_config_overlay(struct stk **head, char *arg)
+/*
+ * In the parent, until the container has exited and the pipes are empty,
+ * or are closed: what it left running in the background (without a pid
+ * namespace) may keep them open for good.
+ */
+static void relay_log(struct output_log *log, pid_t pid)
 {
-	int ret = 0;
-	struct stk *a = NULL, *b = NULL, *w = NULL, *e;
-	/* collect one 'work', two 'from' paths, and exactly one 'to' */
-	while (*head && ret == 0 && !(a && a->next && b && w)) {
-		switch ((*head)->arg) {
-		case WORK:
-			if (w)
-				ret = -2;
-			else
-				w = pop(head);
+	struct pollfd p[4 + FORWARD_POLLFDS];
+	int i, n, open = 2;
+
+	/* a closed output of the launcher is no reason to stop logging */
+	signal(SIGPIPE, SIG_IGN);
+	for (i = 0; i < 2; ++i) {
+		close(log->s[i].in[1]);
+		p[i].fd = log->s[i].in[0];
+		p[i].events = POLLIN;
+	}
+	/* and the status socket and the forwarding meanwhile */
+	p[2].fd = status_socket();
+	p[2].events = POLLIN;
+	p[3].fd = syscall(SYS_pidfd_open, pid, 0);
+	p[3].events = POLLIN;
+	while (open) {
+		n = forward_pollfds(p + 4);
+		if (poll(p, 4 + n, -1) < 0) {
+			if (EINTR == errno)
+				continue;
+			error("log: poll: %s\n", strerror(errno));
 			break;
-		case FROM:
-			if (a && a->next)
-				ret = -2;
-			else {
-				e = pop(head);
-				e->next = a;
-				a = e;
+		}
+		for (i = 0; i < 2; ++i)
+			if (p[i].fd >= 0 && p[i].revents && log_chunk(log, &log->s[i]) <= 0) {
+				p[i].fd = -1;
+				--open;
 			}
-			break;
-		case TO:
-			if (b)
-				ret = -2;
-			else
-				b = pop(head);
+		if (p[2].fd >= 0 && p[2].revents)
+			serve_status();
+		forward_events(p + 4);
+		if (p[3].fd >= 0 && p[3].revents) {
+			/* what is in the pipes now is the end of it */
+			for (i = 0; i < 2; ++i)
+				while (p[i].fd >= 0 && log_chunk(log, &log->s[i]) > 0)
+					;
 			break;
 		}
 	}
-	if (ret == -2 || !(a && a->next) || !b || !w) {
-		ret = -1;
-		error("'overlay' expects exactly one 'work', two 'from', "
-		      "and one 'to' path lines\n");
-	} else {
-		char *data, *mnt_opts = empty_str, *ovl_opts = empty_str;
-		arg = cleanup(arg);
-		split_args(arg, generic_mount_opts, &mnt_opts, &ovl_opts);
-		if (*ovl_opts)
-			args_to_mount_data(ovl_opts);
-		else
-			ovl_opts = overlay_opts;
-		data = malloc(strlen(ovl_opts) +
-			      sizeof("lowerdir=,upperdir=,workdir=") +
-			      strlen(a->val) + strlen(a->next->val) +
-			      strlen(b->val) + strlen(w->val));
-		sprintf(data, "%s%supperdir=%s,lowerdir=%s,workdir=%s",
-			ovl_opts,
-			"," + (!*ovl_opts || *strlast(ovl_opts) == ','),
-			a->val, a->next->val, w->val);
-		ret = do_mount("overlay", b->val, "overlay", 0, data, mnt_opts);
-		free(data);
-	}
-	free(w);
-	free(b);
-	while (a) {
-		e = a->next;
-		free(a);
-		a = e;
-	}
-	return ret;
+	if (p[3].fd >= 0)
+		close(p[3].fd);
+	for (i = 0; i < 2; ++i)
+		close(log->s[i].in[0]);
 }
 
-static int mkdir_p(const char *path, mode_t mode)
+/* In the child, before it becomes the container */
+static int log_child(struct output_log *log)
 {
-	int ret = mkdir(path, mode);
+	int i;
 
-	if (ret == 0 || EEXIST == errno)
-		return 0;
-	if (ENOENT == errno) {
-		char *dir = strdup(path);
-		char *end = strend(dir);
-		char *slash = dir;
-
-		while (slash < end) {
-			char *s = strchr(slash, '/');
-			if (!s)
-				s = strend(slash);
-			if (s > slash) {
-				*s = '\0';
-				ret = mkdir(dir, mode);
-				*s = '/';
-				if (ret == -1 && EEXIST != errno)
-					break;
-			}
-			slash = s + !!*s;
+	for (i = 0; i < 2; ++i)
+		if (dup2(log->s[i].in[1], STDOUT_FILENO + i) < 0) {
+			error("log: dup2: %s\n", strerror(errno));
+			return -1;
 		}
-		free(dir);
-	}
-	return ret;
+	return 0;
 }
 
-static int mkdir_may_exist(const char *pathname)
+static int close_log(void *ctx, int status)
 {
-	int ret = mkdir_p(pathname, 0755);
-	if (ret == -1 && EEXIST == errno)
-		ret = 0;
-	else if (ret)
-		error("mkdir %s: %s\n", pathname, strerror(errno));
+	struct output_log *log = ctx;
+	int i, ret = log->fd < 0 ? -1 : 0;
+
+	if (log->fd >= 0 && close(log->fd) != 0) {
+		error("log: %s: %s\n", log->path, strerror(errno));
+		ret = -1;
+	}
+	if (log->dir >= 0)
+		close(log->dir);
+	for (i = 0; i < 2; ++i) {
+		close(log->s[i].spare[0]);
+		close(log->s[i].spare[1]);
+	}
+	free(log->path);
+	free(log);
 	return ret;
 }
 
-static int do_config(const char *config)
+/* Open the log (as the invoking user) now, it might be out of reach later */
+static struct output_log *setup_log(const char *path, off_t max, int time)
 {
-	char line[BUFSIZ];
-	struct stk *head = NULL;
-	int ret = 0;
-	char *config_dir;
-	FILE *fp = open_config(config, &config_dir);
+	struct output_log *log = calloc(1, sizeof(*log));
+	struct fs_creds creds;
+	char *slash;
 
-	if (!fp) {
-		error("config file: %s: %s\n", config, strerror(errno));
-		return -1;
+	log->path = strdup(path);
+	log->max = max;
+	log->time = time;
+	slash = strrchr(log->path, '/');
+	user_fs_creds(&creds);
+	if (slash) {
+		*slash = '\0';
+		log->dir = open(slash == log->path ? "/" : log->path,
+				O_PATH | O_DIRECTORY | O_CLOEXEC);
+		*slash = '/';
+		log->name = slash + 1;
+	} else {
+		log->dir = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+		log->name = log->path;
 	}
-	while (fgets(line, BUFSIZ, fp)) {
-		char *arg = line + strspn(line, spaces);
+	log->fd = log->dir < 0 ? -1 :
+		openat(log->dir, log->name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	restore_fs_creds(&creds);
+	if (log->fd < 0) {
+		error("log: %s: %s\n", path, strerror(errno));
+		if (log->dir >= 0)
+			close(log->dir);
+		free(log->path);
+		free(log);
+		return NULL;
+	}
+	return log;
+}
 
-		if ('#' == *arg)
-			continue;
-		/*
-		 * XXX the paths are delimited by EOL token and cannot begin with
-		 * XXX a whitespace character: all leading space is removed.
-		 */
-		if (expect_id("from", &arg))
-			push(&head, FROM, abspath(config_dir, cleanup(arg)));
-		else if (expect_id("from!", &arg)) {
-			const char *path = abspath(config_dir, cleanup(arg));
-			ret = mkdir_may_exist(path);
-			if (ret == 0)
-				push(&head, FROM, path);
-		}
-		else if (expect_id("to", &arg))
-			push(&head, TO, abspath(config_dir, cleanup(arg)));
-		else if (expect_id("to!", &arg)) {
-			const char *path = abspath(config_dir, cleanup(arg));
-			ret = mkdir_may_exist(path);
-			if (ret == 0)
-				push(&head, TO, path);
+/* The pipes, right before the launcher forks the container */
+static int start_log(struct output_log *log)
+{
+	int i;
+
+	for (i = 0; i < 2; ++i) {
+		struct log_stream *s = &log->s[i];
+
+		if (pipe2(s->in, O_CLOEXEC) != 0 || pipe2(s->spare, O_CLOEXEC) != 0) {
+			error("log: pipe: %s\n", strerror(errno));
+			return -1;
 		}
-		else if (expect_id("work", &arg))
-			push(&head, WORK, abspath(config_dir, cleanup(arg)));
-		else if (expect_id("work!", &arg)) {
-			const char *path = abspath(config_dir, cleanup(arg));
-			ret = mkdir_may_exist(path);
-			if (ret == 0)
-				push(&head, WORK, path);
+		/* fewer wake-ups for chatty builds, if the limits allow */
+		(void)fcntl(s->in[1], F_SETPIPE_SZ, 1 << 20);
+		(void)fcntl(s->spare[1], F_SETPIPE_SZ, 1 << 20);
+		s->out = STDOUT_FILENO + i;
+		s->bol = 1;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &log->start);
+	push_at_exit(close_log, log);
+	output_log = log;
+	return 0;
+}
+
+static int wait_container(pid_t pid, const char *prog)
+{
+	int status;
+
+	if (output_log)
+		relay_log(output_log, pid);
+	if (forwarding.head)
+		relay_forwards(pid);
+	serve_status_until_exit();
+	while (wait4(pid, &status, 0, &container_rusage) == -1)
+		if (EINTR != errno) {
+			error("wait(%s): %s\n", prog, strerror(errno));
+			return 2;
 		}
-		else if (expect_id("mount", &arg))
-			ret = do_config_mount(&head, arg);
-		else if (expect_id("bind", &arg))
-			ret = do_config_bind(&head, arg);
-		else if (expect_id("move", &arg))
-			ret = do_config_move(&head, arg);
-		else if (expect_id("union", &arg))
-			ret = do_config_union(&head, arg);
-		else if (expect_id("overlay", &arg))
-			ret = do_config_overlay(&head, arg);
-		else if (expect_id("chroot", &arg))
-			ret = do_chroot(abspath(config_dir, cleanup(arg)));
-		if (ret)
-			break;
+	unregister_container();
+	if (WIFEXITED(status)) {
+		if (verbose > 1)
+			fprintf(stderr, "%s finished (%d)\n", prog, WEXITSTATUS(status));
+		return WEXITSTATUS(status);
 	}
-	if (fp != stdin)
-		fclose(fp);
-	free(config_dir);
-	while (head) {
-		struct stk *a = head->next;
-		free(head);
-		head = a;
+	else if (WIFSIGNALED(status)) {
+		error("%s: %s\n", prog, strsignal(WTERMSIG(status)));
+		return 128 + WTERMSIG(status);
 	}
-	free(abspath_buf);
-	abspath_buf = NULL;
-	return ret;
+	error("failed(%s)\n", prog);
+	return 127;
 }
 
 static int run_container(const char *cd_to, const char *prog, char **argv)
 {
-	if (drop_privileges())
+	if (at_exit_head) {
+		/* stay to run the exit actions */
+		pid_t pid = fork();
+
+		if (pid == -1) {
+			error("fork(%s): %s\n", prog, strerror(errno));
+			return 2;
+		}
+		if (pid) {
+			register_container(pid, -1, argv);
+			return run_at_exit(wait_container(pid, prog));
+		}
+		if (output_log && log_child(output_log) != 0)
+			return 2;
+	}
+	if (drop_privileges() || apply_sched_opts())
 		return 2;
 	if (cd_to && chdir(cd_to) != 0)  {
 		error("chdir(%s): %s\n", cd_to, strerror(errno));
@@ -952,58 +7233,325 @@ static int run_container(const char *cd_to, const char *prog, char **argv)
 
 #define PIDNS_OWN_PROC 1
 
-static int run_pidns_container(const char *cd_to, unsigned flags, const char *prog, char **argv)
+#define PIDNS_PROC_SUBSET 2
+
+/* the launcher stays privileged, to start the program again */
+#define PIDNS_RERUN 4
+
+/* the signal mask for the program, when the launcher blocks some */
+static sigset_t *child_sigmask;
+
+/*
+ * --watch: SIGINT and SIGTERM go on to the init of the current run, and
+ * stop the watch after it; init only gets those it has a handler for, so
+ * one more kills the pid namespace.
+ */
+static volatile sig_atomic_t watch_stop;
+static volatile pid_t watch_pid;
+
+static void watch_signal(int sig)
+{
+	pid_t pid = watch_pid;
+
+	if (pid > 0)
+		kill(pid, watch_stop ? SIGKILL : sig);
+	watch_stop = 1;
+}
+
+/*
+ * The child in a new pid namespace, in one step: clone3(2) returns a pidfd
+ * too, and CLONE_VFORK holds the parent until the exec, after which it
+ * trims itself down to the supervisor. Older kernels unshare and fork.
+ */
+static pid_t clone_pidns(int *pidfd)
 {
+	struct clone_args args = {
+		.flags = CLONE_NEWPID | CLONE_PIDFD | CLONE_VFORK,
+		.pidfd = (uintptr_t)pidfd,
+		.exit_signal = SIGCHLD,
+	};
+	pid_t pid = syscall(SYS_clone3, &args, sizeof(args));
+
+	if (pid >= 0 || ENOSYS != errno)
+		return pid;
+	*pidfd = -1;
 	if (unshare(CLONE_NEWPID) != 0) {
 		error("unshare(CLONE_NEWPID): %s\n", strerror(errno));
-		return 2;
+		errno = 0;
+		return -1;
 	}
-	switch (fork()) {
-		int status;
+	return fork();
+}
+
+/* Start the <prog> in a new pid namespace, and wait for it */
+static int start_pidns_container(const char *cd_to, unsigned flags, const char *prog, char **argv)
+{
+	int pidfd = -1;
+	pid_t pid;
+
+	switch (pid = clone_pidns(&pidfd)) {
 	case -1:
-		error("fork(%s): %s\n", prog, strerror(errno));
+		if (errno)
+			error("clone(%s): %s\n", prog, strerror(errno));
 		break;
 	case 0:
+		if (output_log && log_child(output_log) != 0)
+			_exit(2);
+		if (child_sigmask)
+			sigprocmask(SIG_SETMASK, child_sigmask, NULL);
 		if (verbose)
 			fprintf(stderr, "%s: %s: pid %ld\n", build_container, prog, (long)getpid());
+		/* a procfs of the processes only, showing those of the user */
 		if ((flags & PIDNS_OWN_PROC) &&
-		    mount("proc", "/proc", "proc", MS_NOSUID|MS_NODEV|MS_NOEXEC, NULL) != 0) {
+		    mount("proc", "/proc", "proc", MS_NOSUID|MS_NODEV|MS_NOEXEC,
+			  flags & PIDNS_PROC_SUBSET ? "subset=pid,hidepid=invisible" : NULL) != 0) {
 			error("mount(proc): %s\n", strerror(errno));
-			exit(2);
+			_exit(2);
 		}
-		if (drop_privileges())
-			exit(2);
+		if (drop_privileges() || apply_sched_opts())
+			_exit(2);
 		if (cd_to && chdir(cd_to) != 0)  {
 			error("chdir(%s): %s\n", cd_to, strerror(errno));
-			exit(3);
+			_exit(3);
 		}
 		execvp(prog, argv);
 		error("execvp(%s): %s\n", prog, strerror(errno));
 		_exit(2);
 	default:
+		/* the launcher has done its part: give the memory back */
+		malloc_trim(0);
+		register_container(pid, pidfd, argv);
 		/*
 		 * Currently, dropping privileges here is not strictly
-		 * speaking necessary. Drop them anyway just in case.
+		 * speaking necessary, unless the exit actions need them.
+		 * Drop them anyway just in case.
 		 */
-		(void)drop_privileges();
-		while (wait(&status) == -1)
-			if (EINTR != errno) {
-				error("wait(%s): %s\n", prog, strerror(errno));
-				return 2;
-			}
-		if (WIFEXITED(status)) {
-			if (verbose > 1)
-				fprintf(stderr, "%s finished (%d)\n", prog, WEXITSTATUS(status));
-			return WEXITSTATUS(status);
+		if (!at_exit_head && !(flags & PIDNS_RERUN))
+			(void)drop_privileges();
+		if (flags & PIDNS_RERUN) {
+			sigset_t blocked;
+			int status;
+
+			watch_pid = pid;
+			sigprocmask(SIG_SETMASK, child_sigmask, &blocked);
+			status = wait_container(pid, prog);
+			sigprocmask(SIG_SETMASK, &blocked, NULL);
+			watch_pid = 0;
+			return status;
+		}
+		return wait_container(pid, prog);
+	}
+	return 2;
+}
+
+static int run_pidns_container(const char *cd_to, unsigned flags, const char *prog, char **argv)
+{
+	return run_at_exit(start_pidns_container(cd_to, flags, prog, argv));
+}
+
+/* The quiet time after a change, before the <prog> is started again */
+#define WATCH_DEBOUNCE_MS 200
+
+#define WATCH_EVENTS (IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_ATTRIB | \
+		      IN_MOVED_FROM | IN_MOVED_TO | IN_EXCL_UNLINK)
+
+struct watch
+{
+	int fd;		/* inotify */
+	char **dirs;	/* the watched paths, by the watch descriptor */
+	int ndirs;
+	char **paths;	/* --watch */
+	int npaths;
+	char **lowers;	/* the overlay lower layers, out of reach of the runs */
+	int nlowers;
+};
+
+static struct watch watch = { -1, NULL, 0, NULL, 0, NULL, 0 };
+
+/*
+ * The container reads the lower layers of its overlays, but can't write
+ * to them through its mounts: a change in those, while a run goes, is
+ * someone else's.
+ */
+static void watch_lowers(const struct stk *lower)
+{
+	struct fs_creds creds;
+	char *path;
+
+	if (!watch.npaths)
+		return;
+	user_fs_creds(&creds);
+	for (; lower; lower = lower->next)
+		if ((path = realpath(lower->val, NULL))) {
+			watch.lowers = realloc(watch.lowers,
+					       (watch.nlowers + 1) * sizeof(*watch.lowers));
+			watch.lowers[watch.nlowers++] = path;
+		}
+	restore_fs_creds(&creds);
+}
+
+static int watch_in_lower(const char *path)
+{
+	int i;
+
+	for (i = 0; i < watch.nlowers; ++i)
+		if (is_path_prefix(watch.lowers[i], path))
+			return 1;
+	return 0;
+}
+
+static int watch_add(const char *path, const struct stat *st, int type, struct FTW *ftw)
+{
+	int wd;
+
+	if (type != FTW_D && ftw->level > 0)
+		return 0;
+	wd = inotify_add_watch(watch.fd, path, WATCH_EVENTS);
+	if (wd < 0) {
+		error("watch: %s: %s\n", path, strerror(errno));
+		return 0;
+	}
+	if (wd >= watch.ndirs) {
+		watch.dirs = realloc(watch.dirs, (wd + 1) * sizeof(*watch.dirs));
+		memset(watch.dirs + watch.ndirs, 0, (wd + 1 - watch.ndirs) * sizeof(*watch.dirs));
+		watch.ndirs = wd + 1;
+	}
+	free(watch.dirs[wd]);
+	watch.dirs[wd] = strdup(path);
+	return 0;
+}
+
+/*
+ * Watch the trees of the --watch paths, not crossing mount points, before
+ * the configuration mounts anything over them. The paths are made
+ * absolute, the new directories are added by their paths.
+ */
+static int setup_watch(void)
+{
+	struct fs_creds creds;
+	char *path;
+	int i;
+
+	watch.fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (watch.fd < 0) {
+		error("watch: inotify: %s\n", strerror(errno));
+		return -1;
+	}
+	user_fs_creds(&creds);
+	for (i = 0; i < watch.npaths; ++i) {
+		path = realpath(watch.paths[i], NULL);
+		if (!path || nftw(path, watch_add, 16, FTW_PHYS | FTW_MOUNT) != 0) {
+			error("watch: %s: %s\n", watch.paths[i], strerror(errno));
+			free(path);
+			restore_fs_creds(&creds);
+			return -1;
 		}
-		else if (WIFSIGNALED(status)) {
-			error("%s: %s\n", prog, strsignal(WTERMSIG(status)));
-			return 128 + WTERMSIG(status);
+		free(path);
+	}
+	restore_fs_creds(&creds);
+	return 0;
+}
+
+/*
+ * Take the pending events, and return how many there were; with @ran,
+ * those of a run only count in the lower layers, the rest may be its own.
+ */
+static int watch_events(int ran)
+{
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	const struct inotify_event *ev;
+	struct fs_creds creds;
+	int count = 0;
+	ssize_t n;
+	char *p;
+
+	while ((n = read(watch.fd, buf, sizeof(buf))) > 0)
+		for (p = buf; p < buf + n; p += sizeof(*ev) + ev->len) {
+			ev = (const struct inotify_event *)p;
+			if (ev->wd < 0 || ev->wd >= watch.ndirs || !watch.dirs[ev->wd])
+				continue;
+			if (ev->mask & IN_IGNORED) {
+				free(watch.dirs[ev->wd]);
+				watch.dirs[ev->wd] = NULL;
+				continue;
+			}
+			if (!ran || watch_in_lower(watch.dirs[ev->wd])) {
+				++count;
+				if (verbose > 1)
+					fprintf(stderr, "%s: watch: %s/%s\n", build_container,
+						watch.dirs[ev->wd], ev->len ? ev->name : "");
+			}
+			if ((ev->mask & IN_ISDIR) && (ev->mask & (IN_CREATE | IN_MOVED_TO))) {
+				char *path = malloc(strlen(watch.dirs[ev->wd]) + ev->len + 2);
+
+				sprintf(path, "%s/%s", watch.dirs[ev->wd], ev->name);
+				user_fs_creds(&creds);
+				nftw(path, watch_add, 16, FTW_PHYS | FTW_MOUNT);
+				restore_fs_creds(&creds);
+				free(path);
+			}
 		}
-		error("failed(%s)\n", prog);
-		return 127;
+	return count;
+}
+
+static int poll_watch(struct pollfd *p, int timeout)
+{
+	int n;
+
+	while ((n = poll(p, 2, timeout)) < 0 && EINTR == errno)
+		;
+	return n;
+}
+
+/*
+ * Start the <prog> in a fresh pid namespace each time the watched trees
+ * change, in the mount namespace prepared once, until interrupted. The
+ * processes of a run are gone when its init has been waited for. The
+ * changes made while the <prog> runs are taken for its own and ignored,
+ * but those in the lower layers of its overlays, which it can't write,
+ * start the next run once it has finished.
+ */
+static int run_watch(const char *cd_to, unsigned flags, const char *prog, char **argv)
+{
+	struct sigaction sa = { .sa_handler = watch_signal };
+	struct pollfd p[2];
+	sigset_t mask, old;
+	int status, changed;
+
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGTERM);
+	sigprocmask(SIG_BLOCK, &mask, &old);
+	/* while a run goes; between the runs, the signalfd */
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	child_sigmask = &old;
+	p[0].fd = signalfd(-1, &mask, SFD_CLOEXEC);
+	p[0].events = POLLIN;
+	p[1].fd = watch.fd;
+	p[1].events = POLLIN;
+	if (p[0].fd < 0) {
+		error("watch: signalfd: %s\n", strerror(errno));
+		return run_at_exit(2);
+	}
+	for (;;) {
+		status = start_pidns_container(cd_to, flags | PIDNS_RERUN, prog, argv);
+		if (watch_stop)
+			break;
+		changed = watch_events(1);
+		if (verbose)
+			fprintf(stderr, "%s: %s finished (%d), %s\n", build_container, prog,
+				status, changed ? "changed meanwhile" : "watching for changes");
+		if (!changed && (poll_watch(p, -1) <= 0 || p[0].revents))
+			break;
+		do
+			watch_events(0);
+		while (poll_watch(p, WATCH_DEBOUNCE_MS) > 0 && !p[0].revents);
+		if (p[0].revents)
+			break;
 	}
-	return 2;
+	close(p[0].fd);
+	return run_at_exit(status);
 }
 
 static ssize_t write_file(const char *file, const char *line, int n)
@@ -1022,6 +7570,204 @@ static ssize_t write_file(const char *file, const char *line, int n)
 	return ret;
 }
 
+#define SUBUID_FILE "/etc/subuid"
+#define SUBGID_FILE "/etc/subgid"
+#define ID_MAP_MAX 16
+
+struct id_map
+{
+	int n;
+	unsigned long v[ID_MAP_MAX][3];	/* inside, outside, count */
+};
+static struct id_map uid_map, gid_map;
+
+/*
+ * Map root in the user namespace to the invoking user and the following
+ * ids to the subordinate ranges of the user from /etc/subuid (subgid).
+ */
+static void collect_subids(struct id_map *map, const char *file,
+			   const char *user, unsigned long id)
+{
+	unsigned long next = 1;
+	char line[256];
+	FILE *fp;
+
+	map->v[0][0] = 0;
+	map->v[0][1] = id;
+	map->v[0][2] = 1;
+	map->n = 1;
+	fp = fopen(file, "r");
+	if (!fp) {
+		if (verbose > 1)
+			error("%s: %s\n", file, strerror(errno));
+		return;
+	}
+	while (map->n < ID_MAP_MAX && fgets(line, sizeof(line), fp)) {
+		char *s = cleanup(line), *colon = strchr(s, ':'), *e;
+		unsigned long start, count;
+
+		if (!colon || '#' == *s)
+			continue;
+		*colon = '\0';
+		if (!user || strcmp(s, user) != 0)
+			if (strtoul(s, &e, 10) != id || e == s || *e)
+				continue;
+		if (sscanf(colon + 1, "%lu:%lu", &start, &count) != 2 || !count)
+			continue;
+		map->v[map->n][0] = next;
+		map->v[map->n][1] = start;
+		map->v[map->n][2] = count;
+		next += count;
+		++map->n;
+	}
+	fclose(fp);
+	if (map->n == 1 && verbose > 1)
+		error("%s: no subordinate ids for %s\n", file, user ? user : "?");
+}
+
+static void collect_id_maps(void)
+{
+	uid_t uid = privileges.has_uid ? privileges.uid : privileges.euid;
+	gid_t gid = privileges.has_gid ? privileges.gid : privileges.egid;
+	const char *user = privileges.user;
+	struct passwd *pw;
+
+	if (!user && (pw = getpwuid(uid)))
+		user = pw->pw_name;
+	collect_subids(&uid_map, SUBUID_FILE, user, uid);
+	collect_subids(&gid_map, SUBGID_FILE, user, gid);
+}
+
+static int format_id_map(char *buf, size_t size, const struct id_map *map)
+{
+	int i, n = 0;
+
+	for (i = 0; i < map->n && n < size; ++i)
+		n += snprintf(buf + n, size - n, "%lu %lu %lu\n",
+			      map->v[i][0], map->v[i][1], map->v[i][2]);
+	return n;
+}
+
+static void print_id_maps(void)
+{
+	int i;
+
+	for (i = 0; i < uid_map.n; ++i)
+		printf("# uid_map %lu %lu %lu\n",
+		       uid_map.v[i][0], uid_map.v[i][1], uid_map.v[i][2]);
+	for (i = 0; i < gid_map.n; ++i)
+		printf("# gid_map %lu %lu %lu\n",
+		       gid_map.v[i][0], gid_map.v[i][1], gid_map.v[i][2]);
+}
+
+/* The newuidmap(1) and newgidmap(1) protocol */
+static int run_id_mapper(const char *prog, pid_t pid, const struct id_map *map)
+{
+	char args[ID_MAP_MAX * 3 + 1][24];
+	char *argv[ID_MAP_MAX * 3 + 3];
+	int i, k, n = 0, a = 0, status;
+
+	argv[n++] = (char *)prog;
+	snprintf(args[a], sizeof(args[a]), "%ld", (long)pid);
+	argv[n++] = args[a++];
+	for (i = 0; i < map->n; ++i)
+		for (k = 0; k < 3; ++k) {
+			snprintf(args[a], sizeof(args[a]), "%lu", map->v[i][k]);
+			argv[n++] = args[a++];
+		}
+	argv[n] = NULL;
+	switch (pid = fork()) {
+	case -1:
+		error("fork(%s): %s\n", prog, strerror(errno));
+		return -1;
+	case 0:
+		execvp(prog, argv);
+		error("execvp(%s): %s\n", prog, strerror(errno));
+		_exit(127);
+	}
+	while (waitpid(pid, &status, 0) == -1)
+		if (EINTR != errno)
+			return -1;
+	return WIFEXITED(status) && WEXITSTATUS(status) == 0 ? 0 : -1;
+}
+
+static int write_id_maps(pid_t pid)
+{
+	char file[64], str[ID_MAP_MAX * 3 * 24];
+	int n;
+
+	if (geteuid() != 0)
+		return run_id_mapper("newgidmap", pid, &gid_map) ||
+			run_id_mapper("newuidmap", pid, &uid_map) ? -1 : 0;
+	/* privileged: map directly from the parent user namespace */
+	n = format_id_map(str, sizeof(str), &gid_map);
+	snprintf(file, sizeof(file), "/proc/%ld/gid_map", (long)pid);
+	if (write_file(file, str, n) != n)
+		return -1;
+	n = format_id_map(str, sizeof(str), &uid_map);
+	snprintf(file, sizeof(file), "/proc/%ld/uid_map", (long)pid);
+	if (write_file(file, str, n) != n)
+		return -1;
+	return 0;
+}
+
+/*
+ * The full id maps can be written only from the parent user namespace:
+ * fork a helper which waits until the process unshares its user namespace.
+ */
+static pid_t start_id_mapper(int *sync)
+{
+	int fds[2];
+	pid_t pid;
+
+	if (pipe2(fds, O_CLOEXEC) != 0) {
+		error("pipe: %s\n", strerror(errno));
+		return -1;
+	}
+	switch (pid = fork()) {
+		char c;
+	case -1:
+		error("fork: %s\n", strerror(errno));
+		close(fds[0]);
+		close(fds[1]);
+		return -1;
+	case 0:
+		close(fds[1]);
+		if (read(fds[0], &c, 1) != 1)
+			_exit(1);
+		_exit(write_id_maps(getppid()) ? 1 : 0);
+	}
+	close(fds[0]);
+	*sync = fds[1];
+	return pid;
+}
+
+static int finish_id_mapper(pid_t pid, int sync)
+{
+	int status;
+
+	if (write(sync, "", 1) != 1)
+		error("id mapper: %s\n", strerror(errno));
+	close(sync);
+	while (waitpid(pid, &status, 0) == -1)
+		if (EINTR != errno) {
+			error("id mapper: %s\n", strerror(errno));
+			return -1;
+		}
+	if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+		error("failed to map the subordinate ids\n");
+		return -1;
+	}
+	/* the container runs as root of the user namespace */
+	privileges.has_uid = privileges.has_gid = 1;
+	privileges.uid = 0;
+	privileges.gid = 0;
+	privileges.ngroups = 0;
+	free(privileges.groups);
+	privileges.groups = NULL;
+	return 0;
+}
+
 static int setup_userns(void)
 {
 	uid_t uid;
@@ -1061,6 +7807,461 @@ static int setup_netns(void)
 	return 0;
 }
 
+/*
+ * A pool of network namespaces made in advance: nsfs files bind-mounted
+ * in NETNS_POOL_PATH, each with the loopback interface up. A launch with
+ * -N claims one by unmounting it (only one of the racing launchers can)
+ * and enters it with setns(2); a detached process then makes a new one
+ * to keep the pool at the size given with --netns-pool. The kernel tears
+ * down the used namespaces asynchronously once the containers exit.
+ */
+#define NETNS_POOL_SIZE "size"
+
+static int make_pool_netns(int pooldir)
+{
+	char name[32], path[64];
+	int fd, status;
+	pid_t pid;
+
+	switch (pid = fork()) {
+	case -1:
+		return -1;
+	case 0:
+		snprintf(name, sizeof(name), "net.%ld", (long)getpid());
+		snprintf(path, sizeof(path), "/proc/self/fd/%d/%s", pooldir, name);
+		if (unshare(CLONE_NEWNET) != 0 || setup_netns() != 0)
+			_exit(1);
+		fd = openat(pooldir, name, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+		if (fd < 0)
+			_exit(1);
+		close(fd);
+		if (mount("/proc/self/ns/net", path, NULL, MS_BIND, NULL) != 0) {
+			unlinkat(pooldir, name, 0);
+			_exit(1);
+		}
+		_exit(0);
+	}
+	while (waitpid(pid, &status, 0) == -1)
+		if (EINTR != errno)
+			return -1;
+	return WIFEXITED(status) && !WEXITSTATUS(status) ? 0 : -1;
+}
+
+static int is_pool_netns(int fd)
+{
+	return ioctl(fd, NS_GET_NSTYPE) == CLONE_NEWNET;
+}
+
+/* Count the pooled namespaces, removing the files of the failed ones */
+static int count_pool_netns(int pooldir)
+{
+	int fd, n = 0, dfd = dup(pooldir);
+	DIR *dir = dfd < 0 ? NULL : fdopendir(dfd);
+	struct dirent *de;
+
+	if (!dir)
+		return -1;
+	/* the duplicate shares the offset with @pooldir */
+	rewinddir(dir);
+	while ((de = readdir(dir))) {
+		if (strncmp(de->d_name, "net.", 4))
+			continue;
+		fd = openat(pooldir, de->d_name, O_RDONLY | O_CLOEXEC);
+		if (fd >= 0 && is_pool_netns(fd))
+			++n;
+		else if (fd >= 0 && kill(atol(de->d_name + 4), 0) != 0)
+			unlinkat(pooldir, de->d_name, 0);
+		if (fd >= 0)
+			close(fd);
+	}
+	closedir(dir);
+	return n;
+}
+
+/* Claim a namespace of the pool: only one of the racing launchers can unmount it */
+static int take_pool_netns(int pooldir)
+{
+	int fd, ret = -1;
+	struct dirent *de;
+	DIR *dir;
+
+	fd = dup(pooldir);
+	dir = fd < 0 ? NULL : fdopendir(fd);
+	if (!dir) {
+		if (fd >= 0)
+			close(fd);
+		return -1;
+	}
+	rewinddir(dir);
+	while (ret < 0 && (de = readdir(dir))) {
+		char path[sizeof(NETNS_POOL_PATH) + 256];
+
+		if (strncmp(de->d_name, "net.", 4))
+			continue;
+		fd = openat(pooldir, de->d_name, O_RDONLY | O_CLOEXEC);
+		if (fd < 0)
+			continue;
+		snprintf(path, sizeof(path), "%s/%s", NETNS_POOL_PATH, de->d_name);
+		if (is_pool_netns(fd) && umount2(path, MNT_DETACH | UMOUNT_NOFOLLOW) == 0) {
+			unlinkat(pooldir, de->d_name, 0);
+			ret = fd;
+		} else
+			close(fd);
+	}
+	closedir(dir);
+	return ret;
+}
+
+/* Fill, or trim, the pool to its size, one filler at a time */
+static int fill_netns_pool(int pooldir)
+{
+	char buf[32] = "";
+	int n, fd, size, lock, ret = 0;
+	ssize_t k;
+
+	lock = openat(pooldir, NETNS_POOL_SIZE, O_RDWR | O_CLOEXEC);
+	if (lock < 0 || flock(lock, LOCK_EX) != 0 ||
+	    (k = pread(lock, buf, sizeof(buf) - 1, 0)) < 0) {
+		if (lock >= 0)
+			close(lock);
+		return -1;
+	}
+	buf[k] = '\0';
+	size = atoi(buf);
+	for (n = count_pool_netns(pooldir); n >= 0 && n < size && ret == 0; ++n)
+		ret = make_pool_netns(pooldir);
+	for (; n > size && (fd = take_pool_netns(pooldir)) >= 0; --n)
+		close(fd);
+	close(lock);
+	return n < 0 ? -1 : ret;
+}
+
+static int open_netns_pool(void)
+{
+	return open(NETNS_POOL_PATH, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+}
+
+/* --netns-pool=<n>: set the size of the pool and fill it */
+static int setup_netns_pool(int size)
+{
+	char buf[32];
+	int fd, pooldir;
+
+	fd = mkdir_p(AT_FDCWD, NETNS_POOL_PATH, 0700);
+	if (fd >= 0)
+		close(fd);
+	pooldir = open_netns_pool();
+	fd = pooldir < 0 ? -1 :
+		openat(pooldir, NETNS_POOL_SIZE, O_WRONLY | O_CREAT | O_CLOEXEC, 0600);
+	if (fd < 0 || flock(fd, LOCK_EX) != 0 || ftruncate(fd, 0) != 0 ||
+	    write(fd, buf, snprintf(buf, sizeof(buf), "%d\n", size)) < 0) {
+		error("netns pool %s: %s\n", NETNS_POOL_PATH, strerror(errno));
+		if (fd >= 0)
+			close(fd);
+		if (pooldir >= 0)
+			close(pooldir);
+		return -1;
+	}
+	close(fd);
+	fd = fill_netns_pool(pooldir);
+	if (fd != 0)
+		error("netns pool %s: %s\n", NETNS_POOL_PATH, strerror(errno));
+	else if (verbose > 1)
+		fprintf(stderr, "%s: netns pool '%s': %d namespaces\n", build_container,
+			NETNS_POOL_PATH, count_pool_netns(pooldir));
+	close(pooldir);
+	return fd;
+}
+
+/* Refill the pool from a detached process, not to delay the container */
+static void refill_netns_pool(int pooldir)
+{
+	int status;
+	pid_t pid = fork();
+
+	if (pid == 0) {
+		if (fork() != 0)
+			_exit(0);
+		setsid();
+		if ((status = open("/dev/null", O_RDWR)) >= 0) {
+			dup2(status, 0);
+			dup2(status, 1);
+			dup2(status, 2);
+		}
+		close_range(3, ~0U, 0);
+		pooldir = open_netns_pool();
+		_exit(pooldir < 0 || fill_netns_pool(pooldir) != 0);
+	}
+	if (pid > 0)
+		while (waitpid(pid, &status, 0) == -1 && EINTR == errno)
+			;
+}
+
+/*
+ * Enter a network namespace of the pool, if there is one; then refill.
+ * Returns 0 if entered.
+ */
+static int enter_pool_netns(void)
+{
+	int fd, pooldir = open_netns_pool(), ret = -1;
+
+	if (pooldir < 0)
+		return -1;
+	fd = take_pool_netns(pooldir);
+	if (fd >= 0) {
+		if (setns(fd, CLONE_NEWNET) == 0)
+			ret = 0;
+		else
+			error("netns pool: setns: %s\n", strerror(errno));
+		close(fd);
+	}
+	if (verbose > 1)
+		fprintf(stderr, "%s: netns pool '%s': %s\n", build_container,
+			NETNS_POOL_PATH, ret ? "empty" : "entered a network namespace");
+	refill_netns_pool(pooldir);
+	close(pooldir);
+	return ret;
+}
+
+/*
+ * A host-wide GNU make jobserver: a named FIFO with the job tokens, shared
+ * by all containers. The first container starts a daemon which owns the
+ * tokens and withholds some of them while the host is under CPU or memory
+ * pressure (PSI). The containers get the FIFO as inherited descriptors
+ * in MAKEFLAGS and hold a shared lock on it while they run.
+ */
+#define JOBSERVER_TICK 1		/* seconds */
+#define JOBSERVER_IDLE_TICKS 30
+#define PSI_CPU_LOW 2000		/* hundredths of a percent */
+#define PSI_CPU_HIGH 8000
+#define PSI_MEM_LOW 500
+#define PSI_MEM_HIGH 2500
+
+static int jobserver_tokens = -1;
+
+/* The "some avg10" of a /proc/pressure file, in hundredths of a percent */
+static int psi_some_avg10(const char *file)
+{
+	FILE *fp = fopen(file, "r");
+	double v;
+	int ret = -1;
+
+	if (fp) {
+		if (fscanf(fp, "some avg10=%lf", &v) == 1)
+			ret = v * 100;
+		fclose(fp);
+	}
+	return ret;
+}
+
+/* Scale @max down from 100% at @low pressure to 0 at @high */
+static int scale_tokens(int max, int pressure, int low, int high)
+{
+	if (pressure <= low)
+		return max;
+	if (pressure >= high)
+		return 0;
+	return max * (high - pressure) / (high - low);
+}
+
+static int jobserver_target(int max)
+{
+	int cpu = scale_tokens(max, psi_some_avg10("/proc/pressure/cpu"),
+			       PSI_CPU_LOW, PSI_CPU_HIGH);
+	int mem = scale_tokens(max, psi_some_avg10("/proc/pressure/memory"),
+			       PSI_MEM_LOW, PSI_MEM_HIGH);
+
+	return cpu < mem ? cpu : mem;
+}
+
+static void jobserver_daemon(int fifo, int max)
+{
+	char tokens[PIPE_BUF];
+	int withheld = max, idle = 0, n;
+
+	memset(tokens, '+', sizeof(tokens));
+	for (;;) {
+		int target = jobserver_target(max);
+		int circulating = max - withheld;
+
+		if (target < circulating) {
+			/* only the free tokens can be taken back */
+			n = read(fifo, tokens, circulating - target);
+			if (n > 0)
+				withheld += n;
+		} else if (target > circulating) {
+			n = write(fifo, tokens, target - circulating);
+			if (n > 0)
+				withheld -= n;
+		}
+		/* exit when no container has been using the FIFO for a while */
+		if (flock(fifo, LOCK_EX | LOCK_NB) == 0) {
+			if (++idle >= JOBSERVER_IDLE_TICKS)
+				break;
+			flock(fifo, LOCK_UN);
+		} else
+			idle = 0;
+		sleep(JOBSERVER_TICK);
+	}
+	/* exits with the FIFO locked, for its parent to remove */
+	_exit(0);
+}
+
+/*
+ * The FIFO at @path, made if missing: only one made here is opened up to
+ * the other users, and anything but a FIFO (or a symlink) is refused.
+ */
+static int open_jobserver_fifo(const char *path, int flags)
+{
+	int made = mkfifo(path, 0666) == 0, fd;
+	struct stat st;
+
+	if (!made && EEXIST != errno)
+		return -1;
+	fd = open(path, O_RDWR | O_NOFOLLOW | O_CLOEXEC | flags);
+	if (fd < 0 || fstat(fd, &st) != 0)
+		;
+	else if (!S_ISFIFO(st.st_mode))
+		errno = EINVAL;
+	else if (!made || fchmod(fd, 0666) == 0)
+		return fd;
+	if (fd >= 0)
+		close(fd);
+	return -1;
+}
+
+/*
+ * The daemon runs as the invoking user, under a parent which keeps the
+ * privileges only to remove the FIFO once it has exited, the FIFO still
+ * locked (the lock is on the open file they share): the new users wait
+ * for a new daemon.
+ */
+static int start_jobserver_daemon(const char *path, int userfd, int own)
+{
+	struct fs_creds creds;
+	int fifo, status;
+	pid_t pid;
+	char c;
+
+	fifo = open_jobserver_fifo(path, O_NONBLOCK);
+	if (fifo < 0) {
+		error("jobserver: %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+	/* the tokens of a previous daemon */
+	while (read(fifo, &c, 1) == 1)
+		;
+	switch (pid = fork()) {
+	case -1:
+		error("jobserver: fork: %s\n", strerror(errno));
+		close(fifo);
+		return -1;
+	case 0:
+		if (fork() != 0)
+			_exit(0);
+		close(userfd);
+		setsid();
+		if ((status = open("/dev/null", O_RDWR)) >= 0) {
+			dup2(status, 0);
+			dup2(status, 1);
+			dup2(status, 2);
+			if (status > 2)
+				close(status);
+		}
+		/* the daemon keeps the server lock */
+		switch (pid = fork()) {
+		case -1:
+			_exit(1);
+		case 0:
+			if (drop_privileges() == 0)
+				jobserver_daemon(fifo, jobserver_tokens);
+			_exit(1);
+		}
+		while (waitpid(pid, &status, 0) == -1 && EINTR == errno)
+			;
+		if (!own)
+			user_fs_creds(&creds);
+		unlink(path);
+		_exit(0);
+	}
+	close(fifo);
+	while (waitpid(pid, &status, 0) == -1 && EINTR == errno)
+		;
+	if (verbose > 1)
+		fprintf(stderr, "%s: jobserver '%s': %d tokens\n", build_container,
+			path, jobserver_tokens);
+	return 0;
+}
+
+/*
+ * Only the default FIFO, in a directory of root's, is set up with the
+ * privileges of the launcher; any other path as the invoking user.
+ */
+static int setup_jobserver(const char *path)
+{
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	char *dir = strdup(path), *slash = strrchr(dir, '/'), *lock;
+	int own = !strcmp(path, JOBSERVER_PATH);
+	struct fs_creds creds;
+	char flags[64];
+	const char *makeflags;
+	int fd, lockfd, ret = -1;
+
+	if (!own)
+		user_fs_creds(&creds);
+	if (slash && slash != dir) {
+		*slash = '\0';
+		fd = mkdir_p(AT_FDCWD, dir, 0755);
+		if (fd >= 0)
+			close(fd);
+	}
+	free(dir);
+	if (jobserver_tokens < 0)
+		jobserver_tokens = cpus > 1 ? cpus - 1 : 0;
+	if (jobserver_tokens > PIPE_BUF)
+		jobserver_tokens = PIPE_BUF;
+	/* a user of the FIFO, until the last process of the container exits */
+	fd = open_jobserver_fifo(path, 0);
+	if (fd < 0 || flock(fd, LOCK_SH) != 0) {
+		error("jobserver: %s: %s\n", path, strerror(errno));
+		if (fd >= 0)
+			close(fd);
+		if (!own)
+			restore_fs_creds(&creds);
+		return -1;
+	}
+	lock = malloc(strlen(path) + sizeof(".lock"));
+	sprintf(lock, "%s.lock", path);
+	lockfd = open(lock, O_RDWR | O_CREAT | O_NOFOLLOW | O_CLOEXEC, 0666);
+	if (lockfd < 0)
+		error("jobserver: %s: %s\n", lock, strerror(errno));
+	else if (flock(lockfd, LOCK_EX | LOCK_NB) != 0)
+		ret = 0; /* the daemon is running */
+	else
+		ret = start_jobserver_daemon(path, fd, own);
+	if (lockfd >= 0)
+		close(lockfd);
+	free(lock);
+	if (!own)
+		restore_fs_creds(&creds);
+	if (ret) {
+		close(fd);
+		return ret;
+	}
+	/* checked, and now passed on to the program */
+	fcntl(fd, F_SETFD, 0);
+	makeflags = getenv("MAKEFLAGS");
+	snprintf(flags, sizeof(flags), " -j --jobserver-auth=%d,%d", fd, fd);
+	if (makeflags) {
+		char *s = malloc(strlen(makeflags) + strlen(flags) + 1);
+		sprintf(s, "%s%s", makeflags, flags);
+		setenv("MAKEFLAGS", s, 1);
+		free(s);
+	} else
+		setenv("MAKEFLAGS", flags + 1, 1);
+	return 0;
+}
+
 static void setup_default_overlay_opts(void)
 {
 	static char none[] = "";
@@ -1083,7 +8284,7 @@ static void setup_default_overlay_opts(void)
 static void usage(int code)
 {
 	fprintf(stderr, "%s [-hqcLP] [-E NAME[=VALUE]] [-n <container>] [-d <dir>] [-e <prog>] [-- args...]\n"
-		"%s\n%s\n", build_container,
+		"%s%s%s\n%s%s%s\n", build_container,
 		"Run the program <prog> in a new mount namespace to isolate software build\n"
 		"processes or testing environments.\n"
 		"It can setup the target environment on file system level: bind, move, union\n"
@@ -1110,13 +8311,115 @@ static void usage(int code)
 		"-w <dir>       same as -d <dir>, for docker-run compatibility\n"
 		"-P, --pid      unshare the pid namespace to avoid run-away build processes.\n"
 		"               Given twice, will also mount a new /proc in the container\n"
+		"--proc-subset  same as -PP, with the new /proc mounted with the options\n"
+		"               subset=pid,hidepid=invisible: the processes only, and only\n"
+		"               those of the user\n"
 		"-N, --net      unshare the network namespace to allow, for instance, multiple\n"
 		"               services on the same local TCP or UNIX ports or remove network\n"
 		"               access from the build container (loopback interface will be set up)\n"
+		"--netns-pool=<n>\n"
+		"               make <n> network namespaces in advance, in "NETNS_POOL_PATH",\n"
+		"               and exit. Privileged launches with -N enter one of them instead\n"
+		"               of making a new one, and the pool is refilled in the background.\n"
 		"-U, --user     unshare the user namespace for root-less build containers.\n"
 		"               This is forced on if the program is started with non-root EUID.\n"
 		"               The option can be given when running as root to setup a new\n"
-		"               user namespace anyway.\n"
+		"               user namespace anyway.\n",
+		"--map-root     unshare the user namespace, map root in it to the invoking\n"
+		"               user and the following ids to the subordinate ranges of the\n"
+		"               user from "SUBUID_FILE" and "SUBGID_FILE". The <prog> runs as root\n"
+		"               of the namespace. Uses newuidmap(1) and newgidmap(1)\n"
+		"               if not privileged.\n"
+		"--jobserver[=<fifo>]\n"
+		"               join, or start, the host-wide GNU make jobserver on the named\n"
+		"               FIFO (default "JOBSERVER_PATH"), passed to the\n"
+		"               <prog> in MAKEFLAGS. The jobserver daemon keeps the number of\n"
+		"               the job tokens below the number of CPUs and withholds tokens\n"
+		"               while the host is under CPU or memory pressure (PSI).\n"
+		"--jobserver-tokens=<n>\n"
+		"               the number of the job tokens, if this starts the jobserver\n"
+		"               daemon, instead of the number of CPUs less one.\n"
+		"--cpus=<list>  run the <prog> on the CPUs of the <list>, like \"0-3,8\"\n"
+		"--numa=<list>  allocate the memory of the <prog> on the NUMA nodes of the\n"
+		"               <list> only (MPOL_BIND)\n"
+		"--sched=<policy>\n"
+		"               run the <prog> with the scheduling policy \"batch\", \"idle\"\n"
+		"               or \"other\"\n"
+		"--nice=<n>     run the <prog> with the nice value <n>\n"
+		"--ioprio=<class>[:<n>]\n"
+		"               run the <prog> with the I/O scheduling class \"rt\", \"be\"\n"
+		"               (with the level <n>, 0..7, default 4) or \"idle\".\n"
+		"               These are set after dropping privileges, so that the limits\n"
+		"               of the user apply, and can also be set in the configuration.\n"
+		"--stats[=<file>], --stats-json[=<file>]\n"
+		"               report the resource usage of the container when it has\n"
+		"               finished, as text or JSON, to the <file> (or /dev/fd/<n>)\n"
+		"               or the standard error: the exit status, the wall time, the\n"
+		"               rusage of <prog> and its descendants (CPU time, peak RSS of\n"
+		"               the largest process, faults, block I/O), and, with cgroup v2,\n"
+		"               cpu.stat, memory.peak, pids.peak, the io.stat bytes and\n"
+		"               operations, and the PSI stall totals of the cgroup of\n"
+		"               the launcher (since the cgroup was made), when there is no\n"
+		"               other process in it (like with systemd-run --scope).\n"
+		"--perf-stat[=<file>], --perf-stat-json[=<file>]\n"
+		"               count the task clock, context switches, CPU migrations,\n"
+		"               page faults, cycles, instructions, cache references and\n"
+		"               misses of the container with perf_event_open(2), for its\n"
+		"               cgroup v2 on all CPUs if privileged and in a cgroup of its\n"
+		"               own, or inherited by its processes, and report the totals\n"
+		"               at exit like --stats. The hardware counters are \"not\n"
+		"               supported\" without a PMU, like in many VMs.\n",
+		"--list         list the running containers registered in "STATUS_PATH"\n"
+		"               (or $XDG_RUNTIME_DIR/build-container if not privileged): the\n"
+		"               pid, uptime, process count, CPU seconds and RSS of each, as\n"
+		"               answered by its supervising parent on a unix socket there;\n"
+		"               only those of the invoking user, unless run by root.\n"
+		"--memoize=<dir>\n"
+		"               keep the overlay upper directories and the exit status of\n"
+		"               the run in the cache <dir>, keyed by a BLAKE3 hash of the\n"
+		"               configuration, the trees of its <from> paths (names, modes,\n"
+		"               inodes, sizes, mtimes), the -E variables, the <dir> to change\n"
+		"               to, the <prog> and its args; when the key is found, restore\n"
+		"               those instead of running the <prog>.\n"
+		"--log=<file>   write the standard output and error of the container to the\n"
+		"               <file> as well, passed on by the launcher with tee(2) and\n"
+		"               splice(2)\n"
+		"--log-max=<size>\n"
+		"               rename the log to <file>.1 (or truncate it, if that fails)\n"
+		"               once it has grown to about <size> bytes (k, M, G suffixes)\n"
+		"--log-time[=line|chunk]\n"
+		"               prefix each line (default), or each chunk of the output as\n"
+		"               it was read, in the log with the seconds since the start\n"
+		"--queue[=<socket>]\n"
+		"               submit the run to the queue daemon at the <socket> (default\n"
+		"               "QUEUE_PATH"), with the standard input, output and error,\n"
+		"               and wait for it to finish; its queue latency and run time\n"
+		"               are reported\n"
+		"--queue-class=high|normal|low\n"
+		"               the priority class of the submitted run, \"high\" for root\n"
+		"               only (default: normal)\n"
+		"--queue-daemon[=<socket>]\n"
+		"               serve the queue on the <socket>, starting the submitted runs\n"
+		"               as their users, when one of the slots is free: the highest\n"
+		"               class first, then the user with the fewest runs going and\n"
+		"               the least CPU time used lately; stop the runs on SIGTERM\n"
+		"--queue-slots=<n>\n"
+		"               the number of runs going at once (default: the CPU count)\n"
+		"--drop-cache=outputs|cgroup\n"
+		"               at exit, take the files of the build out of the page cache,\n"
+		"               to keep the toolchain there for the next one: \"outputs\"\n"
+		"               writes back and drops (fadvise(2) DONTNEED) the files in the\n"
+		"               overlay upper directories and the committed files, \"cgroup\"\n"
+		"               has the cgroup v2 of the launcher reclaim its memory\n"
+		"               (memory.reclaim)\n"
+		"--watch=<path> (may be repeated) run the <prog> again, in a new pid namespace\n"
+		"               (implies -P) but the same prepared container, each time the\n"
+		"               tree of a <path> changes (inotify(7), after a quiet time of\n"
+		"               200ms), until interrupted. The changes made while the <prog>\n"
+		"               runs are ignored, but those in the lower layers of its\n"
+		"               overlays start the next run once it has finished. SIGINT and\n"
+		"               SIGTERM are passed on to the running <prog>, a second one\n"
+		"               kills it. Not with --memoize or --log.\n"
 		"-E NAME[=VALUE]\n"
 		"               set the environment variable NAME to the VALUE,\n"
 		"               or unset the variable NAME if no VALUE given.\n",
@@ -1142,37 +8445,152 @@ static void usage(int code)
 		"\n"
 		"If the \"from\", \"to\", and \"work\" are followed by \"!\" (exclamation mark)\n"
 		"the <path> directory will be created, including all intermediate directories.\n"
+		"The paths are looked up once, when the line is read, with the file system\n"
+		"credentials of the invoking user. The actions use the looked up paths, i.e.\n"
+		"they are not affected by later renames. Symlinks into /proc/<pid>/fd and\n"
+		"similar \"magic\" links are not followed.\n"
 		"The <from>, <to>, and <work> paths are pushed on top of a stack, took off it\n"
 		"by the keywords which specify actions, in necessary quantities.\n"
 		"\n"
-		"  mount <type> ( rw | ro | noexec | nosuid | nodev | loop )*\n"
+		"  mount <type> ( rw | ro | noexec | nosuid | nodev | loop | shared )*\n"
 		"               mount filesystem <type> from <from> to <to> using the given options.\n"
 		"               For \"loop\" the <from> path should be a file for a loopback mount.\n"
 		"               \"rw\" is assumed if no options is given.\n"
+		"               A \"ro\" mount with \"shared\" is made once for all the containers\n"
+		"               using the same <from> file (registered in "REGISTRY_PATH")\n"
+		"               and cloned from there, so that its page cache is not duplicated;\n"
+		"               the last container using it unmounts it. Needs root privileges\n"
+		"               and no user namespace, otherwise the mount is not shared.\n"
 		"  bind ( ro | rec )*\n"
 		"               Bind-mount <from> to <to> using the given options.\n"
-		"  move         Move a mountpoint <from> to <to>.\n"
+		"  bind-list <path>\n"
+		"               Bind-mount all entries of the manifest file <path>, with lines\n"
+		"               \"<from> <to> ( ro | rec | noexec | nosuid | nodev )*\"\n"
+		"               (relative paths are relative to the configuration file).\n"
+		"               Missing <to> files and directories are created. The entries\n"
+		"               are attached in parallel, the nested <to> after their parents.\n"
+		"  move         Move a mountpoint <from> to <to>.\n",
 		"  union        Make a union-mount of all specified <from> paths to <to>.\n"
 		"               The <from> paths passed to mount(2) syscall in the reverse\n"
 		"               order to what they are specified in the configuration,\n"
 		"               which results to a more natural visibility of same names:\n"
 		"               the earlier <from> are visible in case of conflict.\n"
-		"  overlay      Make a writable overlay out of two <from> paths on <to>.\n"
+		"               With \"flatten=<dir>\" a read-only merged copy of the <from>\n"
+		"               layers (hard links, or copies across file systems) is made\n"
+		"               once in the cache <dir>, and bind-mounted instead of the union.\n"
+		"               The copy is identified by the inode and modification time of\n"
+		"               each <from> directory itself, not of the files in it: replace\n"
+		"               or change (touch) the top directory of a layer to have the copy\n"
+		"               remade.\n"
+		"               With \"shared\" the union is shared by the containers, like\n"
+		"               a \"mount\" with \"shared\".\n"
+		"  image-union [ squashfs | erofs | ext4 ] ( noexec | nosuid | nodev )*\n"
+		"               Make a read-only union of the <from> image files (ordered\n"
+		"               like for \"union\") on <to>. The images are attached to loop\n"
+		"               devices and mounted by parallel workers on the directories\n"
+		"               of a tmpfs mounted on <to>, and the union over them hides\n"
+		"               it. The file system type is detected if not given.\n"
+		"  overlay [ precopy=<glob>[,<glob>]* ]\n"
+		"               Make a writable overlay out of two <from> paths on <to>.\n"
 		"               Also requires specification of a <work> path.\n"
+		"               The files matching \"precopy\" globs (relative to <to>, and\n"
+		"               all the files of the matching directories) are copied up on\n"
+		"               parallel workers before the <prog> is started, instead of\n"
+		"               on its first write to each of them.\n"
+		"  commit [ now ]\n"
+		"               Apply the changes recorded in the overlay upper directory <from>\n"
+		"               (new and changed files, deletions, opaque directories) to the\n"
+		"               directory <to>, after the <prog> has finished successfully,\n"
+		"               or immediately for \"now\". The files are copied by parallel\n"
+		"               workers, sharing the extents (reflink) where supported.\n",
+		"  clone        Copy the directory tree <from> to <to>, on parallel workers,\n"
+		"               sharing the data extents (reflink) where the file system\n"
+		"               supports it. Warns if the data had to be copied.\n"
+		"  manifest <path>\n"
+		"               Write to the file <path>, after the <prog> has finished\n"
+		"               successfully, a manifest of the overlay upper directory <from>:\n"
+		"               \"<BLAKE3> <mode> <size> <name>\" lines for the new and changed\n"
+		"               files and symbolic links (the hash of the link target),\n"
+		"               \"- <mode> - <name>\" for directories and special files,\n"
+		"               \"opaque <mode> - <name>\" for opaque directories, and\n"
+		"               \"deleted - - <name>\" for whiteouts. The files are hashed by\n"
+		"               parallel workers.\n"
+		"  ephemeral    Remove the directory <from> (or <to>), like the upper or work\n"
+		"               directory of an overlay, after all the other exit actions:\n"
+		"               rename it into the directory "TRASH_NAME"\n"
+		"               next to it, emptied by a detached low-priority process.\n"
+		"  scratch <size> [ ext4 | xfs | btrfs ] ( noexec | nosuid | nodev )*\n"
+		"               Mount a new file system of <size> bytes (k, M, G suffixes)\n"
+		"               on <to>, noatime and lazytime, made by mkfs (ext4 without\n"
+		"               a journal by default) in a sparse image on a loop device:\n"
+		"               an unnamed file in <to>, or the first unlocked image\n"
+		"               scratch-<n>.img of the pool directory <from>, made if\n"
+		"               missing and emptied (hole-punched) at exit. Needs root.\n"
 		"  chroot <path>\n"
-		"               Do a chroot(2) into the <path>.\n");
+		"               Do a chroot(2) into the <path>.\n"
+		"  cpus <list>, numa <list>, sched <policy>, nice <n>, ioprio <class>[:<n>]\n"
+		"               Same as the command-line options --cpus, --numa, --sched,\n"
+		"               --nice, and --ioprio.\n");
 	exit(code);
 }
 
+enum {
+	OPT_MAP_ROOT = 256,
+	OPT_JOBSERVER,
+	OPT_JOBSERVER_TOKENS,
+	OPT_STATS,
+	OPT_STATS_JSON,
+	OPT_CPUS,
+	OPT_NUMA,
+	OPT_SCHED,
+	OPT_NICE,
+	OPT_IOPRIO,
+	OPT_NETNS_POOL,
+	OPT_LOG,
+	OPT_LOG_MAX,
+	OPT_LOG_TIME,
+	OPT_PERF_STAT,
+	OPT_PERF_STAT_JSON,
+	OPT_MEMOIZE,
+	OPT_LIST,
+	OPT_PROC_SUBSET,
+	OPT_WATCH,
+	OPT_QUEUE,
+	OPT_QUEUE_DAEMON,
+	OPT_QUEUE_SLOTS,
+	OPT_QUEUE_CLASS,
+	OPT_DROP_CACHE,
+};
+
 int main(int argc, char *argv[])
 {
 	const char *config = NULL;
 	const char *prog = NULL;
 	const char *cd_to = NULL;
-	int lock_fs = 0, login = 0;
+	const char *jobserver = NULL;
+	const char *memo_path = NULL;
+	const char *stats_path = NULL;
+	struct stats *stats_ctx = NULL;
+	const char *perf_path = NULL;
+	struct perf_stat *perf_ctx = NULL;
+	int perf_stat = 0, perf_json = 0;
+	const char *log_path = NULL;
+	struct output_log *log_ctx = NULL;
+	off_t log_max = 0;
+	int log_time = LOG_TIME_NONE;
+	int lock_fs = 0, login = 0, stats = 0, stats_json = 0;
+	int netns_pool = -1, netns_pooled = 0, list = 0, proc_subset = 0;
+	const char *queue_path = NULL, *queue_daemon_path = NULL;
+	int queue_slots = sysconf(_SC_NPROCESSORS_ONLN), queue_class = QUEUE_NORMAL;
+	char **args = malloc((argc + 1) * sizeof(*argv));
+	pid_t id_mapper = 0;
+	int id_mapper_sync = -1;
 
 	privileges.home = getenv("HOME");
 	PWD = get_current_dir_name();
+	blake3_init(&memo.h);
+	/* as given, getopt_long() permutes them */
+	memcpy(args, argv, (argc + 1) * sizeof(*argv));
 
 	for (;;) {
 		static struct option options[] = {
@@ -1183,6 +8601,31 @@ int main(int argc, char *argv[])
 			{ "pid", no_argument, NULL, 'P' },
 			{ "net", no_argument, NULL, 'N' },
 			{ "user", no_argument, NULL, 'U' },
+			{ "map-root", no_argument, NULL, OPT_MAP_ROOT },
+			{ "jobserver", optional_argument, NULL, OPT_JOBSERVER },
+			{ "jobserver-tokens", required_argument, NULL, OPT_JOBSERVER_TOKENS },
+			{ "stats", optional_argument, NULL, OPT_STATS },
+			{ "stats-json", optional_argument, NULL, OPT_STATS_JSON },
+			{ "cpus", required_argument, NULL, OPT_CPUS },
+			{ "numa", required_argument, NULL, OPT_NUMA },
+			{ "sched", required_argument, NULL, OPT_SCHED },
+			{ "nice", required_argument, NULL, OPT_NICE },
+			{ "ioprio", required_argument, NULL, OPT_IOPRIO },
+			{ "netns-pool", required_argument, NULL, OPT_NETNS_POOL },
+			{ "log", required_argument, NULL, OPT_LOG },
+			{ "log-max", required_argument, NULL, OPT_LOG_MAX },
+			{ "log-time", optional_argument, NULL, OPT_LOG_TIME },
+			{ "perf-stat", optional_argument, NULL, OPT_PERF_STAT },
+			{ "perf-stat-json", optional_argument, NULL, OPT_PERF_STAT_JSON },
+			{ "memoize", required_argument, NULL, OPT_MEMOIZE },
+			{ "list", no_argument, NULL, OPT_LIST },
+			{ "proc-subset", no_argument, NULL, OPT_PROC_SUBSET },
+			{ "watch", required_argument, NULL, OPT_WATCH },
+			{ "queue", optional_argument, NULL, OPT_QUEUE },
+			{ "queue-daemon", optional_argument, NULL, OPT_QUEUE_DAEMON },
+			{ "queue-slots", required_argument, NULL, OPT_QUEUE_SLOTS },
+			{ "queue-class", required_argument, NULL, OPT_QUEUE_CLASS },
+			{ "drop-cache", required_argument, NULL, OPT_DROP_CACHE },
 			{ 0 }
 		};
 		int idx, opt = getopt_long(argc, argv, "hn:e:cLlqd:w:PNUvE:", options, &idx);
@@ -1204,6 +8647,7 @@ int main(int argc, char *argv[])
 			prog = optarg;
 			break;
 		case 'E':
+			memo_string(optarg);
 			p = strchr(optarg, '=');
 			if (!p)
 				unsetenv(optarg);
@@ -1240,10 +8684,119 @@ int main(int argc, char *argv[])
 			if (userns > 1)
 				usage(1);
 			break;
+		case OPT_MAP_ROOT:
+			map_root = 1;
+			break;
+		case OPT_JOBSERVER:
+			jobserver = optarg ? optarg : JOBSERVER_PATH;
+			break;
+		case OPT_JOBSERVER_TOKENS:
+			jobserver_tokens = atoi(optarg);
+			break;
+		case OPT_STATS:
+		case OPT_STATS_JSON:
+			stats = 1;
+			stats_json = OPT_STATS_JSON == opt;
+			stats_path = optarg;
+			break;
+		case OPT_PROC_SUBSET:
+			proc_subset = 1;
+			pidns = pidns > 2 ? pidns : 2;
+			break;
+		case OPT_WATCH:
+			watch.paths = realloc(watch.paths, (watch.npaths + 1) * sizeof(*watch.paths));
+			watch.paths[watch.npaths++] = optarg;
+			pidns = pidns ? pidns : 1;
+			break;
+		case OPT_QUEUE:
+			queue_path = optarg ? optarg : QUEUE_PATH;
+			break;
+		case OPT_QUEUE_DAEMON:
+			queue_daemon_path = optarg ? optarg : QUEUE_PATH;
+			break;
+		case OPT_QUEUE_SLOTS:
+			queue_slots = atoi(optarg);
+			if (queue_slots < 1)
+				usage(1);
+			break;
+		case OPT_QUEUE_CLASS:
+			for (queue_class = QUEUE_HIGH; queue_class <= QUEUE_LOW; ++queue_class)
+				if (!strcmp(optarg, queue_classes[queue_class]))
+					break;
+			if (queue_class > QUEUE_LOW)
+				usage(1);
+			break;
+		case OPT_DROP_CACHE:
+			if (!strcmp(optarg, "outputs"))
+				drop_cache = DROP_CACHE_OUTPUTS;
+			else if (!strcmp(optarg, "cgroup"))
+				drop_cache = DROP_CACHE_CGROUP;
+			else
+				usage(1);
+			break;
+		case OPT_LIST:
+			list = 1;
+			break;
+		case OPT_MEMOIZE:
+			memo_path = optarg;
+			memo.enabled = 1;
+			break;
+		case OPT_PERF_STAT:
+		case OPT_PERF_STAT_JSON:
+			perf_stat = 1;
+			perf_json = OPT_PERF_STAT_JSON == opt;
+			perf_path = optarg;
+			break;
+		case OPT_CPUS:
+		case OPT_NUMA:
+		case OPT_SCHED:
+		case OPT_NICE:
+		case OPT_IOPRIO:
+			if (set_sched_opt(options[idx].name, optarg) != 0)
+				usage(1);
+			break;
+		case OPT_NETNS_POOL:
+			netns_pool = atoi(optarg);
+			if (netns_pool < 0)
+				usage(1);
+			break;
+		case OPT_LOG:
+			log_path = optarg;
+			break;
+		case OPT_LOG_MAX:
+			if (parse_size(optarg, &log_max) != 0)
+				usage(1);
+			break;
+		case OPT_LOG_TIME:
+			if (!optarg || !strcmp(optarg, "line"))
+				log_time = LOG_TIME_LINE;
+			else if (!strcmp(optarg, "chunk"))
+				log_time = LOG_TIME_CHUNK;
+			else
+				usage(1);
+			break;
 		default:
 			usage(1);
 		}
 	}
+	if (queue_daemon_path)
+		exit(queue_daemon(queue_daemon_path, queue_slots));
+	if (queue_path) {
+		int i, n = 0;
+
+		/* the same run, without the --queue options */
+		for (i = 0; i < argc && strcmp(args[i], "--"); ++i)
+			if (!strcmp(args[i], "--queue-class") || !strcmp(args[i], "--queue-slots"))
+				++i;
+			else if (strcmp(args[i], "--queue") && strncmp(args[i], "--queue=", 8) &&
+				 strncmp(args[i], "--queue-", 8))
+				args[n++] = args[i];
+		while (i < argc)
+			args[n++] = args[i++];
+		args[n] = NULL;
+		exit(submit_job(queue_path, queue_class, args));
+	}
+	free(args);
 	if (!prog) {
 		if (verbose > 1)
 			error("No program given, falling back to shell\n");
@@ -1259,13 +8812,52 @@ int main(int argc, char *argv[])
 	/* collect privileges of the unmodified process environment */
 	if (collect_privileges())
 		exit(2);
+	if (map_root)
+		collect_id_maps();
+	if (list)
+		exit(list_containers());
+	if (watch.npaths && (memo_path || log_path)) {
+		error("--watch can't be combined with --memoize or --log\n");
+		exit(1);
+	}
+	if (netns_pool >= 0 && !check_config) {
+		if (privileges.euid) {
+			error("--netns-pool needs root privileges\n");
+			exit(2);
+		}
+		exit(setup_netns_pool(netns_pool) ? 2 : 0);
+	}
 	if (check_config) {
+		int i;
+
 		if (drop_privileges())
 			exit(2);
+		if (map_root)
+			print_id_maps();
+		if (jobserver)
+			printf("# jobserver '%s'\n", jobserver);
+		if (stats)
+			printf("# stats '%s'%s\n", stats_path ? stats_path : "stderr",
+			       stats_json ? " json" : "");
+		if (memo_path)
+			printf("# memoize '%s'\n", memo_path);
+		if (perf_stat)
+			printf("# perf-stat '%s'%s\n", perf_path ? perf_path : "stderr",
+			       perf_json ? " json" : "");
+		if (log_path)
+			printf("# log '%s' max %lld%s\n", log_path, (long long)log_max,
+			       LOG_TIME_LINE == log_time ? " time line" :
+			       LOG_TIME_CHUNK == log_time ? " time chunk" : "");
+		for (i = 0; i < watch.npaths; ++i)
+			printf("# watch '%s'\n", watch.paths[i]);
+		if (drop_cache)
+			printf("# drop-cache %s\n",
+			       DROP_CACHE_OUTPUTS == drop_cache ? "outputs" : "cgroup");
 		if (config && do_config(config) != 0)
 			exit(3);
 		if (chrooted && !cd_to)
 			cd_to = PWD;
+		print_sched_opts();
 		if (cd_to)
 			printf("# cd '%s'\n", cd_to);
 		printf("# starting '%s'", prog);
@@ -1279,15 +8871,49 @@ int main(int argc, char *argv[])
 			error("unprivileged execution, setting up user namespace\n");
 		userns = 1;
 	}
-	if (unshare(CLONE_NEWNS | (userns ? CLONE_NEWUSER : 0) | (netns ? CLONE_NEWNET : 0)) == 0) {
-		if (userns && setup_userns() != 0)
+	if (jobserver && setup_jobserver(jobserver) != 0)
+		exit(2);
+	if (stats && !(stats_ctx = setup_stats(stats_path, stats_json)))
+		exit(2);
+	if (perf_stat && !(perf_ctx = setup_perf_stat(perf_path, perf_json)))
+		exit(2);
+	if (memo_path && setup_memo(memo_path) != 0)
+		exit(2);
+	setup_status(config);
+	setup_drop_cache();
+	if (watch.npaths && setup_watch() != 0)
+		exit(2);
+	if (log_path && !(log_ctx = setup_log(log_path, log_max, log_time)))
+		exit(2);
+	/* the host ends of the forwarded sockets stay in the host namespaces */
+	if (netns && config && config_forwards(config) && start_forward_host() != 0)
+		exit(2);
+	/* a privileged launcher can enter a namespace of the pool */
+	if (netns && !privileges.euid && enter_pool_netns() == 0)
+		netns_pooled = 1;
+	if (map_root) {
+		userns = 1;
+		id_mapper = start_id_mapper(&id_mapper_sync);
+		if (id_mapper < 0)
+			exit(2);
+	}
+	/* for the shared mounts, made in the host mount namespace */
+	if (!userns && !privileges.euid) {
+		host_root = open("/", O_PATH | O_DIRECTORY | O_CLOEXEC);
+		host_mntns = open("/proc/self/ns/mnt", O_RDONLY | O_CLOEXEC);
+	}
+	if (unshare(CLONE_NEWNS | (userns ? CLONE_NEWUSER : 0) |
+		    (netns && !netns_pooled ? CLONE_NEWNET : 0)) == 0) {
+		if (id_mapper && finish_id_mapper(id_mapper, id_mapper_sync) != 0)
+			exit(2);
+		if (userns && !id_mapper && setup_userns() != 0)
 			exit(2);
 		if (mount("none", SLASH, NULL,
 			  MS_REC | (lock_fs ? MS_PRIVATE : MS_SLAVE), NULL) != 0) {
 			error("setting mount propagation: %s\n", strerror(errno));
 			exit(2);
 		}
-		if (netns && setup_netns() != 0)
+		if (netns && !netns_pooled && setup_netns() != 0)
 			exit(2);
 	} else {
 		error("unshare(CLONE_NEWNS): %s\n", strerror(errno));
@@ -1296,6 +8922,8 @@ int main(int argc, char *argv[])
 	/* FIXME that's a bit careless: reading and parsing with full privileges */
 	if (config && do_config(config) != 0)
 		exit(3);
+	if (!forwarding.head)
+		stop_forward_host();
 	if (chrooted && !cd_to)
 		cd_to = PWD;
 	argv[optind - 1] = (char *)prog;
@@ -1307,9 +8935,27 @@ int main(int argc, char *argv[])
 			fprintf(stderr, " '%s'", argv[i]);
 		fputc('\n', stderr);
 	}
+	if (memo_path) {
+		int status = start_memo(cd_to, argv + optind - 1);
+
+		if (status >= 0)
+			return run_at_exit(status);
+	}
+	if (stats_ctx)
+		start_stats(stats_ctx);
+	if (perf_ctx)
+		start_perf_stat(perf_ctx);
+	if (log_ctx && start_log(log_ctx) != 0)
+		exit(2);
+	if (watch.npaths)
+		return run_watch(cd_to,
+				 (pidns > 1 ? PIDNS_OWN_PROC : 0) |
+				 (proc_subset ? PIDNS_OWN_PROC | PIDNS_PROC_SUBSET : 0),
+				 prog, argv + optind - 1);
 	if (pidns)
 		return run_pidns_container(cd_to,
-					   pidns > 1 ? PIDNS_OWN_PROC : 0,
+					   (pidns > 1 ? PIDNS_OWN_PROC : 0) |
+					   (proc_subset ? PIDNS_OWN_PROC | PIDNS_PROC_SUBSET : 0),
 					   prog, argv + optind - 1);
 	return run_container(cd_to, prog, argv + optind - 1);
 }
@@ -0,0 +1,30 @@
+#!/bin/sh
+
+# Paths are looked up once, relative to the configuration file
+
+mkdir -p cfg/src
+echo MARK >cfg/src/mark
+echo '
+from src
+to! deep/a/b/c
+bind ro
+
+from deep/a/b/c
+to! moved
+move
+' >cfg/config
+
+run-build-container -c -n $(pwd)/cfg/config |grep "^# mount '.*/cfg/src' '.*/cfg/deep/a/b/c' (null) 0x1001 bind" || exit 1
+test -d cfg/deep/a/b/c || exit 1
+
+sudo "$TEST_SRC_DIR/run-build-container" -n $(pwd)/cfg/config -e cat -- cfg/moved/mark |grep MARK || exit 1
+sudo "$TEST_SRC_DIR/run-build-container" -n $(pwd)/cfg/config -e sh -- -c 'echo >cfg/moved/mark' && exit 1
+
+# magic links are not followed
+echo '
+from /proc/self/cwd
+to moved
+bind
+' >cfg/magic
+sudo "$TEST_SRC_DIR/run-build-container" -n $(pwd)/cfg/magic -e true && exit 1
+exit 0
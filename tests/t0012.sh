@@ -0,0 +1,11 @@
+#!/bin/sh
+
+# --map-root: root of the user namespace is the invoking user
+
+run-build-container --map-root -c >result || exit 1
+grep "^# uid_map 0 $(id -u) 1\$" result || exit 1
+grep "^# gid_map 0 $(id -g) 1\$" result || exit 1
+
+test "$(run-build-container -q --map-root -e id -- -u)" = 0 || exit 1
+test "$(run-build-container -q --map-root -e sh -- -c 'touch f; stat -c %u f')" = 0 || exit 1
+test "$(stat -c %u f)" = "$(id -u)"
@@ -0,0 +1,31 @@
+#!/bin/sh
+
+# bind-list: bind mounts from a manifest
+
+mkdir -p src/dir tgt
+echo FILE >src/file
+echo DIR >src/dir/file
+{
+	echo '# comment'
+	for i in 1 2 3 4 5 6 7 8 9 10; do
+		echo "src/file tgt/files/$i ro"
+	done
+	echo "src/dir tgt/dir"
+	echo "src/file tgt/dir/nested"
+} >manifest
+echo "bind-list manifest" >config
+
+run-build-container -c -n $(pwd)/config >result || exit 1
+test $(grep -c "^# mount '.*/src/file' '.*/tgt/files/[0-9]*' (null) 0x1001 bind" result) = 10 || exit 1
+
+sudo "$TEST_SRC_DIR/run-build-container" -n $(pwd)/config -e sh -- -c '
+cat tgt/files/10 tgt/dir/file tgt/dir/nested' >result || exit 1
+test "$(cat result)" = "FILE
+DIR
+FILE" || exit 1
+test -f tgt/files/1 || exit 1
+sudo "$TEST_SRC_DIR/run-build-container" -n $(pwd)/config -e sh -- -c 'echo >tgt/files/1' && exit 1
+
+echo "src/file" >manifest
+run-build-container -c -n $(pwd)/config && exit 1
+exit 0
@@ -0,0 +1,52 @@
+#!/bin/sh
+
+# commit: apply the overlay upper changes after a successful run
+
+mkdir -p src/gone src/opaque m
+echo keep >src/keep
+echo del >src/del
+echo old >src/opaque/old
+echo '
+to! ram
+mount tmpfs
+from! ram/upper
+from src
+work! ram/work
+to m
+overlay
+from ram/upper
+to src
+commit
+' >config
+
+run-build-container -c -n $(pwd)/config |grep "^# commit '.*/ram/upper' '.*/src'\$" || exit 1
+
+sudo "$TEST_SRC_DIR/run-build-container" -n $(pwd)/config -e sh -- -c '
+echo fail >m/fail
+exit 1'
+test $? = 1 || exit 1
+test -e src/fail && exit 1
+
+sudo "$TEST_SRC_DIR/run-build-container" -n $(pwd)/config -e sh -- -c '
+cd m
+echo new >new
+echo more >>keep
+rm del
+rmdir gone
+rm -r opaque
+mkdir opaque
+echo new >opaque/new
+ln -s keep link' || exit 1
+
+test "$(cat src/new)" = new || exit 1
+test "$(cat src/keep)" = "keep
+more" || exit 1
+test -e src/del && exit 1
+test -e src/gone && exit 1
+test -e src/opaque/old && exit 1
+test "$(cat src/opaque/new)" = new || exit 1
+test "$(readlink src/link)" = keep || exit 1
+# written (and the "to!" made) as the user who ran sudo, not as root
+test "$(stat -c %u:%g ram src/keep src/new src/opaque src/opaque/new | sort -u)" = \
+	"$(id -u):$(id -g)" || exit 1
+exit 0
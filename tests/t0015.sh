@@ -0,0 +1,27 @@
+#!/bin/sh
+
+# clone: copy a tree
+
+mkdir -p src/a/b src/empty
+echo file >src/file
+echo deep >src/a/b/deep
+chmod 751 src/a
+touch -d @1000000000 src/a src/a/b
+chmod 555 src/a/b
+ln -s file src/link
+echo '
+from src
+to! dst
+clone
+' >config
+
+run-build-container -c -n $(pwd)/config |grep "^# clone '.*/src' '.*/dst'\$" || exit 1
+
+sudo "$TEST_SRC_DIR/run-build-container" -n $(pwd)/config -e true || exit 1
+diff -r src dst || exit 1
+test "$(readlink dst/link)" = file || exit 1
+test "$(stat -c %a dst/a)" = 751 || exit 1
+test "$(stat -c %a dst/a/b)" = 555 || exit 1
+test "$(stat -c %Y dst/a) $(stat -c %Y dst/a/b)" = "1000000000 1000000000" || exit 1
+test -d dst/empty || exit 1
+test "$(stat -c %Y src/a/b/deep)" = "$(stat -c %Y dst/a/b/deep)" || exit 1
@@ -0,0 +1,38 @@
+#!/bin/sh
+
+# union flatten=<dir>: a merged copy of the layers
+
+mkdir -p l1/d l2/d l3/d m
+echo top >l1/d/x
+echo mid >l2/d/x
+echo mid >l2/d/y
+echo low >l3/d/z
+chmod 555 l1/d
+echo '
+from l1
+from l2
+from l3
+to m
+union flatten=cache
+' >config
+
+run-build-container -c -n $(pwd)/config >result || exit 1
+grep "^# flatten '.*/cache'\$" result || exit 1
+grep "^# mount '.*/cache' '.*/m' (null) 0x1001 bind" result || exit 1
+
+sudo "$TEST_SRC_DIR/run-build-container" -n $(pwd)/config -e sh -- -c \
+	'cat m/d/x m/d/y m/d/z; stat -c %a m/d' >result || exit 1
+test "$(cat result)" = "top
+mid
+low
+555" || exit 1
+test $(ls cache |wc -l) = 1 || exit 1
+
+# the same layers reuse the copy
+sudo "$TEST_SRC_DIR/run-build-container" -n $(pwd)/config -e true || exit 1
+test $(ls cache |wc -l) = 1 || exit 1
+
+# a changed layer makes a new one
+echo new >l2/new
+sudo "$TEST_SRC_DIR/run-build-container" -n $(pwd)/config -e cat -- m/new |grep new || exit 1
+test $(ls cache |wc -l) = 2 || exit 1
@@ -0,0 +1,14 @@
+#!/bin/sh
+
+# --jobserver: a shared make jobserver on a FIFO
+
+run-build-container -c --jobserver=$(pwd)/js >result || exit 1
+grep "^# jobserver '.*/js'\$" result || exit 1
+
+printf 'all: a b c\na b c:\n\t@echo $@\n' >Makefile.js
+run-build-container -q --jobserver=$(pwd)/js --jobserver-tokens=2 \
+	-e sh -- -c 'echo "$MAKEFLAGS"; make -s -f Makefile.js' >result || exit 1
+grep -- "--jobserver-auth=[0-9]*,[0-9]*" result || exit 1
+test $(grep -c '^[abc]$' result) = 3 || exit 1
+test -p js || exit 1
+test "$(stat -c %u:%g js js.lock | sort -u)" = "$(id -u):$(id -g)"
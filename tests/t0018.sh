@@ -0,0 +1,46 @@
+#!/bin/sh
+
+# manifest: the BLAKE3 manifest of an overlay upper
+
+mkdir -p src/gone src/opaque m
+echo keep >src/keep
+echo old >src/opaque/old
+echo '
+to! ram
+mount tmpfs
+from! ram/upper
+from src
+work! ram/work
+to m
+overlay
+from ram/upper
+manifest out/manifest
+' >config
+
+run-build-container -c -n $(pwd)/config |grep "^# manifest '.*/ram/upper' '.*/out/manifest'\$" || exit 1
+
+sudo "$TEST_SRC_DIR/run-build-container" -n $(pwd)/config -e sh -- -c '
+cd m
+printf abc >abc
+: >empty
+chmod 600 empty
+rm keep
+rmdir gone
+rm -r opaque
+mkdir opaque
+ln -s abc link' || exit 1
+
+cat >expected <<END
+6437b3ac38465133ffb63b75273a8db548c558465d79db03fd359c6cd5bd9d85 100644 3 abc
+af1349b9f5f9a1a6a0404dea36dcc9499bcb25c9adc112b7cc9a93cae41f3262 100600 0 empty
+deleted - - gone
+deleted - - keep
+6437b3ac38465133ffb63b75273a8db548c558465d79db03fd359c6cd5bd9d85 120777 3 link
+opaque 040755 - opaque
+END
+diff -u expected out/manifest || exit 1
+
+# a failed build leaves an empty manifest
+sudo "$TEST_SRC_DIR/run-build-container" -n $(pwd)/config -e false
+test -s out/manifest && exit 1
+exit 0
@@ -0,0 +1,21 @@
+#!/bin/sh
+
+# --stats, --stats-json: the resource usage report
+
+run-build-container -c --stats-json=$(pwd)/stats >result || exit 1
+grep "^# stats '.*/stats' json\$" result || exit 1
+
+run-build-container -q --stats=$(pwd)/stats -e sh -- -c 'exit 3'
+test $? = 3 || exit 1
+grep '^status  *3$' stats || exit 1
+grep '^user_sec  *[0-9.]*$' stats || exit 1
+grep '^maxrss_kb  *[1-9][0-9]*$' stats || exit 1
+
+run-build-container -q -P --stats-json=/dev/fd/3 -e true 3>stats.json || exit 1
+grep '^  "status": 0,$' stats.json || exit 1
+grep '^  "wall_sec": [0-9.]*,$' stats.json || exit 1
+test "$(head -1 stats.json)" = "{" -a "$(tail -1 stats.json)" = "}"
+
+# the cgroup of the launcher, shared with this shell, is not the container's
+run-build-container -q --stats=$(pwd)/stats -e true || exit 1
+! grep '^cgroup' stats
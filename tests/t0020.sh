@@ -0,0 +1,28 @@
+#!/bin/sh
+
+# --cpus, --sched, --nice, --ioprio, and the configuration keywords
+
+echo '
+sched idle
+nice 5
+ioprio be:6
+' >config
+
+run-build-container -c --cpus=0 -n $(pwd)/config >result || exit 1
+grep "^# cpus 0\$" result || exit 1
+grep "^# sched idle\$" result || exit 1
+grep "^# nice 5\$" result || exit 1
+grep "^# ioprio be:6\$" result || exit 1
+
+run-build-container -c --nice=99 2>/dev/null && exit 1
+run-build-container -c --ioprio=be:8 2>/dev/null && exit 1
+run-build-container -c --cpus=1- 2>/dev/null && exit 1
+
+run-build-container -q --cpus=0 --sched=batch --nice=10 -e sh -- -c '
+grep "^Cpus_allowed_list:	0\$" /proc/self/status || exit 1
+set -- $(sed "s/.*) //" /proc/self/stat)
+test "${17}" = 10 -a "${39}" = 3' || exit 1
+
+run-build-container -q -P -n $(pwd)/config -e sh -- -c '
+set -- $(sed "s/.*) //" /proc/self/stat)
+test "${17}" = 5 -a "${39}" = 5' || exit 1
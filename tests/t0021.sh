@@ -0,0 +1,28 @@
+#!/bin/sh
+
+# --netns-pool: -N enters a network namespace made in advance
+
+pooled() {
+	grep " /run/build-container/netns/net\.[0-9]* .* nsfs " /proc/self/mountinfo |
+		sed 's/.* \(net:\[[0-9]*\]\) .*/\1/'
+}
+
+sudo "$TEST_SRC_DIR/run-build-container" --netns-pool=2 || exit 1
+pooled >before
+test $(wc -l <before) = 2 || exit 1
+
+sudo "$TEST_SRC_DIR/run-build-container" -q -N -e sh -- -c \
+	'readlink /proc/self/ns/net; cat /sys/class/net/lo/flags' >result || exit 1
+grep -xFf before result || exit 1
+test $(( $(tail -1 result) & 1 )) = 1 || exit 1
+
+# refilled in the background
+for i in 1 2 3 4 5 6 7 8 9 10; do
+	test $(pooled |wc -l) = 2 && break
+	sleep 1
+done
+test $(pooled |wc -l) = 2 || exit 1
+pooled |grep -xFf result && exit 1
+
+sudo "$TEST_SRC_DIR/run-build-container" --netns-pool=0 || exit 1
+test $(pooled |wc -l) = 0
@@ -0,0 +1,47 @@
+#!/bin/sh
+
+# union shared: concurrent containers use the same registered mount
+
+mkdir -p l1 l2 m
+echo a >l1/a
+echo b >l2/b
+echo '
+from l1
+from l2
+to m
+union shared
+' >config
+
+run-build-container -c -n $(pwd)/config |grep "^# mount 'union' '.*/m' overlay 0x0 0x2 " || exit 1
+
+sudo "$TEST_SRC_DIR/run-build-container" -q -n $(pwd)/config -e sh -- -c \
+	'stat -c %d m/a >first; sleep 3' &
+for i in 1 2 3 4 5; do
+	test -s first && break
+	sleep 1
+done
+sudo "$TEST_SRC_DIR/run-build-container" -q -n $(pwd)/config -e sh -- -c \
+	'cat m/a m/b; stat -c %d m/a' >result || exit 1
+wait $! || exit 1
+test "$(cat result)" = "a
+b
+$(cat first)" || exit 1
+
+# the last container unregistered it
+ls /run/build-container/mounts |grep '^union-' && exit 1
+
+# a registered mount of another identity under the key is not handed out
+rm first
+sudo "$TEST_SRC_DIR/run-build-container" -q -n $(pwd)/config -e sh -- -c \
+	'stat -c %d m/a >first; sleep 3' &
+for i in 1 2 3 4 5; do
+	test -s first && break
+	sleep 1
+done
+sudo sh -c 'for id in /run/build-container/mounts/union-*.id; do echo other >$id; done'
+sudo "$TEST_SRC_DIR/run-build-container" -q -n $(pwd)/config -e sh -- -c \
+	'stat -c %d m/a' >result || exit 1
+wait $! || exit 1
+test "$(cat result)" != "$(cat first)" || exit 1
+ls /run/build-container/mounts |grep '^union-' && exit 1
+exit 0
@@ -0,0 +1,33 @@
+#!/bin/sh
+
+# --log, --log-max, --log-time: the output of the container, also in a log
+
+run-build-container -c --log=out.log --log-max=1M --log-time=chunk >result || exit 1
+grep "^# log 'out.log' max 1048576 time chunk\$" result || exit 1
+
+run-build-container -q --log=$(pwd)/out.log -e sh -- -c \
+	'echo out; echo err >&2; exit 3' >stdout 2>stderr
+test $? = 3 || exit 1
+test "$(cat stdout)" = out -a "$(cat stderr)" = err || exit 1
+grep -x out out.log && grep -x err out.log || exit 1
+
+run-build-container -q -P --log=$(pwd)/time.log --log-time -e sh -- -c \
+	'echo one; echo two' >stdout || exit 1
+test "$(cat stdout)" = "one
+two" || exit 1
+grep -c '^\[ *[0-9]*\.[0-9]*\] [a-z]*$' time.log | grep -x 2 || exit 1
+
+run-build-container -q --log=$(pwd)/big.log --log-max=8k -e seq -- 10000 >stdout || exit 1
+test $(wc -l <stdout) = 10000 || exit 1
+test $(stat -c %s big.log.1) -le 8192 -a $(stat -c %s big.log) -le 8192 || exit 1
+test "$(tail -1 big.log)" = 10000
+
+# a process left in the background does not hold the launcher up
+timeout 10 run-build-container -q --log=$(pwd)/bg.log -e sh -- -c \
+	'echo before; sleep 30 & echo $! >bg; echo after' >stdout
+status=$?
+kill $(cat bg)
+test $status = 0 || exit 1
+test "$(cat stdout)" = "before
+after" || exit 1
+grep -x after bg.log
@@ -0,0 +1,30 @@
+#!/bin/sh
+
+# ephemeral: the overlay upper and work directories, removed in the background
+
+mkdir -p src m
+echo src >src/file
+echo '
+from! disk/upper
+from src
+work! disk/work
+to m
+overlay
+from disk/upper
+ephemeral
+from disk/work
+ephemeral
+' >config
+
+run-build-container -c -n $(pwd)/config |grep "^# ephemeral '.*/disk/upper'\$" || exit 1
+
+sudo "$TEST_SRC_DIR/run-build-container" -q -n $(pwd)/config -e sh -- -c '
+cd m && mkdir -p a/b && seq 1000 | while read i; do echo $i >a/b/$i; done' || exit 1
+
+# gone at once, the trash emptied later
+test -d disk -a ! -e disk/upper -a ! -e disk/work || exit 1
+for i in 1 2 3 4 5 6 7 8 9 10; do
+	test -z "$(ls -A disk/.build-container-trash)" && exit 0
+	sleep 1
+done
+exit 1
@@ -0,0 +1,16 @@
+#!/bin/sh
+
+# --perf-stat, --perf-stat-json: the performance counters of the container
+
+run-build-container -c --perf-stat=$(pwd)/perf >result || exit 1
+grep "^# perf-stat '.*/perf'\$" result || exit 1
+
+# the software counters work without a PMU, and count the children too
+run-build-container -q --perf-stat=$(pwd)/perf -e sh -- -c 'ls / >/dev/null' || exit 1
+grep '^perf\.task_clock_msec  *[0-9.]*$' perf || exit 1
+grep '^perf\.page_faults  *[1-9][0-9]*$' perf || exit 1
+grep '^perf\.cycles  *\([0-9]*\|not supported\)$' perf || exit 1
+
+run-build-container -q -P --perf-stat-json=/dev/fd/3 -e true 3>perf.json || exit 1
+grep '^  "perf.context_switches": [0-9]*,$' perf.json || exit 1
+test "$(head -1 perf.json)" = "{" -a "$(tail -1 perf.json)" = "}"
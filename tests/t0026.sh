@@ -0,0 +1,42 @@
+#!/bin/sh
+
+# --memoize: the second run with the same inputs restores the first one
+
+mkdir -p src out m
+echo a >src/a
+echo '
+to! ram
+mount tmpfs
+from! ram/upper
+from src
+work! ram/work
+to m
+overlay
+from ram/upper
+to out
+commit
+' >config
+
+run-build-container -c --memoize=$(pwd)/cache >result || exit 1
+grep "^# memoize '.*/cache'\$" result || exit 1
+
+step() {
+	sudo "$TEST_SRC_DIR/run-build-container" -q -n $(pwd)/config \
+		--memoize=$(pwd)/cache "$@" -e sh -- -c \
+		'echo run >>runs; date +%s%N >m/stamp; mkdir m/d; echo d >m/d/f'
+}
+
+step || exit 1
+first=$(cat out/stamp)
+rm -r out/*
+step || exit 1
+test "$(cat out/stamp)" = "$first" -a "$(cat out/d/f)" = d || exit 1
+test $(wc -l <runs) = 1 || exit 1
+
+# a changed input is a new key
+step -E X=1 || exit 1
+test $(wc -l <runs) = 2 || exit 1
+echo b >src/b
+step || exit 1
+test $(wc -l <runs) = 3 || exit 1
+test $(ls cache | wc -l) = 3
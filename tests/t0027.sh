@@ -0,0 +1,42 @@
+#!/bin/sh
+
+# --list: the running containers, registered by their parents
+
+sudo "$TEST_SRC_DIR/run-build-container" -q -P -e sh -- -c \
+	'touch started; while ! test -e done; do sleep 0.1; done' &
+while ! test -e started; do sleep 0.1; done
+
+sudo "$TEST_SRC_DIR/run-build-container" -v -v --list >result
+touch done
+wait $! || exit 1
+grep "^[0-9]* .* - sh -c touch started" result || exit 1
+grep '^processes [1-9]' result || exit 1
+grep "^cwd $(pwd)\$" result || exit 1
+
+sudo "$TEST_SRC_DIR/run-build-container" --list >result || exit 1
+! grep -q "touch started" result
+
+# and each run of --watch
+mkdir src
+sudo "$TEST_SRC_DIR/run-build-container" -q --watch=src -e sh -- -c \
+	'n=$(cat runs 2>/dev/null | wc -l); echo >>runs; touch started$n; while ! test -e done$n; do sleep 0.1; done; touch finished$n' &
+pid=$!
+for i in $(seq 50); do test -e started0 && break; sleep 0.1; done
+touch done0
+# the changes made while a run goes are its own
+for i in $(seq 50); do test -e finished0 && break; sleep 0.1; done
+sleep 0.5
+echo a >src/file
+for i in $(seq 50); do test -e started1 && break; sleep 0.1; done
+sudo "$TEST_SRC_DIR/run-build-container" --list >result
+touch done1
+kill -TERM $pid
+wait $pid
+grep -q "touch started\$n" result || exit 1
+
+# the stale sockets of the user are removed, though not theirs to remove
+stale=/run/build-container/running/999999999.sock
+sudo python3 -c 'import socket, sys; socket.socket(socket.AF_UNIX).bind(sys.argv[1])' $stale
+sudo chown $(id -u) $stale
+sudo "$TEST_SRC_DIR/run-build-container" --list >result || exit 1
+! test -e $stale
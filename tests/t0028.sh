@@ -0,0 +1,11 @@
+#!/bin/sh
+
+# -P with clone3(2): the program is pid 1; --proc-subset: only the processes in /proc
+
+sudo "$TEST_SRC_DIR/run-build-container" -q -P -e sh -- -c 'echo $$' >result || exit 1
+test "$(cat result)" = 1 || exit 1
+
+sudo "$TEST_SRC_DIR/run-build-container" -q --proc-subset -e sh -- -c \
+	'test ! -e /proc/meminfo && ls /proc' >result || exit 1
+grep -qx 1 result || exit 1
+! grep -qv '^[0-9a-z-]*$' result
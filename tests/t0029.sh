@@ -0,0 +1,24 @@
+#!/bin/sh
+
+# overlay precopy: the matching files are in the upper before the program starts
+
+mkdir -p src/db src/other up wrk m
+echo db >src/db/data
+echo big >src/archive.tar
+echo other >src/other/file
+echo '
+from up
+from src
+work wrk
+to m
+overlay precopy=db precopy=*.tar
+' >config
+
+run-build-container -c -n $(pwd)/config |grep "^# precopy 'db,\*.tar' in '.*/m'\$" || exit 1
+
+sudo "$TEST_SRC_DIR/run-build-container" -q -n $(pwd)/config -e sh -- -c \
+	"ls -A $(pwd)/up $(pwd)/up/db" >result || exit 1
+grep -qx data result || exit 1
+grep -qx archive.tar result || exit 1
+! grep -q other result || exit 1
+test "$(cat up/db/data)" = db
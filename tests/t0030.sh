@@ -0,0 +1,76 @@
+#!/bin/sh
+
+# --watch: run again, in a new pid namespace, when the watched tree changes
+
+mkdir -p src
+run-build-container -c --watch=src |grep -qx "# watch 'src'" || exit 1
+
+sudo "$TEST_SRC_DIR/run-build-container" -q --watch=src -e sh -- -c 'echo $$ >>runs' &
+pid=$!
+# the run is over a moment after its line: what it writes is its own
+wait_runs() {
+	for i in $(seq 50); do
+		test "$(wc -l <runs 2>/dev/null)" = $1 && sleep 0.3 && return 0
+		sleep 0.1
+	done
+	kill $pid
+	exit 1
+}
+wait_runs 1
+echo a >src/file
+wait_runs 2
+mkdir src/dir
+wait_runs 3
+echo b >src/dir/file
+wait_runs 4
+kill -TERM $pid
+wait $pid || exit 1
+test "$(sort -u runs)" = 1
+
+# its own changes during a run don't start the next one
+mkdir -p src3
+sudo "$TEST_SRC_DIR/run-build-container" -q --watch=src3 -e sh -- -c \
+	'echo $$ >>runs3; echo x >>src3/own' &
+pid=$!
+for i in $(seq 50); do test -s src3/own && break; sleep 0.1; done
+sleep 1
+kill -TERM $pid
+wait $pid
+test "$(wc -l <runs3)" = 1 || exit 1
+
+# but a change to a lower layer of its overlay does
+mkdir -p src2 m2
+echo "
+to! ram2
+mount tmpfs
+from! ram2/upper
+from $(pwd)/src2
+work! ram2/work
+to $(pwd)/m2
+overlay
+" >config2
+sudo "$TEST_SRC_DIR/run-build-container" -q -n $(pwd)/config2 --watch=src2 -e sh -- -c \
+	'echo $$ >>runs2; echo y >m2/own; test -e once || { touch once; while ! test -e go; do sleep 0.1; done; }' &
+pid=$!
+for i in $(seq 50); do test -e once && break; sleep 0.1; done
+echo x >src2/during
+touch go
+for i in $(seq 50); do
+	test "$(wc -l <runs2 2>/dev/null)" = 2 && break
+	sleep 0.1
+done
+sleep 1
+kill -TERM $pid
+wait $pid
+test "$(wc -l <runs2)" = 2 || exit 1
+
+# and a signal stops the running one
+sudo "$TEST_SRC_DIR/run-build-container" -q --watch=src2 -e sh -- -c \
+	'trap "exit 7" TERM; touch started; sleep 100 & wait' &
+pid=$!
+for i in $(seq 50); do test -e started && break; sleep 0.1; done
+kill -TERM $pid
+for i in $(seq 30); do kill -0 $pid 2>/dev/null || break; sleep 0.1; done
+! kill -0 $pid 2>/dev/null || { kill -KILL $pid; exit 1; }
+wait $pid
+test $? = 7
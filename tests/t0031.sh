@@ -0,0 +1,43 @@
+#!/bin/sh
+
+# --queue-daemon: one slot, the normal class before the low one, the status,
+# the standard output of the run
+
+sudo "$TEST_SRC_DIR/run-build-container" -q --queue-daemon=$(pwd)/queue --queue-slots=1 &
+daemon=$!
+for i in $(seq 50); do test -S queue && break; sleep 0.1; done
+
+run-build-container --queue=$(pwd)/queue -q -e sh -- -c \
+	'while ! test -e go; do sleep 0.1; done; echo first >>order' &
+sleep 0.5
+run-build-container --queue=$(pwd)/queue --queue-class=low -q -e sh -- -c \
+	'echo low >>order' &
+sleep 0.5
+run-build-container --queue=$(pwd)/queue -e sh -- -c \
+	'echo normal >>order; exit 3' 2>result &
+normal=$!
+sleep 0.5
+touch go
+wait $normal
+test $? = 3 || { kill $daemon; exit 1; }
+grep -q "queue: status 3, queued [0-9.]*s, ran [0-9.]*s" result || { kill $daemon; exit 1; }
+
+# a submission with the wrong descriptors is refused, and they are closed
+python3 -c '
+import os, select, socket, sys
+r, w = os.pipe()
+s = socket.socket(socket.AF_UNIX, socket.SOCK_SEQPACKET)
+s.connect(sys.argv[1])
+socket.send_fds(s, [b"x"], [w])
+os.close(w)
+print(s.recv(256).decode(), end="")
+sys.exit(0 if select.select([r], [], [], 5)[0] and not os.read(r, 1) else 1)
+' queue >result || { kill $daemon; exit 1; }
+grep -q "^error malformed submission" result || { kill $daemon; exit 1; }
+
+out=$(run-build-container --queue=$(pwd)/queue -q -e echo -- out)
+kill $daemon
+wait $daemon || exit 1
+test "$out" = out || exit 1
+test ! -e queue || exit 1
+test "$(cat order)" = "$(printf 'first\nnormal\nlow')"
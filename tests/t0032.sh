@@ -0,0 +1,22 @@
+#!/bin/sh
+
+# scratch: a file system of its own in an image of the pool, emptied at exit
+
+mkdir -p pool m
+echo "
+from $(pwd)/pool
+to $(pwd)/m
+scratch 32M ext4 nodev
+" >config
+
+run-build-container -c -n $(pwd)/config |grep -q "^# scratch '.*/m' 33554432 ext4 image '.*/pool'\$" || exit 1
+
+sudo "$TEST_SRC_DIR/run-build-container" -q -n $(pwd)/config -e sh -- -c '
+grep " $(pwd)/m .* ext4 " /proc/self/mountinfo &&
+stat -c "owner %u:%g" m &&
+dd if=/dev/zero of=m/data bs=1M count=8 status=none && sync' >result || exit 1
+grep -q noatime result || exit 1
+grep -qx "owner $(id -u):$(id -g)" result || exit 1
+test ! -e m/data || exit 1
+test "$(stat -c %s pool/scratch-0.img)" = 33554432 || exit 1
+test "$(stat -c %b pool/scratch-0.img)" = 0
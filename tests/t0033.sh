@@ -0,0 +1,22 @@
+#!/bin/sh
+
+# --drop-cache=outputs: the upper and the committed files are not cached at exit
+
+mkdir -p src up wrk m out
+echo "
+from $(pwd)/up
+from $(pwd)/src
+work $(pwd)/wrk
+to $(pwd)/m
+overlay
+from $(pwd)/up
+to $(pwd)/out
+commit
+" >config
+
+run-build-container -c --drop-cache=outputs -n $(pwd)/config |grep -qx "# drop-cache outputs" || exit 1
+
+sudo "$TEST_SRC_DIR/run-build-container" -q --drop-cache=outputs -n $(pwd)/config -e \
+	dd -- if=/dev/zero of=m/data bs=1M count=4 status=none || exit 1
+test "$(stat -c %s out/data)" = 4194304 || exit 1
+test "$(fincore -n -o PAGES up/data out/data | tr -d " \n")" = 00
@@ -0,0 +1,37 @@
+#!/bin/sh
+
+# image-union: a union of image files, mounted in parallel under the union
+
+mkdir -p top bottom m
+echo top >top/file
+echo bottom >bottom/file
+echo bottom >bottom/only
+mkfs.ext4 -q -d top top.img 4M || exit 1
+mkfs.ext4 -q -d bottom bottom.img 4M || exit 1
+echo "
+from $(pwd)/top.img
+from $(pwd)/bottom.img
+to $(pwd)/m
+image-union
+" >config
+
+run-build-container -c -n $(pwd)/config >result || exit 1
+grep -q "^# image '.*/bottom.img' (detected) on '.*/m/1'\$" result || exit 1
+grep -q "^# mount 'image-union' '.*/m' overlay 0x1 .*lowerdir=.*/m/0:.*/m/1'\$" result || exit 1
+
+sudo "$TEST_SRC_DIR/run-build-container" -q -n $(pwd)/config -e sh -- -c \
+	'cat m/file m/only; ls m; ! touch m/new' >result 2>/dev/null || exit 1
+test "$(head -2 result)" = "$(printf 'top\nbottom')" || exit 1
+! grep -qx 0 result
+
+# the images are attached read-only: on a read-only mount, and untouched
+mkdir ro
+cp top.img bottom.img ro/
+sum=$(cat ro/*.img | md5sum)
+sudo mount --bind ro ro && sudo mount -o remount,bind,ro ro || exit 1
+sed "s|$(pwd)/\([a-z]*\).img|$(pwd)/ro/\1.img|" config >config.ro
+sudo "$TEST_SRC_DIR/run-build-container" -q -n $(pwd)/config.ro -e cat -- m/file >result
+status=$?
+sudo umount ro
+test $status = 0 -a "$(cat result)" = top || exit 1
+test "$(cat ro/*.img | md5sum)" = "$sum" || exit 1
@@ -0,0 +1,45 @@
+#!/bin/sh
+
+# forward: a host cache daemon, reachable from the network namespace of -N
+
+echo "
+forward tcp:4226 unix:$(pwd)/cache.sock
+forward unix:@cache unix:$(pwd)/cache.sock
+forward unix:inside.sock unix:$(pwd)/cache.sock
+forward unix:@stuck unix:$(pwd)/stuck.sock
+" >config
+
+! run-build-container -c -n $(pwd)/config 2>/dev/null || exit 1
+run-build-container -c -N -n $(pwd)/config >result || exit 1
+grep -qx "# forward 'tcp:4226' to 'unix:$(pwd)/cache.sock'" result || exit 1
+grep -qx "# forward 'unix:@cache' to 'unix:$(pwd)/cache.sock'" result || exit 1
+
+# the stand-in daemon answers each line, until the other end is done
+perl -MIO::Socket::UNIX -e '
+	my $s = IO::Socket::UNIX->new(Local => "cache.sock", Listen => 8) or die;
+	open(my $ready, ">", "ready"); close($ready);
+	while (my $c = $s->accept) {
+		print $c "hit $_" while <$c>;
+		close($c);
+	}' &
+daemon=$!
+# and one that never accepts: its backlog fills up
+perl -MIO::Socket::UNIX -e '
+	my $s = IO::Socket::UNIX->new(Local => "stuck.sock", Listen => 1) or die;
+	sleep 60;' &
+stuck=$!
+trap 'kill $daemon $stuck' EXIT
+for i in $(seq 50); do test -e ready && test -e stuck.sock && break; sleep 0.1; done
+
+timeout 30 sudo "$TEST_SRC_DIR/run-build-container" -q -N -n $(pwd)/config -e perl -- -MIO::Socket -e '
+	my @stuck = map { IO::Socket::UNIX->new(Peer => "\0stuck") } 1..4;
+	for my $c (sub { IO::Socket::INET->new("127.0.0.1:4226") },
+		   sub { IO::Socket::UNIX->new(Peer => "\0cache") },
+		   sub { IO::Socket::UNIX->new(Peer => "inside.sock") }) {
+		$c = &$c or die;
+		print $c "key$_\n" for 1..3;
+		$c->shutdown(1);
+		print while <$c>;
+	}' >result || exit 1
+test "$(cat result)" = "$(printf 'hit key%s\n' 1 2 3 1 2 3 1 2 3)" || exit 1
+! test -e inside.sock || exit 1